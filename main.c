@@ -1,19 +1,577 @@
+#define _POSIX_C_SOURCE 200809L  // For clock_gettime, fdopen and pthread_condattr_setclock, also under -std=c11
+#define _DEFAULT_SOURCE  // For MAP_ANONYMOUS, which POSIX does not name
+
 #include <stdint.h>   // For fixed-width integer types like uint8_t and uint16_t
+#include <stddef.h>   // For offsetof, used to copy CPU state around the memory array
 #include <stdio.h>    // For input/output functions like printf
 #include <stdlib.h>   // For functions like exit
 #include <assert.h>   // For the assert macro used in testing
+#include <string.h>   // For memcmp used when grouping instances
+#include <unistd.h>   // For write, used to send each terminal frame in one call
+#include <stdatomic.h> // For the lock-free audio ring shared with the audio thread
+#include <pthread.h>  // For the worker threads that play movies in parallel
+#include <time.h>     // For clock_gettime, used to measure resume latency
+#include <sys/mman.h> // For the shared page the fork server's children report through
+#include <sys/wait.h> // For waitpid, used to reap fork server children
+#include <signal.h>   // For SIGALRM, which ends fork server children that outlive their time limit
+#include <errno.h>    // For EOWNERDEAD, reported when a fork server child died holding the response lock
+#include <sched.h>    // For sched_yield, used by the page store check in main() while readers hold old versions
+
+#define MEMORY_SIZE 4096            // Addressable memory (addresses 0x000 to 0xFFF)
+#define MEMORY_GUARD 1              // Zero bytes past the end, so fetching at 0xFFF stays inside the array
+#define ADDRESS_MASK 0x0FFF         // Addresses and the PC wrap around at 12 bits
+#define PAGE_SIZE 64                // Bytes per page tracked for snapshots
+#define MEMORY_PAGES (MEMORY_SIZE / PAGE_SIZE)  // 64 pages: one bit each in a uint64_t
+#define CYCLES_PER_TICK 10          // Instructions per 60 Hz timer tick (a 600 Hz guest clock)
+#define DISPLAY_WIDTH 128           // SUPER-CHIP hi-res width; lo-res 64x32 pixels are drawn as 2x2 blocks
+#define DISPLAY_HEIGHT 64
+
+// Write generations per page, so each consumer keeps its own mark and finds the pages written since,
+// and the latest write to the sound timer, so audio can switch at the exact instruction
+typedef struct {
+    uint64_t clock;                 // Bumped by every store; a consumer's mark is a value of it
+    uint64_t page[MEMORY_PAGES];    // Clock of the latest write to each page; 0 if never written
+    uint64_t sound_cycles;          // Guest clock at the latest FX18; 0 if never executed
+    uint8_t sound_value;            // Value that FX18 wrote
+} WriteClock;
 
 // Define a CPU structure to represent the state of the emulator
 typedef struct {
     uint8_t registers[16];          // An array of 16 8-bit general-purpose registers (V0 to VF)
-    size_t position_in_memory;      // Program counter ("PC")
-    uint8_t memory[4096];           // Memory array of 4096 bytes (addresses 0x000 to 0xFFF)
+    uint16_t position_in_memory;    // Program counter ("PC"), always kept within ADDRESS_MASK
+    uint16_t index;                 // I: address register for memory loads and stores
+    uint8_t memory[MEMORY_SIZE + MEMORY_GUARD];  // Memory array of 4096 bytes plus guard padding that must stay zero
     uint16_t stack[16];             // A stack for storing return addresses (used by CALL and RET)
     size_t stack_pointer;           // Points to the next free slot in the stack
+    uint8_t delay_timer;            // DT: counts down once per tick while non-zero
+    uint8_t sound_timer;            // ST: counts down once per tick while non-zero
+    uint16_t keys;                  // Bit k is set while hex key k is held
+    uint64_t cycles;                // Instructions executed so far: the guest's virtual clock
+    uint64_t display[DISPLAY_HEIGHT][2];  // 128x64 framebuffer: two words per row, MSB of word 0 is the leftmost pixel
+    uint8_t hires;                  // 1 in 128x64 mode (00FF), 0 in 64x32 mode (00FE)
+    WriteClock writes;              // When each page was last written; nothing ever clears it
 } CPU;
 
+// Results of run_for()
+#define RUN_HALTED 0                // A HALT instruction was executed
+#define RUN_BUDGET 1                // The instruction budget ran out
+#define RUN_IDLE 2                  // The budget ran out in a wait loop that only input can end
+#define RUN_OUT_OF_GAS 3            // The next instruction costs more gas than is left; it was not executed
+
+#define IDLE_LOOP_MAX 32            // Longest loop body, in instructions, considered for fast-forward
+
+#define BITSLICE_LANES 64           // Instances packed into one uint64_t per register bit
+
+// Bitsliced view of up to 64 CPU instances that share PC, stack and memory
+typedef struct {
+    uint64_t planes[16][8];         // planes[x][b]: bit b of register Vx, one bit per instance
+    uint64_t live;                  // Lanes that hold an instance
+    uint64_t active;                // Lanes at the shared PC; the others were skipped one instruction past it
+    uint64_t skipped[32];           // Bitsliced per-lane count of instructions skipped (not executed)
+    uint64_t start_cycles;          // Clock when the lanes were loaded; per-lane clocks are rebuilt from it
+    uint8_t start_delay_timer;
+    uint8_t start_sound_timer;
+    uint64_t start_writes;          // shared.writes.clock when loaded, to find the pages the lanes wrote
+    CPU shared;                     // State common to all lanes (registers unused)
+} BitslicedCPU;
+
+#define IR_BLOCK_MAX 64             // Longest run of guest instructions translated into one block
+#define IR_HOT_THRESHOLD 4          // Executions of a block before it is kept in the cache
+#define VECTOR_LANES 32             // Byte lanes per group: one 256-bit vector per register
+
+// A fixed-size micro-op: exactly one guest instruction with explicit operands
+typedef struct {
+    uint8_t kind;                   // One of the UOP_* kinds below
+    uint8_t dst;                    // Register written (or compared)
+    uint8_t src;                    // Register read
+    uint8_t imm;                    // 8-bit immediate
+    uint8_t flags;                  // UOP_DEF_VF if the op also writes VF
+    uint8_t gas;                    // Gas charged for the guest instruction (0 until the block is metered)
+    uint16_t target;                // Jump/call target, or resume address for UOP_FALLTHROUGH
+} MicroOp;
+
+enum {
+    UOP_LD_K, UOP_LD_Y, UOP_ADD_K, UOP_OR, UOP_AND, UOP_XOR, UOP_ADD_XY,
+    UOP_SE_K, UOP_SNE_K, UOP_SE_Y,                                 // Skip the next op when taken
+    UOP_JMP, UOP_CALL, UOP_RET, UOP_HALT, UOP_EXIT, UOP_FALLTHROUGH, // Terminators: always the last op
+    UOP_CALL_UNCHECKED, UOP_RET_UNCHECKED,                         // CALL/RET proven unable to overflow/underflow
+    UOP_KIND_COUNT
+};
+
+#define UOP_DEF_VF 0x01             // Op writes VF after its destination
+
+// A translated block: op i is the guest instruction at (start_pc + 2 * i) & ADDRESS_MASK
+typedef struct {
+    uint16_t start_pc;              // Guest address of the first op
+    uint16_t length;                // Ops in the block, terminator included
+    MicroOp ops[IR_BLOCK_MAX + 1];  // Room for a UOP_FALLTHROUGH after a full block
+    uint32_t gas;                   // Sum of the ops' gas, charged once at block entry
+} IrBlock;
+
+// Opcode classes that gas costs are configured for
+enum {
+    GAS_HALT, GAS_ALU, GAS_SKIP, GAS_JUMP, GAS_CALL, GAS_RET, GAS_DISPLAY, GAS_TIMER, GAS_KEY, GAS_MEMORY,
+    GAS_OTHER, GAS_CLASS_COUNT
+};
+
+// Instructions as decode_opcode() names them; every engine and analysis decodes through it
+enum {
+    OP_HALT, OP_CLS, OP_SCROLL_DOWN, OP_SCROLL_RIGHT, OP_SCROLL_LEFT, OP_LORES, OP_HIRES, OP_RET, OP_JMP, OP_CALL,
+    OP_SE_K, OP_SNE_K, OP_SE_Y, OP_LD_K, OP_ADD_K, OP_LD_Y, OP_OR, OP_AND, OP_XOR, OP_ADD_XY, OP_LD_I,
+    OP_DRAW, OP_SKP, OP_SKNP, OP_LD_DT_TO_V, OP_LD_KEY, OP_LD_V_TO_DT, OP_LD_V_TO_ST, OP_ADD_I, OP_BCD, OP_STORE_REGS,
+    OP_LOAD_REGS, OP_UNKNOWN, OP_COUNT
+};
+
+#define OPF_SKIP 0x01               // May skip the next instruction
+#define OPF_WAIT 0x02               // Allowed in a wait loop: touches only registers, input and reads of the delay timer
+#define OPF_READS_DT 0x04           // Reads the delay timer
+#define OPF_PUSH 0x08               // Pushes a return address; execute() exits when the stack is full
+#define OPF_POP 0x10                // Pops a return address; execute() exits when the stack is empty
+#define OPF_LOADS 0x20              // Reads opcode_memory_span() bytes at I besides the fetch
+#define OPF_STORES 0x40             // Writes opcode_memory_span() bytes at I
+
+// What the rest of the emulator needs to know about an instruction without running it
+typedef struct {
+    uint8_t gas_class;              // GAS_* class its cost is configured by
+    uint8_t flags;                  // OPF_* bits
+} OpInfo;
+
+// Cost of each opcode class; a cost of 0 is charged as 1, so that gas always runs out
+typedef struct {
+    uint8_t cost[GAS_CLASS_COUNT];
+} GasSchedule;
+
+// Result of the static call-depth analysis from one entry point
+typedef struct {
+    uint16_t entry;                 // Address the analysis started from
+    uint8_t bounded;                // 1 if call depth is bounded and RET can never underflow
+    uint8_t max_depth;              // Deepest call nesting reachable from entry (when bounded)
+    uint64_t code_pages;            // Pages holding the instructions the proof walked
+} StackAnalysis;
+
+// Translated blocks for one ROM image, indexed by guest address and shared by every backend
+typedef struct {
+    uint8_t memory[MEMORY_SIZE + MEMORY_GUARD];  // ROM the blocks were translated from
+    uint8_t elide_stack_checks;     // Blocks use unchecked CALL/RET; valid only when entered through stack.entry
+    const GasSchedule *schedule;    // Costs stamped into translated blocks, or NULL when unmetered
+    StackAnalysis stack;            // Proof backing elide_stack_checks
+    IrBlock *blocks[MEMORY_SIZE];   // Cached block starting at each address, once hot
+    uint32_t heat[MEMORY_SIZE];     // Executions seen before caching
+    uint64_t code_pages;            // Pages any cached block was translated from
+    uint8_t frozen;                 // Never allocate or free blocks: new code runs from scratch translations (forked children)
+    const CPU *synced;              // Instance memory was last synced from, or NULL
+    uint64_t synced_writes;         // Its writes.clock at that sync
+    uint64_t invalidated;           // Blocks dropped because guest stores rewrote their code
+    uint64_t compiled;              // Blocks translated and cached
+    uint64_t hits;                  // Block executions served from the cache
+    uint64_t cold;                  // Block executions translated on the fly
+} IrCache;
+
+// Structure-of-arrays view of up to VECTOR_LANES instances that share PC, stack and memory
+typedef struct {
+    uint8_t registers[16][VECTOR_LANES];  // registers[x][lane] holds Vx of each instance
+    uint8_t live[VECTOR_LANES];           // 0xFF for lanes that hold an instance
+    uint8_t skip[VECTOR_LANES];           // 0xFF for lanes that skip the instruction at PC
+    uint32_t skipped[VECTOR_LANES];       // Instructions each lane skipped (not executed)
+    uint64_t start_cycles;                // Clock when the lanes were gathered
+    uint8_t start_delay_timer;
+    uint8_t start_sound_timer;
+    uint64_t start_writes;                // shared.writes.clock when gathered
+    CPU shared;                           // State common to all lanes (registers unused)
+} VectorGroup;
+
+// Lane utilization counters for run_regrouped(): how full its PC-regrouped lockstep groups ran
+typedef struct {
+    uint64_t vector_steps;          // Group steps issued, one per instruction a group ran
+    uint64_t lane_slots;            // Lanes offered by those steps (steps x width)
+    uint64_t active_lanes;          // Lanes that actually executed an instruction
+    uint64_t regroups;              // Times instances were re-bucketed into fresh groups
+} LaneStats;
+
+#define VIDEO_Y4M 0                 // YUV4MPEG2 stream, monochrome luma plane; repeats as an XREPEAT=n frame parameter
+#define VIDEO_PBM 1                 // Concatenated binary PBM (P4) images; repeats as a "# repeat n" header comment
+#define VIDEO_BUFFER_SIZE (1 << 20) // Output is gathered and written in chunks of this size
+
+// Headless exporter turning framebuffer frames into a raw video stream
+typedef struct {
+    FILE *file;                     // Destination stream
+    int format;                     // VIDEO_Y4M or VIDEO_PBM
+    int scale;                      // Every pixel becomes scale x scale output pixels
+    uint8_t *buffer;                // Pending output, flushed with one large fwrite
+    size_t used;                    // Bytes pending in buffer
+    uint8_t *frame;                 // Pixel data of the last frame, held back until its repeat count is known
+    size_t frame_size;              // Bytes in frame
+    uint64_t last[DISPLAY_HEIGHT][2];  // Framebuffer that produced frame
+    int pending;                    // 1 while frame has not been emitted
+    uint64_t repeats;               // Frames after it with the same framebuffer, so far
+    uint64_t frames;                // Frames written
+    uint64_t duplicates;            // Frames folded into the previous frame's repeat count
+} VideoExporter;
+
+#define TERMINAL_ROWS (DISPLAY_HEIGHT / 2)  // Each character cell shows two pixel rows as a half block
+#define TERMINAL_BUFFER_SIZE 32768  // Enough for a full redraw of every cell
+
+// Terminal renderer that sends only the cells that changed since the previous frame
+typedef struct {
+    int fd;                         // Terminal file descriptor
+    uint64_t shown[DISPLAY_HEIGHT][2];  // Framebuffer currently on the terminal
+    int valid;                      // 0 forces a full redraw (first frame, or after a resize)
+    char *buffer;                   // Escape sequences for one frame, sent with a single write
+    uint64_t frames;                // Frames rendered
+    uint64_t cells_sent;            // Cells emitted, including short runs of unchanged filler
+    uint64_t bytes_sent;            // Bytes written to the terminal
+} TerminalRenderer;
+
+#define AUDIO_RING_SIZE 8192        // Samples in the audio ring (a power of two)
+#define AUDIO_BLOCK 256             // Samples generated per block before publishing to the ring
+#define AUDIO_AMPLITUDE 8000        // Peak level of the 16-bit tone
+#define CYCLES_PER_SECOND (CYCLES_PER_TICK * 60)  // Guest instructions per second of virtual time
+
+// Single-producer single-consumer ring of mono 16-bit samples
+typedef struct {
+    int16_t samples[AUDIO_RING_SIZE];
+    _Atomic size_t head;            // Next slot the emulation thread writes (producer only)
+    _Atomic size_t tail;            // Next slot the audio sink reads (consumer only)
+    uint64_t overruns;              // Samples dropped because the ring was full (producer only)
+    uint64_t underruns;             // Silent samples the sink had to insert (consumer only)
+} AudioRing;
+
+// PCM generator driven by the sound timer, playing an XO-CHIP style 1-bit pattern
+typedef struct {
+    AudioRing *ring;                // Destination of the generated samples
+    uint32_t sample_rate;           // Output samples per second
+    uint8_t pattern[16];            // 128-bit waveform, most significant bit first
+    uint8_t pitch;                  // Pattern playback rate is 4000 * 2^((pitch - 64) / 48) bits/s
+    uint32_t phase;                 // Position in the pattern, in 1/65536ths of a bit
+    uint64_t start_cycles;          // Guest clock when generation started
+    uint64_t samples;               // Samples accounted for since start_cycles
+    uint64_t timer_cycles;          // Guest clock samples have been generated up to
+    uint8_t timer;                  // Sound timer at timer_cycles
+} AudioGenerator;
+
+// WAV file sink that drains the ring for headless runs
+typedef struct {
+    FILE *file;                     // Output file, seekable so the header can be completed
+    uint32_t sample_rate;           // Samples per second written in the header
+    uint64_t data_bytes;            // Sample bytes written so far
+} WavSink;
+
+#define CYCLES_PER_FRAME CYCLES_PER_TICK  // Instructions per 60 Hz frame; movie input changes only between frames
+#define MOVIE_MAGIC "C8MV"          // First bytes of a movie file
+
+// A run of consecutive frames with the same keys held
+typedef struct {
+    uint32_t frames;                // Length of the run in frames
+    uint16_t keys;                  // Key bitmask held throughout the run
+} MovieRun;
+
+// Recorded input: frame-indexed key bitmasks, run-length encoded
+typedef struct {
+    MovieRun *runs;                 // Runs in playback order
+    size_t count;                   // Runs in use
+    size_t capacity;                // Runs allocated
+    uint64_t frames;                // Total frames
+} InputMovie;
+
+// Snapshot of one CPU, kept in sync by copying only the pages written since the last take or restore
+typedef struct {
+    CPU state;                      // Saved machine state
+    int valid;                      // 0 until the first take; the first take copies all of memory
+    uint64_t mark;                  // The CPU's writes.clock as of the last take or restore
+} CpuSnapshot;
+
+// Run-ahead driver: each frame is run for real, then speculatively ahead to produce the frame shown
+typedef struct {
+    CpuSnapshot snapshot;           // Real state at the end of the latest real frame
+    int frames_ahead;               // Frames run speculatively with the current input
+    uint64_t display[DISPLAY_HEIGHT][2];  // Speculative framebuffer to present
+    uint8_t hires;                  // Display mode of the speculative frame
+    uint64_t pages_copied;          // Pages moved by snapshot takes and restores
+} RunAhead;
+
+#define ROLLBACK_FRAMES 16          // Frames of history kept for late input corrections
+
+// One frame of rollback history: the state it started from and the pages it overwrote
+typedef struct {
+    CPU start;                      // State at the start of the frame (memory is not used)
+    uint16_t keys;                  // Input the frame was simulated with
+    uint64_t pages;                 // Pages the frame wrote
+    uint8_t undo[MEMORY_PAGES][PAGE_SIZE];  // Contents of those pages before the frame
+} RollbackFrame;
+
+// Ring of per-frame history that lets a late input rewrite the recent past
+typedef struct {
+    RollbackFrame frames[ROLLBACK_FRAMES];  // Indexed by frame number modulo ROLLBACK_FRAMES
+    CpuSnapshot shadow;             // Memory as it was at the start of the current frame
+    uint64_t frame;                 // Number of the next frame to simulate
+    uint64_t first;                 // Oldest frame still in the ring
+    uint64_t rollbacks;             // Corrections that changed history
+    uint64_t resimulated;           // Frames simulated again because of corrections
+} Rollback;
+
+#define RESULT_NONE ((size_t)-1)    // Empty link in the result cache's lists
+#define RESULT_MAGIC "C8RC"         // First bytes of a disk tier entry
+#define RESULT_VERSION 1            // Disk tier format: header, then a migration blob relative to blank memory
+#define RESULT_HEADER (4 + 2 + 4 + 4)  // Magic, version, RUN_* status, blob size
+
+// Content address of a job: two independently seeded 64-bit hashes of ROM, start state and input
+typedef struct {
+    uint64_t hash[2];
+} JobKey;
+
+// One cached job result, linked into a hash bucket chain and the LRU list
+typedef struct {
+    JobKey key;                     // Job this result belongs to
+    CPU result;                     // Final state after playing the job's input
+    int status;                     // RUN_* status the job ended with
+    size_t chain;                   // Next entry in the same hash bucket
+    size_t newer;                   // Neighbour towards the most recently used end
+    size_t older;                   // Neighbour towards the least recently used end
+} ResultEntry;
+
+// Cache of whole-job results: an in-memory LRU in front of an optional on-disk tier
+// A cache is not locked: use each one from a single thread. Processes may share a directory, since
+// entries are published whole by rename()
+typedef struct {
+    ResultEntry *entries;           // Fixed pool of capacity entries
+    size_t capacity;                // Results kept in memory
+    size_t used;                    // Entries of the pool handed out so far
+    size_t *buckets;                // Head entry of each hash chain; bucket count is a power of two
+    size_t bucket_mask;             // Bucket count minus one
+    size_t newest;                  // Most recently used entry
+    size_t oldest;                  // Least recently used entry, evicted first
+    const char *directory;          // Directory of the disk tier, or NULL for memory only
+    uint64_t lookups;               // Lookups made
+    uint64_t hits;                  // Lookups answered from memory
+    uint64_t disk_hits;             // Lookups answered from disk
+} ResultCache;
+
+#define CHECKPOINT_INTERVAL 32      // Frames of input between checkpoints along a job
+
+// State after a given input prefix: one node of the checkpoint trie
+typedef struct {
+    JobKey key;                     // Content address of the start state and every frame of input in the prefix
+    uint64_t frames;                // Prefix length in frames
+    size_t parent;                  // Checkpoint one interval shorter on the same prefix, or RESULT_NONE
+    uint32_t children;              // Checkpoints that extend this one; only leaves are evicted
+    size_t newer;                   // Leaf list neighbour towards the most recently used end (leaves only)
+    size_t older;                   // Leaf list neighbour towards the least recently used end (leaves only)
+    size_t chain;                   // Next node in the same hash bucket
+    int status;                     // RUN_* status at this point; RUN_HALTED ends every extension
+    CPU state;                      // Machine state after the prefix
+} Checkpoint;
+
+// Trie of checkpoints shared between jobs whose inputs start the same way, bounded by LRU leaf eviction
+typedef struct {
+    Checkpoint *nodes;              // Fixed pool of capacity nodes
+    size_t capacity;                // Checkpoints kept at most
+    size_t used;                    // Nodes of the pool handed out so far
+    size_t *buckets;                // Head node of each hash chain
+    size_t bucket_mask;             // Bucket count minus one
+    size_t newest;                  // Most recently used leaf
+    size_t oldest;                  // Least recently used leaf, evicted first
+    uint64_t jobs;                  // Jobs run through the trie
+    uint64_t frames_resumed;        // Frames skipped by restoring a checkpoint
+    uint64_t frames_run;            // Frames executed
+    uint64_t evictions;             // Leaves dropped to make room
+} CheckpointTrie;
+
+#define LZ_MIN_MATCH 4              // Shortest back-reference the LZ codec emits
+#define LZ_HASH_BITS 12             // Match finder table: 4096 recent positions
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)  // Worst-case compressed size of n bytes
+
+#define PARK_LIVE 0                 // Instance is uncompressed and may run
+#define PARK_QUEUED 1               // Idle long enough; waiting for the background compressor
+#define PARK_BUSY 2                 // Being compressed right now
+#define PARK_PARKED 3               // Held only in compressed form
+
+#define POOL_NONE 0xFFFFFFFFu        // Empty link in the shared page pool
+#define POOL_BUCKETS 4096           // Hash buckets of the shared page pool (a power of two)
+#define POOL_SIGHTINGS 4096         // Unique parked pages remembered by hash, so a second copy is noticed (a power of two)
+
+// One deduplicated memory page, shared by every parked instance holding the same bytes
+typedef struct {
+    uint8_t data[PAGE_SIZE];        // Page contents
+    uint64_t hash;                  // hash64 of data
+    uint32_t refs;                  // Parked instances referring to the page; 0 means free
+    uint32_t chain;                 // Next page in the same bucket, or the next free page
+} SharedPage;
+
+// Content-addressed pool of reference-counted pages
+typedef struct {
+    SharedPage *pages;              // Pages by id; ids stay valid as the array grows
+    uint32_t count;                 // Ids handed out so far
+    uint32_t capacity;              // Pages allocated
+    uint32_t free_list;             // First page released for reuse
+    uint32_t live;                  // Pages with references: PAGE_SIZE bytes each are held here
+    uint32_t buckets[POOL_BUCKETS]; // First page of each hash chain
+} PagePool;
+
+// A page seen in only one parked instance so far; it stays in that instance's blob
+typedef struct {
+    uint64_t hash;                  // hash64 of the page
+    size_t slot;                    // Slot holding it, or RESULT_NONE for an empty entry
+} PageSighting;
+
+// One instance that can be parked: either a live CPU or a compressed image of it
+typedef struct {
+    CPU *cpu;                       // Live state, NULL while parked
+    uint8_t *blob;                  // Compressed state while parked
+    size_t blob_size;               // Bytes in blob
+    int state;                      // PARK_* state, guarded by the lot's lock
+    uint32_t idle_runs;             // Consecutive runs that ended idle, waiting on input
+    uint8_t in_queue;               // 1 while the slot has an entry in the compressor's queue
+    uint8_t scanned;                // 1 once the deduplicator has moved its duplicated pages into the pool
+    uint64_t shared_pages;          // Pages held in the lot's pool rather than in blob
+    uint32_t page_ids[MEMORY_PAGES];  // Pool id of each page in shared_pages
+} ParkSlot;
+
+// Instances plus the background thread that compresses the ones left idle
+typedef struct {
+    ParkSlot *slots;                // One slot per instance
+    size_t count;                   // Number of instances
+    uint32_t idle_threshold;        // Idle runs in a row before an instance is parked
+    size_t *queue;                  // Ring of slots waiting to be compressed
+    size_t queue_head;              // Next queued slot to compress
+    size_t queue_tail;              // Where the next slot is queued
+    pthread_mutex_t lock;           // Guards slot states, the queue and the metrics
+    pthread_cond_t work;            // Signals the compressor that the queue is not empty
+    pthread_cond_t parked;          // Signals resumers that a compression finished
+    pthread_t compressor;           // Background compression thread
+    int stopping;                   // Set to make the compressor exit
+    uint64_t parked_instances;      // Instances currently parked
+    uint64_t parked_bytes;          // Compressed blob bytes currently held; the pool adds pool.live * PAGE_SIZE
+    uint64_t parks;                 // Compressions done
+    uint64_t resumes;               // Decompressions done
+    uint64_t resume_ns_total;       // Time spent in resumes
+    uint64_t resume_ns_max;         // Slowest resume
+    PagePool pool;                  // Pages shared between parked instances, guarded by lock
+    double dedup_rate;              // Pages the deduplicator may hash per second; 0 disables it
+    double dedup_tokens;            // Pages it may hash right now (refilled at dedup_rate)
+    uint64_t dedup_refill_ns;       // When the tokens were last refilled
+    size_t dedup_cursor;            // Next slot the deduplicator looks at
+    uint64_t dedup_scanned_pages;   // Pages hashed by the deduplicator
+    uint64_t reclaimed_bytes;       // Page bytes no longer stored because another instance holds the same page
+    PageSighting sightings[POOL_SIGHTINGS];  // Direct-mapped by hash, guarded by lock
+} ParkingLot;
+
+#define MIGRATION_MAGIC 0x4D38  // "8M": first field of a migration blob
+#define MIGRATION_MAX_BLOB (64 + MEMORY_SIZE + 8 + LZ_BOUND(sizeof(((CPU *)0)->display)))  // Largest blob
+#define FORK_JOB_SECONDS 10         // Wall-clock limit per fork server job; SIGALRM ends a child still running
+#define FORK_MAX_CHILDREN 8         // Jobs a fork server runs at once; it reads the next request only below this
+
+// Counters kept by the fork server
+typedef struct {
+    uint64_t jobs;                  // Jobs served by a forked child
+    uint64_t failures;              // Jobs that could not be forked or whose child failed
+    uint64_t timeouts;              // Failed jobs whose child hit FORK_JOB_SECONDS
+    uint64_t startup_ns_total;      // Request read to first guest instruction, summed over jobs
+    uint64_t startup_ns_max;        // Slowest time to first guest instruction
+} ForkServerStats;
+
+#define SHA256_SIZE 32              // Bytes in a SHA-256 digest
+#define SHA256_LANES 8              // Messages hashed side by side: eight 32-bit words fill a 256-bit vector
+#define MERKLE_DEPTH 6              // Levels from a page leaf up to the page root: log2(MEMORY_PAGES)
+#define MERKLE_MESSAGE_SIZE 65      // Every node hashes a domain byte plus 64 bytes (a page, a framebuffer band, two children or a register leaf)
+#define MERKLE_BATCH 128            // Messages a commit queues before hashing them, a multiple of SHA256_LANES
+#define MERKLE_DISPLAY_LEAVES 16    // Framebuffer bands of PAGE_SIZE bytes: four 128-pixel rows each
+#define MERKLE_DISPLAY_DEPTH 4      // Levels from a band leaf up to the framebuffer root: log2(MERKLE_DISPLAY_LEAVES)
+
+// Incremental Merkle commitment to one instance: a tree over the memory pages, joined with a state subtree of
+// two register leaves and a tree over the framebuffer bands
+typedef struct {
+    uint8_t nodes[2 * MEMORY_PAGES][SHA256_SIZE];  // Heap order: nodes[1] covers all pages, page p's leaf is nodes[MEMORY_PAGES + p]
+    uint8_t display[2 * MERKLE_DISPLAY_LEAVES][SHA256_SIZE];  // Heap order over framebuffer bands; display[1] covers the framebuffer
+    uint8_t leaves[2][SHA256_SIZE]; // Leaf over registers, PC, I, live stack, timers, keys and display mode; leaf over stack pointer and clock
+    uint8_t core[SHA256_SIZE];      // Hash of the two register leaves
+    uint8_t state[SHA256_SIZE];     // Hash of core and display[1]: everything but memory
+    uint8_t root[SHA256_SIZE];      // The commitment: hash of nodes[1] and state
+    const CPU *synced;              // Instance the last commit hashed, or NULL; any other instance rehashes every page
+    uint64_t mark;                  // Its writes.clock at that commit: pages written after it are rehashed
+    uint8_t shadow_state[2][MERKLE_MESSAGE_SIZE];  // Register leaf messages as of the last commit
+    uint64_t shadow_display[DISPLAY_HEIGHT][2];  // Framebuffer as of the last commit: display writes have no clock
+    uint64_t stale;                 // Pages to rehash whatever the write clock says: all before the first commit
+    uint64_t changed;               // During a commit: page nodes of the level being rehashed; at the top, bit 0 is the page root
+    uint64_t display_changed;       // During a commit: framebuffer nodes of the level being rehashed
+    uint64_t hashes;                // SHA-256 messages hashed for this tree
+} MerkleTree;
+
+// Commitments to a run's state at regular steps, plus stored states to replay any part of it
+typedef struct {
+    uint64_t interval;              // Instructions between commitments
+    uint64_t checkpoint_every;      // Commitments between stored states
+    uint8_t (*roots)[SHA256_SIZE];  // roots[k]: commitment after k * interval instructions
+    size_t count;                   // Commitments recorded
+    size_t capacity;                // Commitments allocated
+    CPU *checkpoints;               // checkpoints[j]: state after j * checkpoint_every * interval instructions
+    size_t checkpoint_count;        // States stored
+    size_t checkpoint_capacity;     // States allocated
+    uint64_t steps;                 // Instructions executed since the start of the trace
+    uint8_t halted;                 // 1 once the run executed HALT; the trace is then complete
+    uint8_t end_root[SHA256_SIZE];  // Commitment to the state where the run stopped
+    MerkleTree tree;                // Incremental commitment to the running instance
+} ExecutionTrace;
+
+// Evidence for one disputed instruction: anyone can rerun it and compare the commitments
+typedef struct {
+    uint64_t step;                  // Instructions executed before this one
+    uint16_t opcode;                // Instruction at the pre-state's PC
+    uint8_t pre_root[SHA256_SIZE];  // Prover's commitment before the instruction (step_verify does not trust it)
+    uint8_t post_root[SHA256_SIZE]; // Prover's commitment after it
+    CPU pre;                        // Full state before the instruction; keys are the run's agreed input
+} StepProof;
+
+// Counters kept by the optimistic transaction engine
+typedef struct {
+    uint64_t incarnations;          // Transaction executions, including re-executions
+    uint64_t validations;           // Read set validations
+    uint64_t aborts;                // Incarnations whose reads turned out stale
+    uint64_t dependencies;          // Reads that found an aborted write and waited for its re-execution
+} StmStats;
+
+#define STORE_VERSIONS 1024         // Versions a page store can retain at once (a power of two)
+#define STORE_READERS 64            // Readers that can hold a snapshot at the same time
+#define STORE_LATEST UINT64_MAX     // Asks store_open for the newest version
+#define STORE_IDLE UINT64_MAX       // Announced by a reader holding no snapshot
+
+// Results of store_commit()
+#define STORE_OK 0                  // Committed (or nothing changed)
+#define STORE_CONFLICT 1            // Another commit changed one of the same pages since the base version
+#define STORE_FULL 2                // Open snapshots of old versions hold every version slot
+
+// One immutable page of committed memory, shared by every later version that leaves it unchanged
+typedef struct {
+    uint8_t data[PAGE_SIZE];        // Contents, never modified once committed
+    uint64_t retired;               // First version that no longer holds the page; 0 while the latest holds it
+} StorePage;
+
+// One committed version of memory: a page table pointing at shared pages
+typedef struct {
+    uint64_t number;                // Version number; version 0 is the initial image
+    StorePage *pages[MEMORY_PAGES]; // Page p of this version
+} StoreVersion;
+
+// Multi-version page store: snapshot isolation for commits, lock-free snapshots for readers
+typedef struct {
+    _Atomic(StoreVersion *) ring[STORE_VERSIONS];  // Retained versions, at number % STORE_VERSIONS
+    _Atomic uint64_t latest;        // Newest committed version
+    _Atomic uint64_t oldest;        // Oldest version a reader may still open
+    _Atomic uint64_t readers[STORE_READERS];  // Version each reader holds, or STORE_IDLE
+    pthread_mutex_t commit_lock;    // Serializes commits and collection
+    uint64_t collected;             // Every version below this one has been freed
+    StorePage **retired;            // Pages replaced by commits, in commit order, waiting to be freed
+    size_t retired_head;            // First page still waiting
+    size_t retired_count;           // End of the waiting pages
+    size_t retired_capacity;        // Pages the array can hold
+    uint64_t live_pages;            // Pages allocated and not yet freed
+    uint64_t commits;               // Versions committed
+    uint64_t conflicts;             // Commits refused by STORE_CONFLICT
+} PageStore;
+
 // Function prototypes (think of this as interfaces)
 void run(CPU *cpu);
+uint16_t fetch(const CPU *cpu);
+int execute(CPU *cpu, uint16_t opcode);
 void ld(CPU *cpu, uint8_t vx, uint8_t kk);
 void add(CPU *cpu, uint8_t vx, uint8_t kk);
 void se(CPU *cpu, uint8_t vx, uint8_t kk);
@@ -25,87 +583,529 @@ void add_xy(CPU *cpu, uint8_t x, uint8_t y);
 void and_xy(CPU *cpu, uint8_t x, uint8_t y);
 void or_xy(CPU *cpu, uint8_t x, uint8_t y);
 void xor_xy(CPU *cpu, uint8_t x, uint8_t y);
+void skp(CPU *cpu, uint8_t vx);
+void sknp(CPU *cpu, uint8_t vx);
+void ld_key(CPU *cpu, uint8_t vx);
+void ld_dt(CPU *cpu, uint8_t vx);
+void ld_st(CPU *cpu, uint8_t vx);
+void ld_i(CPU *cpu, uint16_t addr);
+void add_i(CPU *cpu, uint8_t vx);
+void ld_bcd(CPU *cpu, uint8_t vx);
+void ld_mem(CPU *cpu, uint8_t vx);
+void ld_regs(CPU *cpu, uint8_t vx);
+void store(CPU *cpu, uint16_t addr, uint8_t value);
+uint64_t pages_written_since(const CPU *cpu, uint64_t mark);
+void mark_pages_written(CPU *cpu, uint64_t pages);
+void tick(CPU *cpu);
+void cls(CPU *cpu);
+void scroll_down(CPU *cpu, uint8_t n);
+void scroll_right(CPU *cpu);
+void scroll_left(CPU *cpu);
+void set_hires(CPU *cpu, uint8_t on);
+void draw(CPU *cpu, uint8_t vx, uint8_t vy, uint8_t n);
+void advance_clock(CPU *cpu, uint64_t instructions);
+int run_for(CPU *cpu, uint64_t budget);
+int shares_machine_state(const CPU *a, const CPU *b);
+void bitslice_load(BitslicedCPU *bs, const CPU *cpus, size_t count);
+void bitslice_store(const BitslicedCPU *bs, CPU *cpus, size_t count);
+int bitslice_run(BitslicedCPU *bs);
+void run_bitsliced(CPU *cpus, size_t count);
+double lane_utilization(const LaneStats *stats);
+void run_regrouped(CPU *cpus, size_t count, size_t width, size_t regroup_interval, LaneStats *stats);
+void ir_build_block(const uint8_t *memory, uint16_t pc, IrBlock *block);
+const char *ir_verify(const IrBlock *block);
+void ir_cache_init(IrCache *cache, const uint8_t *memory);
+void ir_cache_free(IrCache *cache);
+void ir_cache_sync(IrCache *cache, const CPU *cpu);
+const IrBlock *ir_lookup(IrCache *cache, uint16_t pc, IrBlock *scratch);
+int ir_exec_block(CPU *cpu, const IrBlock *block, uint32_t *refund);
+void run_ir(CPU *cpu, IrCache *cache);
+int run_ir_for(CPU *cpu, IrCache *cache, uint64_t budget);
+StackAnalysis analyze_stack_depth(const uint8_t *memory, uint16_t entry);
+void ir_elide_stack_checks(IrBlock *block);
+int ir_cache_elide_stack_checks(IrCache *cache, uint16_t entry);
+int vector_run(VectorGroup *group, IrCache *cache);
+void run_vector_ir(CPU *cpus, size_t count, IrCache *cache);
+void video_open(VideoExporter *video, FILE *file, int format, int scale);
+void video_write_frame(VideoExporter *video, const CPU *cpu);
+void video_close(VideoExporter *video);
+void terminal_open(TerminalRenderer *term, int fd);
+void terminal_resize(TerminalRenderer *term);
+void terminal_render(TerminalRenderer *term, const CPU *cpu);
+void terminal_close(TerminalRenderer *term);
+void audio_ring_init(AudioRing *ring);
+size_t audio_ring_push(AudioRing *ring, const int16_t *samples, size_t count);
+size_t audio_ring_pop(AudioRing *ring, int16_t *samples, size_t count);
+void audio_ring_pull(AudioRing *ring, int16_t *samples, size_t count);
+void audio_init(AudioGenerator *audio, AudioRing *ring, uint32_t sample_rate, const CPU *cpu);
+void audio_generate(AudioGenerator *audio, const CPU *cpu);
+void wav_open(WavSink *wav, FILE *file, uint32_t sample_rate);
+void wav_drain(WavSink *wav, AudioRing *ring);
+void wav_close(WavSink *wav);
+void movie_init(InputMovie *movie);
+void movie_free(InputMovie *movie);
+void movie_record(InputMovie *movie, uint16_t keys);
+void movie_save(const InputMovie *movie, FILE *file);
+int movie_load(InputMovie *movie, FILE *file);
+int movie_play(CPU *cpu, const InputMovie *movie);
+int movie_play_ir(CPU *cpu, IrCache *cache, const InputMovie *movie);
+void play_movies(const CPU *start, const InputMovie *movies, size_t count, CPU *results, int *outcomes, int threads);
+int snapshot_take(CpuSnapshot *snapshot, CPU *cpu);
+int snapshot_restore(CpuSnapshot *snapshot, CPU *cpu);
+void run_ahead_init(RunAhead *ahead, int frames_ahead);
+int run_ahead_frame(RunAhead *ahead, CPU *cpu, uint16_t keys);
+void rollback_init(Rollback *rollback, CPU *cpu);
+int rollback_advance(Rollback *rollback, CPU *cpu, uint16_t keys);
+int rollback_correct(Rollback *rollback, CPU *cpu, uint64_t frame, uint16_t keys);
+uint64_t hash64(const void *data, size_t size, uint64_t seed);
+JobKey job_key(const CPU *start, const InputMovie *movie);
+void result_cache_init(ResultCache *cache, size_t capacity, const char *directory);
+void result_cache_free(ResultCache *cache);
+int result_cache_lookup(ResultCache *cache, JobKey key, CPU *result, int *status);
+void result_cache_insert(ResultCache *cache, JobKey key, const CPU *result, int status);
+double result_cache_hit_rate(const ResultCache *cache);
+int run_job_cached(ResultCache *cache, const CPU *start, const InputMovie *movie, CPU *result);
+void checkpoint_trie_init(CheckpointTrie *trie, size_t capacity);
+void checkpoint_trie_free(CheckpointTrie *trie);
+int run_job_resumable(CheckpointTrie *trie, const CPU *start, const InputMovie *movie, CPU *result);
+size_t lz_compress(const uint8_t *src, size_t size, uint8_t *dst);
+long lz_decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity);
+void parking_init(ParkingLot *lot, size_t count, uint32_t idle_threshold);
+void parking_free(ParkingLot *lot);
+CPU *parking_acquire(ParkingLot *lot, size_t id);
+void parking_note_run(ParkingLot *lot, size_t id, int status);
+void parking_set_dedup_rate(ParkingLot *lot, double pages_per_second);
+int fork_server(int request_fd, int result_fd, const CPU *warm, IrCache *cache, ForkServerStats *stats);
+GasSchedule gas_default_schedule(void);
+uint8_t gas_cost(const GasSchedule *schedule, uint16_t opcode);
+void ir_cache_set_schedule(IrCache *cache, const GasSchedule *schedule);
+int run_metered(CPU *cpu, const GasSchedule *schedule, uint64_t *gas);
+int run_ir_metered(CPU *cpu, IrCache *cache, uint64_t *gas);
+size_t migration_encode(const CPU *cpu, const uint8_t *rom, uint8_t *blob);
+int migration_decode(const uint8_t *blob, size_t size, const uint8_t *rom, CPU *cpu);
+int migrate_send(int fd, const CPU *cpu, const uint8_t *rom);
+int migrate_receive(int fd, const uint8_t *rom, CPU *cpu);
+void sha256_many(const uint8_t *const *messages, size_t size, size_t count, uint8_t (*digests)[SHA256_SIZE]);
+void merkle_init(MerkleTree *tree);
+size_t merkle_commit(MerkleTree *tree, const CPU *cpu);
+size_t merkle_commit_batch(MerkleTree *trees, const CPU *cpus, size_t count);
+void merkle_prove_page(const MerkleTree *tree, int page, uint8_t path[MERKLE_DEPTH + 1][SHA256_SIZE]);
+int merkle_verify_page(const uint8_t root[SHA256_SIZE], int page, const uint8_t *data, const uint8_t path[MERKLE_DEPTH + 1][SHA256_SIZE]);
+void trace_init(ExecutionTrace *trace, uint64_t interval, uint64_t checkpoint_every);
+void trace_free(ExecutionTrace *trace);
+int trace_run(ExecutionTrace *trace, CPU *cpu, uint64_t max_steps);
+long trace_replay(const ExecutionTrace *trace, uint64_t a, uint64_t b, uint64_t stride, uint8_t (*roots)[SHA256_SIZE], CPU *state);
+int step_prove(const ExecutionTrace *trace, uint64_t step, StepProof *proof);
+int step_verify(const StepProof *proof, const uint8_t pre_root[SHA256_SIZE], const uint8_t post_root[SHA256_SIZE]);
+void run_transactions_serial(uint8_t *memory, const CPU *txs, size_t count, uint64_t budget, CPU *results, int *outcomes);
+void run_transactions(uint8_t *memory, const CPU *txs, size_t count, uint64_t budget, CPU *results, int *outcomes, int threads, StmStats *stats);
+void store_init(PageStore *store, const uint8_t *memory);
+void store_free(PageStore *store);
+const StoreVersion *store_open(PageStore *store, int reader, uint64_t number);
+void store_close(PageStore *store, int reader);
+const uint8_t *store_page(const StoreVersion *version, int page);
+uint64_t store_checkout(const StoreVersion *version, CPU *cpu);
+int store_commit(PageStore *store, CPU *cpu, const StoreVersion *base, uint64_t *since, uint64_t *number);
+int decode_opcode(uint16_t opcode);
+int opcode_memory_span(uint16_t opcode);
+int op_would_fault(const CPU *cpu, int op);
+
+// Properties of each OP_* instruction, indexed by decode_opcode()
+static const OpInfo op_info[OP_COUNT] = {
+    [OP_HALT] = {GAS_HALT, 0},
+    [OP_CLS] = {GAS_DISPLAY, 0},
+    [OP_SCROLL_DOWN] = {GAS_DISPLAY, 0},
+    [OP_SCROLL_RIGHT] = {GAS_DISPLAY, 0},
+    [OP_SCROLL_LEFT] = {GAS_DISPLAY, 0},
+    [OP_LORES] = {GAS_DISPLAY, 0},
+    [OP_HIRES] = {GAS_DISPLAY, 0},
+    [OP_RET] = {GAS_RET, OPF_POP},
+    [OP_JMP] = {GAS_JUMP, 0},
+    [OP_CALL] = {GAS_CALL, OPF_PUSH},
+    [OP_SE_K] = {GAS_SKIP, OPF_SKIP | OPF_WAIT},
+    [OP_SNE_K] = {GAS_SKIP, OPF_SKIP | OPF_WAIT},
+    [OP_SE_Y] = {GAS_SKIP, OPF_SKIP | OPF_WAIT},
+    [OP_LD_K] = {GAS_ALU, OPF_WAIT},
+    [OP_ADD_K] = {GAS_ALU, OPF_WAIT},
+    [OP_LD_Y] = {GAS_ALU, OPF_WAIT},
+    [OP_OR] = {GAS_ALU, OPF_WAIT},
+    [OP_AND] = {GAS_ALU, OPF_WAIT},
+    [OP_XOR] = {GAS_ALU, OPF_WAIT},
+    [OP_ADD_XY] = {GAS_ALU, OPF_WAIT},
+    [OP_LD_I] = {GAS_MEMORY, 0},
+    [OP_DRAW] = {GAS_DISPLAY, OPF_LOADS},
+    [OP_SKP] = {GAS_KEY, OPF_SKIP | OPF_WAIT},
+    [OP_SKNP] = {GAS_KEY, OPF_SKIP | OPF_WAIT},
+    [OP_LD_DT_TO_V] = {GAS_TIMER, OPF_WAIT | OPF_READS_DT},
+    [OP_LD_KEY] = {GAS_KEY, OPF_WAIT},
+    [OP_LD_V_TO_DT] = {GAS_TIMER, 0},
+    [OP_LD_V_TO_ST] = {GAS_TIMER, 0},
+    [OP_ADD_I] = {GAS_MEMORY, 0},
+    [OP_BCD] = {GAS_MEMORY, OPF_STORES},
+    [OP_STORE_REGS] = {GAS_MEMORY, OPF_STORES},
+    [OP_LOAD_REGS] = {GAS_MEMORY, OPF_LOADS},
+    [OP_UNKNOWN] = {GAS_OTHER, 0},
+};
+
+// Function to name the instruction an opcode encodes; OP_UNKNOWN for opcodes execute() rejects
+int decode_opcode(uint16_t opcode) {
+    switch (opcode & 0xF000) {
+        case 0x0000:
+            if (opcode == 0x0000) {
+                return OP_HALT;
+            } else if (opcode == 0x00E0) {
+                return OP_CLS;
+            } else if ((opcode & 0xFFF0) == 0x00C0) {
+                return OP_SCROLL_DOWN;
+            } else if (opcode == 0x00EE) {
+                return OP_RET;
+            } else if (opcode == 0x00FB) {
+                return OP_SCROLL_RIGHT;
+            } else if (opcode == 0x00FC) {
+                return OP_SCROLL_LEFT;
+            } else if (opcode == 0x00FE) {
+                return OP_LORES;
+            } else if (opcode == 0x00FF) {
+                return OP_HIRES;
+            }
+            return OP_UNKNOWN;
+        case 0x1000:
+            return OP_JMP;
+        case 0x2000:
+            return OP_CALL;
+        case 0x3000:
+            return OP_SE_K;
+        case 0x4000:
+            return OP_SNE_K;
+        case 0x5000:
+            return OP_SE_Y;
+        case 0x6000:
+            return OP_LD_K;
+        case 0x7000:
+            return OP_ADD_K;
+        case 0x8000:
+            switch (opcode & 0x000F) {
+                case 0x0:
+                    return OP_LD_Y;
+                case 0x1:
+                    return OP_OR;
+                case 0x2:
+                    return OP_AND;
+                case 0x3:
+                    return OP_XOR;
+                case 0x4:
+                    return OP_ADD_XY;
+            }
+            return OP_UNKNOWN;
+        case 0xA000:
+            return OP_LD_I;
+        case 0xD000:
+            return OP_DRAW;
+        case 0xE000:
+            if ((opcode & 0x00FF) == 0x9E) {
+                return OP_SKP;
+            } else if ((opcode & 0x00FF) == 0xA1) {
+                return OP_SKNP;
+            }
+            return OP_UNKNOWN;
+        case 0xF000:
+            switch (opcode & 0x00FF) {
+                case 0x07:
+                    return OP_LD_DT_TO_V;
+                case 0x0A:
+                    return OP_LD_KEY;
+                case 0x15:
+                    return OP_LD_V_TO_DT;
+                case 0x18:
+                    return OP_LD_V_TO_ST;
+                case 0x1E:
+                    return OP_ADD_I;
+                case 0x33:
+                    return OP_BCD;
+                case 0x55:
+                    return OP_STORE_REGS;
+                case 0x65:
+                    return OP_LOAD_REGS;
+            }
+            return OP_UNKNOWN;
+    }
+    return OP_UNKNOWN;
+}
+
+// Function to count the bytes at I an OPF_LOADS or OPF_STORES instruction touches; 0 for the others
+int opcode_memory_span(uint16_t opcode) {
+    uint8_t x = (opcode & 0x0F00) >> 8;
+
+    switch (decode_opcode(opcode)) {
+        case OP_DRAW:
+            return (opcode & 0x000F) ? (opcode & 0x000F) : 32;  // DXY0: 16x16 sprite, two bytes per row
+        case OP_BCD:
+            return 3;
+        case OP_STORE_REGS:
+        case OP_LOAD_REGS:
+            return x + 1;
+    }
+    return 0;
+}
+
+// Function to check whether execute() would end the process on op: unknown, or a stack overflow or underflow
+int op_would_fault(const CPU *cpu, int op) {
+    if (op == OP_UNKNOWN) {
+        return 1;
+    }
+    if (op_info[op].flags & OPF_PUSH) {
+        return cpu->stack_pointer >= sizeof(cpu->stack) / sizeof(cpu->stack[0]);
+    }
+    if (op_info[op].flags & OPF_POP) {
+        return cpu->stack_pointer == 0;
+    }
+    return 0;
+}
 
 // Function to execute instructions in a loop
 void run(CPU *cpu) {
-    while (1) {  // Infinite loop until a return statement is encountered
-        // Fetch the opcode (16 bits) by combining two consecutive bytes from memory
-        uint8_t op_byte1 = cpu->memory[cpu->position_in_memory];
-        uint8_t op_byte2 = cpu->memory[cpu->position_in_memory + 1];
-        uint16_t opcode = (op_byte1 << 8) | op_byte2;
-
-        // Decode the opcode into its constituent parts using bitwise operations
-        uint8_t x = (opcode & 0x0F00) >> 8;    // Bits 8-11: Register X
-        uint8_t y = (opcode & 0x00F0) >> 4;    // Bits 4-7: Register Y
-        uint8_t kk = opcode & 0x00FF;          // Bits 0-7: Immediate 8-bit value
-        uint8_t op_minor = opcode & 0x000F;    // Bits 0-3: Minor opcode
-        uint16_t addr = opcode & 0x0FFF;       // Bits 0-11: Address
-
-        cpu->position_in_memory += 2;          // Move to the next instruction (each opcode is 2 bytes)
-
-        // Decode and execute the opcode
-        if (opcode == 0x0000) {
+    while (execute(cpu, fetch(cpu))) {
+        // Keep going until a HALT instruction is encountered
+    }
+}
+
+// Function to check that the loop head..tail can only spin on registers, timers and input
+// Returns 1 if the body reads the delay timer, 0 if it does not, and -1 if it may have other effects
+static int wait_loop_body(const uint8_t *memory, uint16_t head, uint16_t tail) {
+    int reads_timer = 0;
+    uint16_t pc = head;
+
+    for (int n = 0; n < IDLE_LOOP_MAX; n++) {
+        int op = decode_opcode((memory[pc] << 8) | memory[pc + 1]);
+
+        if (!((op_info[op].flags & OPF_WAIT) || (pc == tail && op == OP_JMP))) {
+            return -1;  // Calls, timer writes or other jumps: not a pure wait loop
+        }
+        if (op_info[op].flags & OPF_READS_DT) {
+            reads_timer = 1;
+        }
+        if (pc == tail) {
+            return reads_timer;
+        }
+        pc = (pc + 2) & ADDRESS_MASK;
+    }
+    return -1;
+}
+
+// Function to execute about budget instructions of virtual time, then return a RUN_* status
+// A wait loop that repeats with no effect is fast-forwarded in whole iterations: up to the next
+// tick if it polls a running delay timer, otherwise to the end of the budget (parked on input)
+int run_for(CPU *cpu, uint64_t budget) {
+    uint64_t end = cpu->cycles + budget;
+    int idle = 0;
+
+    // State at the last backward transfer, to spot an iteration that changed nothing
+    uint16_t loop_head = 0xFFFF;
+    uint16_t loop_tail = 0;
+    uint64_t loop_cycles = 0;
+    uint8_t loop_registers[16];
+    uint8_t loop_delay_timer = 0;
+    size_t loop_stack_pointer = 0;
+
+    while (cpu->cycles < end) {
+        uint16_t pc = cpu->position_in_memory;
+        uint16_t opcode = fetch(cpu);
+        if (!execute(cpu, opcode)) {
+            return RUN_HALTED;
+        }
+
+        // Only a JMP backwards or an FX0A still waiting for a key can close a wait loop
+        uint16_t head = cpu->position_in_memory;
+        if (head > pc || !((opcode & 0xF000) == 0x1000 || (opcode & 0xF0FF) == 0xF00A)) {
+            continue;
+        }
+
+        if (head == loop_head && pc == loop_tail && cpu->stack_pointer == loop_stack_pointer &&
+            memcmp(cpu->registers, loop_registers, sizeof(loop_registers)) == 0) {
+            int reads_timer = wait_loop_body(cpu->memory, head, pc);
+            if (reads_timer >= 0 && (!reads_timer || cpu->delay_timer == loop_delay_timer)) {
+                uint64_t period = cpu->cycles - loop_cycles;
+                uint64_t limit = end;
+                int input_only = !reads_timer || cpu->delay_timer == 0;
+                if (!input_only) {
+                    // Stop short of the instruction that sees the next tick
+                    uint64_t next_tick = (cpu->cycles / CYCLES_PER_TICK + 1) * CYCLES_PER_TICK;
+                    limit = (next_tick - 1 < end) ? next_tick - 1 : end;
+                }
+                if (limit > cpu->cycles) {
+                    advance_clock(cpu, (limit - cpu->cycles) / period * period);
+                }
+                idle = input_only;
+            }
+        }
+
+        loop_head = head;
+        loop_tail = pc;
+        loop_cycles = cpu->cycles;
+        memcpy(loop_registers, cpu->registers, sizeof(loop_registers));
+        loop_delay_timer = cpu->delay_timer;
+        loop_stack_pointer = cpu->stack_pointer;
+    }
+    return idle ? RUN_IDLE : RUN_BUDGET;
+}
+
+// Function to fetch the opcode (16 bits) by combining two consecutive bytes from memory
+// The PC never exceeds 0xFFF, so the second byte at most reads the zero guard; no bounds check needed
+uint16_t fetch(const CPU *cpu) {
+    uint8_t op_byte1 = cpu->memory[cpu->position_in_memory];
+    uint8_t op_byte2 = cpu->memory[cpu->position_in_memory + 1];
+    return (op_byte1 << 8) | op_byte2;
+}
+
+// Function to execute a single fetched opcode; returns 0 on HALT and 1 otherwise
+int execute(CPU *cpu, uint16_t opcode) {
+    // Decode the opcode into its constituent parts using bitwise operations
+    uint8_t x = (opcode & 0x0F00) >> 8;    // Bits 8-11: Register X
+    uint8_t y = (opcode & 0x00F0) >> 4;    // Bits 4-7: Register Y
+    uint8_t kk = opcode & 0x00FF;          // Bits 0-7: Immediate 8-bit value
+    uint8_t op_minor = opcode & 0x000F;    // Bits 0-3: Minor opcode
+    uint16_t addr = opcode & 0x0FFF;       // Bits 0-11: Address
+
+    cpu->position_in_memory = (cpu->position_in_memory + 2) & ADDRESS_MASK;  // Move to the next instruction (each opcode is 2 bytes)
+    if (++cpu->cycles % CYCLES_PER_TICK == 0) {
+        tick(cpu);                         // Timers run on guest time, not host time
+    }
+
+    // Decode and execute the opcode
+    switch (decode_opcode(opcode)) {
+        case OP_HALT:
             // Opcode 0x0000: HALT instruction
-            return;  // Exit the run loop (halt execution)
-        } else if (opcode == 0x00E0) {
-            // Opcode 0x00E0: CLEAR SCREEN (Not implemented)
-        } else if (opcode == 0x00EE) {
+            return 0;  // Exit the run loop (halt execution)
+        case OP_CLS:
+            // Opcode 0x00E0: CLEAR SCREEN
+            cls(cpu);
+            break;
+        case OP_SCROLL_DOWN:
+            // Opcode 0x00CN: SCROLL DOWN N rows
+            scroll_down(cpu, op_minor);
+            break;
+        case OP_SCROLL_RIGHT:
+            // Opcode 0x00FB: SCROLL RIGHT 4 pixels
+            scroll_right(cpu);
+            break;
+        case OP_SCROLL_LEFT:
+            // Opcode 0x00FC: SCROLL LEFT 4 pixels
+            scroll_left(cpu);
+            break;
+        case OP_LORES:
+            // Opcode 0x00FE: LOW-RES mode (64x32)
+            set_hires(cpu, 0);
+            break;
+        case OP_HIRES:
+            // Opcode 0x00FF: HIGH-RES mode (128x64)
+            set_hires(cpu, 1);
+            break;
+        case OP_RET:
             // Opcode 0x00EE: RET instruction
             ret(cpu);  // Return from subroutine
-        } else if ((opcode & 0xF000) == 0x1000) {
+            break;
+        case OP_JMP:
             // Opcode 0x1NNN: JMP instruction
             jmp(cpu, addr);
-        } else if ((opcode & 0xF000) == 0x2000) {
+            break;
+        case OP_CALL:
             // Opcode 0x2NNN: CALL instruction
             call(cpu, addr);
-        } else if ((opcode & 0xF000) == 0x3000) {
+            break;
+        case OP_SE_K:
             // Opcode 0x3XKK: SE Vx, KK
             se(cpu, x, kk);
-        } else if ((opcode & 0xF000) == 0x4000) {
+            break;
+        case OP_SNE_K:
             // Opcode 0x4XKK: SNE Vx, KK
             sne(cpu, x, kk);
-        } else if ((opcode & 0xF000) == 0x5000) {
+            break;
+        case OP_SE_Y:
             // Opcode 0x5XY0: SE Vx, Vy
             se(cpu, x, cpu->registers[y]);
-        } else if ((opcode & 0xF000) == 0x6000) {
+            break;
+        case OP_LD_K:
             // Opcode 0x6XKK: LD Vx, KK
             ld(cpu, x, kk);
-        } else if ((opcode & 0xF000) == 0x7000) {
+            break;
+        case OP_ADD_K:
             // Opcode 0x7XKK: ADD Vx, KK
             add(cpu, x, kk);
-        } else if ((opcode & 0xF000) == 0x8000) {
-            // Opcode 0x8XYN: Arithmetic and logical operations
-            switch (op_minor) {
-                case 0x0:
-                    // Opcode 0x8XY0: LD Vx, Vy
-                    ld(cpu, x, cpu->registers[y]);
-                    break;
-                case 0x1:
-                    // Opcode 0x8XY1: OR Vx, Vy
-                    or_xy(cpu, x, y);
-                    break;
-                case 0x2:
-                    // Opcode 0x8XY2: AND Vx, Vy
-                    and_xy(cpu, x, y);
-                    break;
-                case 0x3:
-                    // Opcode 0x8XY3: XOR Vx, Vy
-                    xor_xy(cpu, x, y);
-                    break;
-                case 0x4:
-                    // Opcode 0x8XY4: ADD Vx, Vy
-                    add_xy(cpu, x, y);
-                    break;
-                default:
-                    printf("Unhandled opcode: 0x%04X\n", opcode);
-                    exit(EXIT_FAILURE);
-            }
-        } else {
+            break;
+        case OP_LD_Y:
+            // Opcode 0x8XY0: LD Vx, Vy
+            ld(cpu, x, cpu->registers[y]);
+            break;
+        case OP_OR:
+            // Opcode 0x8XY1: OR Vx, Vy
+            or_xy(cpu, x, y);
+            break;
+        case OP_AND:
+            // Opcode 0x8XY2: AND Vx, Vy
+            and_xy(cpu, x, y);
+            break;
+        case OP_XOR:
+            // Opcode 0x8XY3: XOR Vx, Vy
+            xor_xy(cpu, x, y);
+            break;
+        case OP_ADD_XY:
+            // Opcode 0x8XY4: ADD Vx, Vy
+            add_xy(cpu, x, y);
+            break;
+        case OP_LD_I:
+            // Opcode 0xANNN: LD I, NNN
+            ld_i(cpu, addr);
+            break;
+        case OP_DRAW:
+            // Opcode 0xDXYN: DRW Vx, Vy, N (DXY0 draws a 16x16 sprite)
+            draw(cpu, x, y, op_minor);
+            break;
+        case OP_SKP:
+            // Opcode 0xEX9E: SKP Vx
+            skp(cpu, x);
+            break;
+        case OP_SKNP:
+            // Opcode 0xEXA1: SKNP Vx
+            sknp(cpu, x);
+            break;
+        case OP_LD_DT_TO_V:
+            // Opcode 0xFX07: LD Vx, DT
+            ld(cpu, x, cpu->delay_timer);
+            break;
+        case OP_LD_KEY:
+            // Opcode 0xFX0A: LD Vx, K (wait for a key press)
+            ld_key(cpu, x);
+            break;
+        case OP_LD_V_TO_DT:
+            // Opcode 0xFX15: LD DT, Vx
+            ld_dt(cpu, x);
+            break;
+        case OP_LD_V_TO_ST:
+            // Opcode 0xFX18: LD ST, Vx
+            ld_st(cpu, x);
+            break;
+        case OP_ADD_I:
+            // Opcode 0xFX1E: ADD I, Vx
+            add_i(cpu, x);
+            break;
+        case OP_BCD:
+            // Opcode 0xFX33: LD B, Vx (BCD digits of Vx at I, I+1, I+2)
+            ld_bcd(cpu, x);
+            break;
+        case OP_STORE_REGS:
+            // Opcode 0xFX55: LD [I], V0..Vx
+            ld_mem(cpu, x);
+            break;
+        case OP_LOAD_REGS:
+            // Opcode 0xFX65: LD V0..Vx, [I]
+            ld_regs(cpu, x);
+            break;
+        default:
             // Unhandled opcode
             printf("Unhandled opcode: 0x%04X\n", opcode);
             exit(EXIT_FAILURE);
-        }
     }
+    return 1;
 }
 
 // Function to load a value into register Vx
@@ -121,14 +1121,14 @@ void add(CPU *cpu, uint8_t vx, uint8_t kk) {
 // Function to skip next instruction if Vx equals kk
 void se(CPU *cpu, uint8_t vx, uint8_t kk) {
     if (cpu->registers[vx] == kk) {
-        cpu->position_in_memory += 2;  // Skip next instruction
+        cpu->position_in_memory = (cpu->position_in_memory + 2) & ADDRESS_MASK;  // Skip next instruction
     }
 }
 
 // Function to skip next instruction if Vx not equals kk
 void sne(CPU *cpu, uint8_t vx, uint8_t kk) {
     if (cpu->registers[vx] != kk) {
-        cpu->position_in_memory += 2;  // Skip next instruction
+        cpu->position_in_memory = (cpu->position_in_memory + 2) & ADDRESS_MASK;  // Skip next instruction
     }
 }
 
@@ -153,7 +1153,7 @@ void ret(CPU *cpu) {
         printf("Stack underflow!\n");
         exit(EXIT_FAILURE);
     }
-    cpu->position_in_memory = cpu->stack[--cpu->stack_pointer];
+    cpu->position_in_memory = cpu->stack[--cpu->stack_pointer] & ADDRESS_MASK;
 }
 
 // Function to add Vy to Vx with carry flag
@@ -178,36 +1178,5579 @@ void xor_xy(CPU *cpu, uint8_t x, uint8_t y) {
     cpu->registers[x] ^= cpu->registers[y];
 }
 
-// The main function where the program execution begins
-int main() {
-    // Initialize the CPU structure with zeros
-    CPU cpu = {0};
+// Function to skip next instruction if the key in Vx is pressed
+void skp(CPU *cpu, uint8_t vx) {
+    if ((cpu->keys >> (cpu->registers[vx] & 0xF)) & 1) {
+        cpu->position_in_memory = (cpu->position_in_memory + 2) & ADDRESS_MASK;  // Skip next instruction
+    }
+}
 
-    cpu.position_in_memory = 0;  // Start execution at address 0
+// Function to skip next instruction if the key in Vx is not pressed
+void sknp(CPU *cpu, uint8_t vx) {
+    if (!((cpu->keys >> (cpu->registers[vx] & 0xF)) & 1)) {
+        cpu->position_in_memory = (cpu->position_in_memory + 2) & ADDRESS_MASK;  // Skip next instruction
+    }
+}
 
-    // Initialize registers with given values
-    cpu.registers[0] = 5;    // V0 = 5
-    cpu.registers[1] = 10;   // V1 = 10
+// Function to wait for a key: stores the lowest held key in Vx, or re-executes until one is held
+void ld_key(CPU *cpu, uint8_t vx) {
+    if (cpu->keys == 0) {
+        cpu->position_in_memory = (cpu->position_in_memory - 2) & ADDRESS_MASK;  // Spin on this instruction
+        return;
+    }
+    uint8_t key = 0;
+    while (!((cpu->keys >> key) & 1)) {
+        key++;
+    }
+    cpu->registers[vx] = key;
+}
 
-    // Load instructions into memory
-    uint8_t *mem = cpu.memory;  // Pointer to the memory array for convenience
+// Function to set the delay timer from Vx
+void ld_dt(CPU *cpu, uint8_t vx) {
+    cpu->delay_timer = cpu->registers[vx];
+}
 
-    // Main program
-    mem[0x0000] = 0x21; mem[0x0001] = 0x00;  // Address 0x0000: CALL 0x0100
-    mem[0x0002] = 0x21; mem[0x0003] = 0x00;  // Address 0x0002: CALL 0x0100
+// Function to set the sound timer from Vx
+void ld_st(CPU *cpu, uint8_t vx) {
+    cpu->sound_timer = cpu->registers[vx];
+    cpu->writes.sound_cycles = cpu->cycles;
+    cpu->writes.sound_value = cpu->sound_timer;
+}
 
-    // Subroutine at address 0x0100
-    mem[0x0100] = 0x80; mem[0x0101] = 0x14;  // Address 0x0100: ADD V0, V1
-    mem[0x0102] = 0x80; mem[0x0103] = 0x14;  // Address 0x0102: ADD V0, V1
-    mem[0x0104] = 0x00; mem[0x0105] = 0xEE;  // Address 0x0104: ADD V0, V1
+// Function to write one byte of guest memory, stamping its page with the next write generation
+void store(CPU *cpu, uint16_t addr, uint8_t value) {
+    addr &= ADDRESS_MASK;
+    cpu->memory[addr] = value;
+    cpu->writes.page[addr / PAGE_SIZE] = ++cpu->writes.clock;
+}
 
-    run(&cpu);  // Start the CPU execution
+// Function to list the pages written after mark; every page when the clock is behind the mark (another history)
+uint64_t pages_written_since(const CPU *cpu, uint64_t mark) {
+    uint64_t pages = 0;
 
-    // After execution, check that the result is as expected
-    assert(cpu.registers[0] == 45);  // V0 should now be 420
+    if (cpu->writes.clock < mark) {
+        return ~(uint64_t)0;
+    }
+    for (int page = 0; page < MEMORY_PAGES; page++) {
+        if (cpu->writes.page[page] > mark) {
+            pages |= (uint64_t)1 << page;
+        }
+    }
+    return pages;
+}
 
-    // Print the result of the computation
-    printf("0 + (70 * 3) + (70 * 3) = %d\n", cpu.registers[0]);
+// Function to record writes the host made to memory without store()
+void mark_pages_written(CPU *cpu, uint64_t pages) {
+    if (pages == 0) {
+        return;
+    }
+    cpu->writes.clock++;
+    for (int page = 0; page < MEMORY_PAGES; page++) {
+        if ((pages >> page) & 1) {
+            cpu->writes.page[page] = cpu->writes.clock;
+        }
+    }
+}
+
+// Function to load an address into I
+void ld_i(CPU *cpu, uint16_t addr) {
+    cpu->index = addr;
+}
+
+// Function to add Vx to I
+void add_i(CPU *cpu, uint8_t vx) {
+    cpu->index = (cpu->index + cpu->registers[vx]) & ADDRESS_MASK;
+}
+
+// Function to store the hundreds, tens and ones digits of Vx at I, I+1 and I+2
+void ld_bcd(CPU *cpu, uint8_t vx) {
+    uint8_t value = cpu->registers[vx];
+    store(cpu, cpu->index, value / 100);
+    store(cpu, cpu->index + 1, (value / 10) % 10);
+    store(cpu, cpu->index + 2, value % 10);
+}
+
+// Function to store V0..Vx at I onwards; I is left unchanged
+void ld_mem(CPU *cpu, uint8_t vx) {
+    for (int r = 0; r <= vx; r++) {
+        store(cpu, cpu->index + r, cpu->registers[r]);
+    }
+}
+
+// Function to load V0..Vx from I onwards; I is left unchanged
+void ld_regs(CPU *cpu, uint8_t vx) {
+    for (int r = 0; r <= vx; r++) {
+        cpu->registers[r] = cpu->memory[(cpu->index + r) & ADDRESS_MASK];
+    }
+}
+
+// Function to clear the whole framebuffer
+void cls(CPU *cpu) {
+    memset(cpu->display, 0, sizeof(cpu->display));
+}
+
+// Function to scroll the display down by n pixels of the current mode (whole-row move)
+void scroll_down(CPU *cpu, uint8_t n) {
+    size_t rows = cpu->hires ? n : 2 * n;
+    if (rows > DISPLAY_HEIGHT) {
+        rows = DISPLAY_HEIGHT;
+    }
+    memmove(cpu->display[rows], cpu->display[0], (DISPLAY_HEIGHT - rows) * sizeof(cpu->display[0]));
+    memset(cpu->display[0], 0, rows * sizeof(cpu->display[0]));
+}
+
+// Function to scroll the display right by 4 pixels of the current mode
+// Each row is a 128-bit value split over two words, so this is a cross-word shift
+void scroll_right(CPU *cpu) {
+    int bits = cpu->hires ? 4 : 8;
+    for (int row = 0; row < DISPLAY_HEIGHT; row++) {
+        uint64_t left = cpu->display[row][0], right = cpu->display[row][1];
+        cpu->display[row][0] = left >> bits;
+        cpu->display[row][1] = (right >> bits) | (left << (64 - bits));
+    }
+}
+
+// Function to scroll the display left by 4 pixels of the current mode
+void scroll_left(CPU *cpu) {
+    int bits = cpu->hires ? 4 : 8;
+    for (int row = 0; row < DISPLAY_HEIGHT; row++) {
+        uint64_t left = cpu->display[row][0], right = cpu->display[row][1];
+        cpu->display[row][0] = (left << bits) | (right >> (64 - bits));
+        cpu->display[row][1] = right << bits;
+    }
+}
+
+// Function to switch between 64x32 and 128x64 mode; the framebuffer keeps its contents
+void set_hires(CPU *cpu, uint8_t on) {
+    cpu->hires = on;
+}
+
+// Function to toggle one framebuffer pixel; returns 1 if it was lit before
+static int flip_pixel(CPU *cpu, int row, int col) {
+    uint64_t bit = (uint64_t)1 << (63 - col % 64);
+    int lit = (cpu->display[row][col / 64] & bit) != 0;
+    cpu->display[row][col / 64] ^= bit;
+    return lit;
+}
+
+// Function to XOR an N-byte sprite at I onto the display at (Vx, Vy); VF is set to 1 if a lit pixel was cleared
+// The origin wraps to the screen of the current mode and the sprite is clipped at its edges. N = 0 draws a
+// 16x16 sprite of two bytes per row in both modes, as SUPER-CHIP does in hi-res; lo-res pixels are 2x2 blocks
+void draw(CPU *cpu, uint8_t vx, uint8_t vy, uint8_t n) {
+    int scale = cpu->hires ? 1 : 2;
+    int width = DISPLAY_WIDTH / scale;
+    int height = DISPLAY_HEIGHT / scale;
+    int columns = n ? 8 : 16;
+    int rows = n ? n : 16;
+    int left = cpu->registers[vx] % width;
+    int top = cpu->registers[vy] % height;
+    int collision = 0;
+
+    for (int r = 0; r < rows && top + r < height; r++) {
+        uint16_t addr = cpu->index + (uint16_t)(r * columns / 8);
+        uint16_t bits = cpu->memory[addr & ADDRESS_MASK] << 8;
+        if (columns == 16) {
+            bits |= cpu->memory[(addr + 1) & ADDRESS_MASK];
+        }
+        for (int c = 0; c < columns && left + c < width; c++) {
+            if (!(bits & (0x8000 >> c))) {
+                continue;
+            }
+            for (int dy = 0; dy < scale; dy++) {
+                for (int dx = 0; dx < scale; dx++) {
+                    collision |= flip_pixel(cpu, (top + r) * scale + dy, (left + c) * scale + dx);
+                }
+            }
+        }
+    }
+    cpu->registers[0xF] = collision;
+}
+
+// Function to count both timers down by one 60 Hz tick
+void tick(CPU *cpu) {
+    if (cpu->delay_timer > 0) {
+        cpu->delay_timer--;
+    }
+    if (cpu->sound_timer > 0) {
+        cpu->sound_timer--;
+    }
+}
+
+// Function to advance the virtual clock by many instructions at once, applying every tick crossed
+void advance_clock(CPU *cpu, uint64_t instructions) {
+    uint64_t ticks = (cpu->cycles + instructions) / CYCLES_PER_TICK - cpu->cycles / CYCLES_PER_TICK;
+    cpu->cycles += instructions;
+    cpu->delay_timer = (ticks >= cpu->delay_timer) ? 0 : cpu->delay_timer - (uint8_t)ticks;
+    cpu->sound_timer = (ticks >= cpu->sound_timer) ? 0 : cpu->sound_timer - (uint8_t)ticks;
+}
+
+// Function to rebuild a lane's clock and timers after lockstep execution
+// Lanes that skipped instructions executed fewer of them than the shared state counted
+static void settle_lane_clock(CPU *lane, uint64_t start_cycles, uint8_t delay_timer, uint8_t sound_timer, uint64_t cycles) {
+    lane->cycles = start_cycles;
+    lane->delay_timer = delay_timer;
+    lane->sound_timer = sound_timer;
+    advance_clock(lane, cycles - start_cycles);
+}
+
+// Function to check that two instances differ at most in their registers
+int shares_machine_state(const CPU *a, const CPU *b) {
+    return a->position_in_memory == b->position_in_memory &&
+           a->index == b->index &&
+           a->stack_pointer == b->stack_pointer &&
+           a->delay_timer == b->delay_timer &&
+           a->sound_timer == b->sound_timer &&
+           a->keys == b->keys &&
+           a->cycles == b->cycles &&
+           a->hires == b->hires &&
+           memcmp(a->display, b->display, sizeof(a->display)) == 0 &&
+           memcmp(a->stack, b->stack, sizeof(a->stack)) == 0 &&
+           memcmp(a->memory, b->memory, sizeof(a->memory)) == 0;
+}
+
+// Function to transpose up to 64 instances into bitsliced form; lane n is cpus[lanes[n]], or cpus[n] when lanes is NULL
+static void bitslice_gather(BitslicedCPU *bs, const CPU *cpus, const size_t *lanes, size_t count) {
+    const CPU *first = &cpus[lanes != NULL ? lanes[0] : 0];
+
+    memset(bs->planes, 0, sizeof(bs->planes));
+    bs->live = (count >= BITSLICE_LANES) ? ~(uint64_t)0 : (((uint64_t)1 << count) - 1);
+    bs->active = bs->live;
+    bs->shared = *first;
+    memset(bs->skipped, 0, sizeof(bs->skipped));
+    bs->start_cycles = first->cycles;
+    bs->start_delay_timer = first->delay_timer;
+    bs->start_sound_timer = first->sound_timer;
+    bs->start_writes = first->writes.clock;
+
+    for (size_t lane = 0; lane < count; lane++) {
+        for (int x = 0; x < 16; x++) {
+            uint8_t value = cpus[lanes != NULL ? lanes[lane] : lane].registers[x];
+            for (int b = 0; b < 8; b++) {
+                bs->planes[x][b] |= (uint64_t)((value >> b) & 1) << lane;
+            }
+        }
+    }
+}
+
+// Function to transpose up to 64 instances into bitsliced form
+void bitslice_load(BitslicedCPU *bs, const CPU *cpus, size_t count) {
+    bitslice_gather(bs, cpus, NULL, count);
+}
+
+// Function to transpose back into separate instances; lane n goes to cpus[lanes[n]], or cpus[n] when lanes is NULL
+static void bitslice_scatter(const BitslicedCPU *bs, CPU *cpus, const size_t *lanes, size_t count) {
+    uint64_t written = pages_written_since(&bs->shared, bs->start_writes);
+
+    for (size_t lane = 0; lane < count; lane++) {
+        CPU *cpu = &cpus[lanes != NULL ? lanes[lane] : lane];
+        WriteClock writes = cpu->writes;  // Bookkeeping per instance, not shared state
+        *cpu = bs->shared;
+        cpu->writes = writes;
+        mark_pages_written(cpu, written);
+        for (int x = 0; x < 16; x++) {
+            uint8_t value = 0;
+            for (int b = 0; b < 8; b++) {
+                value |= (uint8_t)(((bs->planes[x][b] >> lane) & 1) << b);
+            }
+            cpu->registers[x] = value;
+        }
+        uint64_t skipped = 0;
+        for (int b = 0; b < 32; b++) {
+            skipped |= ((bs->skipped[b] >> lane) & 1) << b;
+        }
+        settle_lane_clock(cpu, bs->start_cycles, bs->start_delay_timer, bs->start_sound_timer,
+                          bs->shared.cycles - skipped);
+        if (!((bs->active >> lane) & 1)) {
+            cpu->position_in_memory = (cpu->position_in_memory + 2) & ADDRESS_MASK;
+        }
+    }
+}
+
+// Function to transpose back into separate instances
+void bitslice_store(const BitslicedCPU *bs, CPU *cpus, size_t count) {
+    bitslice_scatter(bs, cpus, NULL, count);
+}
+
+// Function to add one to a bitsliced counter in the lanes of mask
+static void bitslice_count(uint64_t counter[32], uint64_t mask) {
+    for (int b = 0; b < 32 && mask != 0; b++) {
+        uint64_t carry = counter[b] & mask;
+        counter[b] ^= mask;
+        mask = carry;
+    }
+}
+
+// Function to write a bitsliced value into Vx for the lanes in mask
+static void bitslice_write(BitslicedCPU *bs, uint8_t x, const uint64_t value[8], uint64_t mask) {
+    for (int b = 0; b < 8; b++) {
+        bs->planes[x][b] = (value[b] & mask) | (bs->planes[x][b] & ~mask);
+    }
+}
+
+// Function to broadcast an immediate into bitsliced form
+static void bitslice_splat(uint64_t out[8], uint8_t kk) {
+    for (int b = 0; b < 8; b++) {
+        out[b] = ((kk >> b) & 1) ? ~(uint64_t)0 : 0;
+    }
+}
+
+// Function to add two bitsliced bytes with a ripple-carry network, returning the carry-out mask
+static uint64_t bitslice_adder(uint64_t out[8], const uint64_t a[8], const uint64_t b[8]) {
+    uint64_t carry = 0;
+    for (int i = 0; i < 8; i++) {
+        uint64_t half = a[i] ^ b[i];
+        out[i] = half ^ carry;
+        carry = (a[i] & b[i]) | (carry & half);
+    }
+    return carry;
+}
+
+// Function to compute the mask of lanes where two bitsliced bytes are equal
+static uint64_t bitslice_equal(const uint64_t a[8], const uint64_t b[8]) {
+    uint64_t diff = 0;
+    for (int i = 0; i < 8; i++) {
+        diff |= a[i] ^ b[i];
+    }
+    return ~diff;
+}
+
+// Function to run all lanes in lockstep until HALT (returns 1) or until lanes diverge (returns 0)
+int bitslice_run(BitslicedCPU *bs) {
+    uint64_t active = bs->active;
+    CPU *cpu = &bs->shared;
+
+    while (1) {
+        uint16_t opcode = fetch(cpu);
+
+        uint8_t x = (opcode & 0x0F00) >> 8;
+        uint8_t y = (opcode & 0x00F0) >> 4;
+        uint8_t kk = opcode & 0x00FF;
+        int op = decode_opcode(opcode);
+
+        uint64_t value[8];
+        uint64_t skip = 0;       // Lanes that skip the next instruction
+
+        switch (op) {
+            case OP_SE_K:
+            case OP_SNE_K:
+            case OP_SE_Y: {
+                // SE/SNE produce a per-lane skip mask instead of a branch
+                if (op == OP_SE_Y) {
+                    memcpy(value, bs->planes[y], sizeof(value));
+                } else {
+                    bitslice_splat(value, kk);
+                }
+                uint64_t equal = bitslice_equal(bs->planes[x], value);
+                skip = active & ((op == OP_SNE_K) ? ~equal : equal);
+                break;
+            }
+            case OP_LD_K:
+                bitslice_splat(value, kk);
+                bitslice_write(bs, x, value, active);
+                break;
+            case OP_ADD_K: {
+                uint64_t imm[8];
+                bitslice_splat(imm, kk);
+                bitslice_adder(value, bs->planes[x], imm);
+                bitslice_write(bs, x, value, active);
+                break;
+            }
+            case OP_ADD_XY: {
+                uint64_t carry = bitslice_adder(value, bs->planes[x], bs->planes[y]);
+                uint64_t flag[8] = {carry, 0, 0, 0, 0, 0, 0, 0};
+                bitslice_write(bs, x, value, active);
+                bitslice_write(bs, 0xF, flag, active);  // Set carry flag VF
+                break;
+            }
+            case OP_LD_Y:
+            case OP_OR:
+            case OP_AND:
+            case OP_XOR:
+                // LD/OR/AND/XOR are one word operation per bit plane
+                for (int b = 0; b < 8; b++) {
+                    uint64_t vx = bs->planes[x][b], vy = bs->planes[y][b];
+                    value[b] = (op == OP_LD_Y) ? vy : (op == OP_OR) ? (vx | vy) : (op == OP_AND) ? (vx & vy) : (vx ^ vy);
+                }
+                bitslice_write(bs, x, value, active);
+                break;
+            case OP_HALT:
+            case OP_CLS:
+            case OP_SCROLL_DOWN:
+            case OP_SCROLL_RIGHT:
+            case OP_SCROLL_LEFT:
+            case OP_LORES:
+            case OP_HIRES:
+            case OP_RET:
+            case OP_JMP:
+            case OP_CALL:
+                if (active == bs->live) {
+                    // Control flow and display ops are the same for every lane, so they run once on the shared state
+                    if (!execute(cpu, opcode)) {
+                        return 1;  // Every lane reached HALT together
+                    }
+                    continue;
+                }
+                bs->active = active;  // Control flow under a partial mask
+                return 0;
+            default:
+                // An opcode left to the scalar path
+                bs->active = active;
+                return 0;
+        }
+
+        bitslice_count(bs->skipped, bs->live & ~active);  // Lanes skipped past this instruction
+        cpu->position_in_memory = (cpu->position_in_memory + 2) & ADDRESS_MASK;
+        cpu->cycles++;
+        active = bs->live & ~skip;
+    }
+}
+
+// Function to run many instances, 64 at a time in bitsliced form where they share everything but registers
+void run_bitsliced(CPU *cpus, size_t count) {
+    BitslicedCPU *bs = malloc(sizeof(BitslicedCPU));
+    if (bs == NULL) {
+        printf("Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t base = 0; base < count; base += BITSLICE_LANES) {
+        size_t lanes = count - base;
+        if (lanes > BITSLICE_LANES) {
+            lanes = BITSLICE_LANES;
+        }
+
+        int uniform = 1;
+        for (size_t lane = 1; lane < lanes && uniform; lane++) {
+            uniform = shares_machine_state(&cpus[base], &cpus[base + lane]);
+        }
+
+        if (uniform) {
+            bitslice_load(bs, &cpus[base], lanes);
+            int halted = bitslice_run(bs);
+            bitslice_store(bs, &cpus[base], lanes);
+            if (halted) {
+                continue;  // All lanes halted in lockstep
+            }
+        }
+
+        // Finish (or fully run) this chunk one instance at a time
+        for (size_t lane = 0; lane < lanes; lane++) {
+            run(&cpus[base + lane]);
+        }
+    }
+
+    free(bs);
+}
+
+// Function to report the fraction of lane slots that did useful work
+double lane_utilization(const LaneStats *stats) {
+    return stats->lane_slots ? (double)stats->active_lanes / (double)stats->lane_slots : 0.0;
+}
+
+#define NO_LANE ((size_t)-1)        // Marks an empty or halted lane slot
+#define LANE_MAX_WAIT 64            // Group steps a lane may be masked off before its PC leads the group
+
+// Function to bucket live instances by PC (counting sort) and pack them into groups of width lanes
+static size_t regroup(const CPU *cpus, const uint8_t *halted, size_t count, size_t width,
+                      size_t *slots, size_t *order, size_t *buckets) {
+    memset(buckets, 0, (MEMORY_SIZE + 1) * sizeof(size_t));
+
+    for (size_t i = 0; i < count; i++) {
+        if (!halted[i]) {
+            buckets[cpus[i].position_in_memory + 1]++;
+        }
+    }
+    for (size_t b = 0; b < MEMORY_SIZE; b++) {
+        buckets[b + 1] += buckets[b];
+    }
+    size_t live = buckets[MEMORY_SIZE];
+    for (size_t i = 0; i < count; i++) {
+        if (!halted[i]) {
+            order[buckets[cpus[i].position_in_memory]++] = i;
+        }
+    }
+
+    size_t groups = (live + width - 1) / width;
+    for (size_t slot = 0; slot < groups * width; slot++) {
+        slots[slot] = (slot < live) ? order[slot] : NO_LANE;
+    }
+    return groups;
+}
+
+// Function to run many instances to HALT in lockstep groups, periodically regrouping them by PC
+// A group step runs the lanes at the group's lowest PC and masks the rest off, counting lane utilization;
+// a lane masked off for LANE_MAX_WAIT steps leads instead, so a loop at a lower PC cannot starve it.
+// Leading lanes that share everything but registers run bitsliced until they diverge; others step alone
+void run_regrouped(CPU *cpus, size_t count, size_t width, size_t regroup_interval, LaneStats *stats) {
+    if (count == 0) {
+        return;
+    }
+    if (width == 0) {
+        width = 1;  // Every instance in a group of its own
+    }
+
+    size_t groups_max = (count + width - 1) / width;
+    size_t *slots = malloc(groups_max * width * sizeof(size_t));
+    size_t *order = malloc(count * sizeof(size_t));
+    size_t *buckets = malloc((MEMORY_SIZE + 1) * sizeof(size_t));
+    uint8_t *halted = calloc(count, 1);
+    uint32_t *waited = calloc(count, sizeof(uint32_t));
+    size_t *coherent = malloc(width * sizeof(size_t));
+    BitslicedCPU *bs = malloc(sizeof(BitslicedCPU));
+    if (slots == NULL || order == NULL || buckets == NULL || halted == NULL || waited == NULL || coherent == NULL || bs == NULL) {
+        printf("Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t live = count;
+    size_t groups = 0;
+    size_t rounds = 0;
+    while (live > 0) {
+        if (groups == 0 || (regroup_interval != 0 && rounds % regroup_interval == 0)) {
+            groups = regroup(cpus, halted, count, width, slots, order, buckets);
+            stats->regroups++;
+        }
+        rounds++;
+
+        for (size_t g = 0; g < groups; g++) {
+            size_t *lanes = &slots[g * width];
+
+            // Reconverge on the lowest PC in the group, unless a lane has waited too long
+            size_t leader_pc = NO_LANE;
+            size_t starved = NO_LANE;
+            for (size_t lane = 0; lane < width; lane++) {
+                size_t i = lanes[lane];
+                if (i == NO_LANE) {
+                    continue;
+                }
+                if (cpus[i].position_in_memory < leader_pc) {
+                    leader_pc = cpus[i].position_in_memory;
+                }
+                if (waited[i] >= LANE_MAX_WAIT && (starved == NO_LANE || waited[i] > waited[starved])) {
+                    starved = i;
+                }
+            }
+            if (leader_pc == NO_LANE) {
+                continue;  // Every lane in this group has halted
+            }
+            if (starved != NO_LANE) {
+                leader_pc = cpus[starved].position_in_memory;
+            }
+
+            // Leading lanes that differ only in registers run together for as long as they stay in step
+            size_t together = 0;
+            for (size_t lane = 0; lane < width && together < BITSLICE_LANES; lane++) {
+                size_t i = lanes[lane];
+                if (i != NO_LANE && cpus[i].position_in_memory == leader_pc &&
+                    (together == 0 || shares_machine_state(&cpus[coherent[0]], &cpus[i]))) {
+                    coherent[together++] = i;
+                }
+            }
+            if (together > 1) {
+                bitslice_gather(bs, cpus, coherent, together);
+                int all_halted = bitslice_run(bs);
+                uint64_t steps = bs->shared.cycles - bs->start_cycles;
+                if (steps > 0) {
+                    bitslice_scatter(bs, cpus, coherent, together);
+                    stats->vector_steps += steps;
+                    stats->lane_slots += steps * width;
+                    for (size_t lane = 0; lane < width; lane++) {
+                        size_t i = lanes[lane];
+                        if (i != NO_LANE) {
+                            waited[i] += (uint32_t)steps;  // The lanes outside the run sat masked off throughout
+                        }
+                    }
+                    for (size_t n = 0; n < together; n++) {
+                        size_t i = coherent[n];
+                        stats->active_lanes += cpus[i].cycles - bs->start_cycles;
+                        waited[i] = 0;
+                        if (all_halted) {
+                            halted[i] = 1;
+                            live--;
+                        }
+                    }
+                    if (all_halted) {
+                        for (size_t lane = 0; lane < width; lane++) {
+                            if (lanes[lane] != NO_LANE && halted[lanes[lane]]) {
+                                lanes[lane] = NO_LANE;
+                            }
+                        }
+                    }
+                    continue;
+                }
+                // The first instruction is left to the scalar path: step the lanes one at a time below
+            }
+
+            stats->vector_steps++;
+            stats->lane_slots += width;
+            for (size_t lane = 0; lane < width; lane++) {
+                if (lanes[lane] == NO_LANE) {
+                    continue;
+                }
+                if (cpus[lanes[lane]].position_in_memory != leader_pc) {
+                    waited[lanes[lane]]++;
+                    continue;  // Masked off this step
+                }
+                CPU *cpu = &cpus[lanes[lane]];
+                waited[lanes[lane]] = 0;
+                stats->active_lanes++;
+                if (!execute(cpu, fetch(cpu))) {
+                    halted[lanes[lane]] = 1;
+                    lanes[lane] = NO_LANE;
+                    live--;
+                }
+            }
+        }
+    }
+
+    free(slots);
+    free(order);
+    free(buckets);
+    free(halted);
+    free(waited);
+    free(coherent);
+    free(bs);
+}
+
+// Function to translate guest instructions starting at pc into a block of micro-ops
+void ir_build_block(const uint8_t *memory, uint16_t pc, IrBlock *block) {
+    block->start_pc = pc;
+    block->length = 0;
+
+    while (1) {
+        MicroOp *op = &block->ops[block->length++];
+        memset(op, 0, sizeof(*op));
+
+        if (block->length > IR_BLOCK_MAX) {
+            op->kind = UOP_FALLTHROUGH;  // Resume at pc in the next block
+            op->target = pc;
+            return;
+        }
+
+        uint16_t opcode = (memory[pc] << 8) | memory[pc + 1];
+        op->dst = (opcode & 0x0F00) >> 8;
+        op->src = (opcode & 0x00F0) >> 4;
+        op->imm = opcode & 0x00FF;
+        op->target = opcode & 0x0FFF;
+        pc = (pc + 2) & ADDRESS_MASK;
+
+        switch (decode_opcode(opcode)) {
+            case OP_HALT:
+                op->kind = UOP_HALT;
+                return;
+            case OP_RET:
+                op->kind = UOP_RET;
+                return;
+            case OP_JMP:
+                op->kind = UOP_JMP;
+                return;
+            case OP_CALL:
+                op->kind = UOP_CALL;
+                return;
+            case OP_SE_K:
+                op->kind = UOP_SE_K;
+                break;
+            case OP_SNE_K:
+                op->kind = UOP_SNE_K;
+                break;
+            case OP_SE_Y:
+                op->kind = UOP_SE_Y;
+                break;
+            case OP_LD_K:
+                op->kind = UOP_LD_K;
+                break;
+            case OP_ADD_K:
+                op->kind = UOP_ADD_K;
+                break;
+            case OP_LD_Y:
+                op->kind = UOP_LD_Y;
+                break;
+            case OP_OR:
+                op->kind = UOP_OR;
+                break;
+            case OP_AND:
+                op->kind = UOP_AND;
+                break;
+            case OP_XOR:
+                op->kind = UOP_XOR;
+                break;
+            case OP_ADD_XY:
+                op->kind = UOP_ADD_XY;
+                op->flags = UOP_DEF_VF;
+                break;
+            default:
+                op->kind = UOP_EXIT;  // Left to execute(): memory, display, timer and key ops, or an unhandled opcode
+                return;
+        }
+    }
+}
+
+// Function to check a block's structural invariants; returns NULL if valid, else a description
+const char *ir_verify(const IrBlock *block) {
+    if (block->length == 0 || block->length > IR_BLOCK_MAX + 1) {
+        return "block length out of range";
+    }
+    for (uint16_t i = 0; i < block->length; i++) {
+        const MicroOp *op = &block->ops[i];
+        int terminator = op->kind >= UOP_JMP;
+        if (op->kind >= UOP_KIND_COUNT) {
+            return "unknown micro-op kind";
+        }
+        if (op->dst > 0xF || op->src > 0xF) {
+            return "register operand out of range";
+        }
+        if (terminator != (i == block->length - 1)) {
+            return "terminator is not the last op";
+        }
+        if ((op->flags & UOP_DEF_VF) != (op->kind == UOP_ADD_XY ? UOP_DEF_VF : 0)) {
+            return "VF definition does not match op kind";
+        }
+        if (op->target > 0x0FFF) {
+            return "target outside memory";
+        }
+        if (op->kind == UOP_FALLTHROUGH && op->target != ((block->start_pc + 2 * i) & ADDRESS_MASK)) {
+            return "fallthrough does not resume at the next instruction";
+        }
+    }
+    return NULL;
+}
+
+// Function to prepare an empty block cache for a ROM image
+void ir_cache_init(IrCache *cache, const uint8_t *memory) {
+    memset(cache, 0, sizeof(*cache));
+    memcpy(cache->memory, memory, sizeof(cache->memory));
+}
+
+// Function to release every cached block; a frozen cache only forgets them
+void ir_cache_free(IrCache *cache) {
+    for (size_t pc = 0; pc < sizeof(cache->blocks) / sizeof(cache->blocks[0]); pc++) {
+        if (!cache->frozen) {
+            free(cache->blocks[pc]);
+        }
+        cache->blocks[pc] = NULL;
+    }
+}
+
+// Function to start an empty cache for a different ROM, keeping its gas schedule
+static void ir_cache_rebind(IrCache *cache, const uint8_t *memory) {
+    const GasSchedule *schedule = cache->schedule;
+    uint8_t frozen = cache->frozen;
+    ir_cache_free(cache);
+    ir_cache_init(cache, memory);
+    cache->schedule = schedule;
+    cache->frozen = frozen;
+}
+
+// Function to bring the cache's copy of memory up to date after guest stores
+// Cached blocks translated from a rewritten page are dropped, as is a stack proof that walked it
+void ir_cache_sync(IrCache *cache, const CPU *cpu) {
+    uint64_t written = cache->synced == cpu ? pages_written_since(cpu, cache->synced_writes) : ~(uint64_t)0;
+    uint64_t rewritten = 0;
+
+    cache->synced = cpu;
+    cache->synced_writes = cpu->writes.clock;
+
+    for (int page = 0; page < MEMORY_PAGES; page++) {
+        size_t offset = (size_t)page * PAGE_SIZE;
+        if (((written >> page) & 1) && memcmp(cache->memory + offset, cpu->memory + offset, PAGE_SIZE) != 0) {
+            memcpy(cache->memory + offset, cpu->memory + offset, PAGE_SIZE);
+            rewritten |= (uint64_t)1 << page;
+        }
+    }
+
+    if (cache->elide_stack_checks && (rewritten & cache->stack.code_pages)) {
+        ir_cache_free(cache);  // Every cached block may carry unchecked CALL/RET
+        cache->elide_stack_checks = 0;
+        return;
+    }
+    if (!(rewritten & cache->code_pages)) {
+        return;
+    }
+    for (size_t pc = 0; pc < MEMORY_SIZE; pc++) {
+        const IrBlock *block = cache->blocks[pc];
+        if (block == NULL) {
+            continue;
+        }
+        for (uint16_t i = 0; i < block->length; i++) {
+            uint16_t at = (block->start_pc + 2 * i) & ADDRESS_MASK;
+            if ((rewritten >> (at / PAGE_SIZE)) & 1 || (rewritten >> (((at + 1) & ADDRESS_MASK) / PAGE_SIZE)) & 1) {
+                if (!cache->frozen) {
+                    free(cache->blocks[pc]);
+                }
+                cache->blocks[pc] = NULL;
+                cache->invalidated++;
+                break;
+            }
+        }
+    }
+}
+
+// Function to find the block at pc, translating it into scratch until it turns hot
+const IrBlock *ir_lookup(IrCache *cache, uint16_t pc, IrBlock *scratch) {
+    if (cache->blocks[pc] != NULL) {
+        cache->hits++;
+        return cache->blocks[pc];
+    }
+
+    IrBlock *block = scratch;
+    if (!cache->frozen && ++cache->heat[pc] >= IR_HOT_THRESHOLD) {
+        block = malloc(sizeof(IrBlock));
+        if (block == NULL) {
+            printf("Out of memory!\n");
+            exit(EXIT_FAILURE);
+        }
+        cache->blocks[pc] = block;
+        cache->compiled++;
+        for (uint16_t i = 0; i <= IR_BLOCK_MAX; i++) {
+            cache->code_pages |= (uint64_t)1 << (((pc + 2 * i) & ADDRESS_MASK) / PAGE_SIZE);
+        }
+    } else {
+        cache->cold++;
+    }
+    ir_build_block(cache->memory, pc, block);
+    if (cache->elide_stack_checks) {
+        ir_elide_stack_checks(block);
+    }
+    assert(ir_verify(block) == NULL);  // A translator bug stops here instead of corrupting guest state
+    block->gas = 0;
+    if (cache->schedule != NULL) {
+        for (uint16_t i = 0; i < block->length; i++) {
+            uint16_t at = (pc + 2 * i) & ADDRESS_MASK;
+            if (block->ops[i].kind != UOP_FALLTHROUGH) {
+                block->ops[i].gas = gas_cost(cache->schedule, (cache->memory[at] << 8) | cache->memory[at + 1]);
+                block->gas += block->ops[i].gas;
+            }
+        }
+    }
+    return block;
+}
+
+// Function to interpret one block; returns 0 on HALT and 1 otherwise, leaving PC at the next block
+// Register ops cannot observe the timers, so the clock is advanced once per block
+// *refund is set to the gas of the ops SE/SNE jumped over, which a metered caller gives back
+int ir_exec_block(CPU *cpu, const IrBlock *block, uint32_t *refund) {
+    uint8_t *v = cpu->registers;
+    uint16_t skipped = 0;  // Ops jumped over by SE/SNE: not executed, so not clocked
+    uint16_t taken;
+    uint16_t i;
+
+    *refund = 0;
+
+    for (i = 0; i < block->length; i++) {
+        const MicroOp *op = &block->ops[i];
+        switch (op->kind) {
+            case UOP_LD_K: v[op->dst] = op->imm; break;
+            case UOP_LD_Y: v[op->dst] = v[op->src]; break;
+            case UOP_ADD_K: v[op->dst] += op->imm; break;
+            case UOP_OR: v[op->dst] |= v[op->src]; break;
+            case UOP_AND: v[op->dst] &= v[op->src]; break;
+            case UOP_XOR: v[op->dst] ^= v[op->src]; break;
+            case UOP_ADD_XY: {
+                uint16_t sum = v[op->dst] + v[op->src];
+                v[op->dst] = sum & 0xFF;
+                v[0xF] = sum > 0xFF;  // Set carry flag VF
+                break;
+            }
+            case UOP_SE_K:
+                taken = (v[op->dst] == op->imm);
+                i += taken;
+                skipped += taken;
+                *refund += taken * block->ops[i].gas;
+                break;
+            case UOP_SNE_K:
+                taken = (v[op->dst] != op->imm);
+                i += taken;
+                skipped += taken;
+                *refund += taken * block->ops[i].gas;
+                break;
+            case UOP_SE_Y:
+                taken = (v[op->dst] == v[op->src]);
+                i += taken;
+                skipped += taken;
+                *refund += taken * block->ops[i].gas;
+                break;
+            case UOP_JMP:
+                advance_clock(cpu, i + 1 - skipped);
+                cpu->position_in_memory = op->target;
+                return 1;
+            case UOP_CALL:
+                advance_clock(cpu, i + 1 - skipped);
+                cpu->position_in_memory = (block->start_pc + 2 * i + 2) & ADDRESS_MASK;
+                call(cpu, op->target);
+                return 1;
+            case UOP_RET:
+                advance_clock(cpu, i + 1 - skipped);
+                ret(cpu);
+                return 1;
+            case UOP_HALT:
+                advance_clock(cpu, i + 1 - skipped);
+                cpu->position_in_memory = (block->start_pc + 2 * i + 2) & ADDRESS_MASK;
+                return 0;
+            case UOP_EXIT:
+                advance_clock(cpu, i - skipped);
+                cpu->position_in_memory = (block->start_pc + 2 * i) & ADDRESS_MASK;
+                return execute(cpu, fetch(cpu));
+            case UOP_FALLTHROUGH:
+                advance_clock(cpu, i - skipped);
+                cpu->position_in_memory = op->target;
+                return 1;
+            case UOP_CALL_UNCHECKED:
+                advance_clock(cpu, i + 1 - skipped);
+                cpu->stack[cpu->stack_pointer++] = (block->start_pc + 2 * i + 2) & ADDRESS_MASK;
+                cpu->position_in_memory = op->target;
+                return 1;
+            case UOP_RET_UNCHECKED:
+                advance_clock(cpu, i + 1 - skipped);
+                cpu->position_in_memory = cpu->stack[--cpu->stack_pointer] & ADDRESS_MASK;
+                return 1;
+        }
+    }
+
+    // A skip jumped over the terminator
+    advance_clock(cpu, i - skipped);
+    cpu->position_in_memory = (block->start_pc + 2 * i) & ADDRESS_MASK;
+    return 1;
+}
+
+// Function to point a cache at an instance's ROM and check that its blocks may run from the instance's state
+// Blocks translated without stack checks are only safe when entered through the proven entry with room on the stack
+static int ir_enter(IrCache *cache, const CPU *cpu) {
+    if (memcmp(cache->memory, cpu->memory, sizeof(cache->memory)) != 0) {
+        ir_cache_rebind(cache, cpu->memory);
+    }
+    return !cache->elide_stack_checks ||
+           (cpu->position_in_memory == cache->stack.entry &&
+            cpu->stack_pointer + cache->stack.max_depth <= sizeof(cpu->stack) / sizeof(cpu->stack[0]));
+}
+
+// Function to run an instance through translated blocks until HALT
+void run_ir(CPU *cpu, IrCache *cache) {
+    IrBlock scratch;
+
+    if (!ir_enter(cache, cpu)) {
+        run(cpu);
+        return;
+    }
+
+    while (1) {
+        const IrBlock *block = ir_lookup(cache, cpu->position_in_memory, &scratch);
+        uint32_t refund;
+        if (!ir_exec_block(cpu, block, &refund)) {
+            break;  // HALT
+        }
+        if (block->ops[block->length - 1].kind == UOP_EXIT &&
+            (cache->synced != cpu || cache->synced_writes != cpu->writes.clock)) {
+            ir_cache_sync(cache, cpu);  // Only opcodes left to execute() can store to memory
+        }
+    }
+}
+
+// Function to run through translated blocks until the clock reaches end; returns a RUN_* status
+// A block runs whole only when it cannot cross end, so input changed at that point is seen by exactly
+// the instructions run_for() would show it to; the last stretch runs one instruction at a time
+// The caller has checked ir_enter() for the run this continues
+static int ir_run_until(CPU *cpu, IrCache *cache, uint64_t end) {
+    IrBlock scratch;
+
+    while (cpu->cycles < end) {
+        const IrBlock *block = ir_lookup(cache, cpu->position_in_memory, &scratch);
+        uint32_t refund;
+
+        if (end - cpu->cycles < block->length) {
+            while (cpu->cycles < end) {
+                if (!execute(cpu, fetch(cpu))) {
+                    return RUN_HALTED;
+                }
+            }
+            break;
+        }
+        if (!ir_exec_block(cpu, block, &refund)) {
+            return RUN_HALTED;
+        }
+        if (block->ops[block->length - 1].kind == UOP_EXIT &&
+            (cache->synced != cpu || cache->synced_writes != cpu->writes.clock)) {
+            ir_cache_sync(cache, cpu);  // Only opcodes left to execute() can store to memory
+        }
+    }
+    return RUN_BUDGET;
+}
+
+// Function to run through translated blocks for budget instructions of virtual time; returns a RUN_* status
+int run_ir_for(CPU *cpu, IrCache *cache, uint64_t budget) {
+    if (!ir_enter(cache, cpu)) {
+        return run_for(cpu, budget);
+    }
+    return ir_run_until(cpu, cache, cpu->cycles + budget);
+}
+
+// Function to find the deepest call nesting reachable from a subroutine entry
+// Returns -1 for recursion or a RET at the top level
+static int explore_call_depth(const uint8_t *memory, uint16_t entry, int top_level, uint8_t *state, int *depth,
+                              uint64_t *pages) {
+    if (state[entry] == 1) {
+        return -1;  // Recursion: depth cannot be bounded
+    }
+    if (state[entry] == 2) {
+        return depth[entry];
+    }
+    state[entry] = 1;
+
+    uint8_t *seen = calloc(MEMORY_SIZE, 1);
+    uint16_t *worklist = malloc(MEMORY_SIZE * sizeof(uint16_t));
+    if (seen == NULL || worklist == NULL) {
+        printf("Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int deepest = 0;
+    size_t pending = 0;
+    worklist[pending++] = entry;
+    seen[entry] = 1;
+
+    while (pending > 0 && deepest >= 0) {
+        uint16_t pc = worklist[--pending];
+        uint16_t opcode = (memory[pc] << 8) | memory[pc + 1];
+        int op = decode_opcode(opcode);
+        uint16_t successors[2];
+        int count = 0;
+
+        *pages |= ((uint64_t)1 << (pc / PAGE_SIZE)) | ((uint64_t)1 << (((pc + 1) & ADDRESS_MASK) / PAGE_SIZE));
+        if (op == OP_HALT) {
+            // HALT ends the path
+        } else if (op == OP_RET) {
+            if (top_level) {
+                deepest = -1;  // RET with nothing pushed by this code would underflow
+            }
+        } else if (op == OP_JMP) {
+            successors[count++] = opcode & 0x0FFF;
+        } else if (op == OP_CALL) {
+            int callee = explore_call_depth(memory, opcode & 0x0FFF, 0, state, depth, pages);
+            if (callee < 0) {
+                deepest = -1;
+            } else if (callee + 1 > deepest) {
+                deepest = callee + 1;
+            }
+            successors[count++] = (pc + 2) & ADDRESS_MASK;  // Where the callee returns to
+        } else if (op_info[op].flags & OPF_SKIP) {
+            successors[count++] = (pc + 2) & ADDRESS_MASK;
+            successors[count++] = (pc + 4) & ADDRESS_MASK;
+        } else if (op != OP_UNKNOWN) {
+            // Stores are followed as data writes; ir_cache_sync() drops the proof if one rewrites code
+            successors[count++] = (pc + 2) & ADDRESS_MASK;
+        } else {
+            // Unhandled opcode: execution stops there
+        }
+
+        for (int s = 0; s < count; s++) {
+            if (!seen[successors[s]]) {
+                seen[successors[s]] = 1;
+                worklist[pending++] = successors[s];
+            }
+        }
+    }
+
+    free(seen);
+    free(worklist);
+    state[entry] = 2;
+    depth[entry] = deepest;
+    return deepest;
+}
+
+// Function to prove a bound on call depth over the ROM call graph reachable from entry
+StackAnalysis analyze_stack_depth(const uint8_t *memory, uint16_t entry) {
+    StackAnalysis result = {entry, 0, 0, 0};
+    uint8_t *state = calloc(MEMORY_SIZE, 1);    // 0 = unvisited, 1 = on the call path, 2 = done
+    int *depth = calloc(MEMORY_SIZE, sizeof(int));
+    if (state == NULL || depth == NULL) {
+        printf("Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int deepest = explore_call_depth(memory, entry, 1, state, depth, &result.code_pages);
+    if (deepest >= 0 && deepest <= 0xFF) {
+        result.bounded = 1;
+        result.max_depth = (uint8_t)deepest;
+    }
+
+    free(state);
+    free(depth);
+    return result;
+}
+
+// Function to rewrite a block's CALL/RET into their unchecked forms
+void ir_elide_stack_checks(IrBlock *block) {
+    MicroOp *last = &block->ops[block->length - 1];
+    if (last->kind == UOP_CALL) {
+        last->kind = UOP_CALL_UNCHECKED;
+    } else if (last->kind == UOP_RET) {
+        last->kind = UOP_RET_UNCHECKED;
+    }
+}
+
+// Function to switch a cache to unchecked CALL/RET if the ROM is proven safe from entry
+// Returns 1 if the checks were elided
+int ir_cache_elide_stack_checks(IrCache *cache, uint16_t entry) {
+    StackAnalysis analysis = analyze_stack_depth(cache->memory, entry);
+    if (!analysis.bounded || analysis.max_depth > sizeof(((CPU *)0)->stack) / sizeof(((CPU *)0)->stack[0])) {
+        return 0;
+    }
+
+    ir_cache_free(cache);  // Blocks translated so far still carry the checks
+    memset(cache->heat, 0, sizeof(cache->heat));
+    cache->stack = analysis;
+    cache->elide_stack_checks = 1;
+    return 1;
+}
+
+// Function to write value into the lanes of mask and keep dst elsewhere
+static void vector_merge(uint8_t dst[VECTOR_LANES], const uint8_t value[VECTOR_LANES], const uint8_t mask[VECTOR_LANES]) {
+    for (int lane = 0; lane < VECTOR_LANES; lane++) {
+        dst[lane] = (value[lane] & mask[lane]) | (dst[lane] & ~mask[lane]);
+    }
+}
+
+// Function to interpret one block's non-terminator ops over every lane: each op selects its loop once,
+// and that loop over the SoA register file is branch-free so the compiler vectorizes it
+static void vector_block_exec(VectorGroup *group, const IrBlock *block) {
+    for (uint16_t i = 0; i + 1 < block->length; i++) {
+        const MicroOp *op = &block->ops[i];
+        uint8_t *vx = group->registers[op->dst];
+        const uint8_t *vy = group->registers[op->src];
+        uint8_t *vf = group->registers[0xF];
+        uint8_t mask[VECTOR_LANES];
+        uint8_t value[VECTOR_LANES];
+
+        for (int lane = 0; lane < VECTOR_LANES; lane++) {
+            mask[lane] = group->live[lane] & ~group->skip[lane];
+            group->skipped[lane] += group->skip[lane] & 1;
+        }
+
+        switch (op->kind) {
+            case UOP_SE_K:
+            case UOP_SNE_K:
+            case UOP_SE_Y:
+                for (int lane = 0; lane < VECTOR_LANES; lane++) {
+                    uint8_t other = (op->kind == UOP_SE_Y) ? vy[lane] : op->imm;
+                    uint8_t equal = (vx[lane] == other) ? 0xFF : 0x00;
+                    group->skip[lane] = mask[lane] & ((op->kind == UOP_SNE_K) ? (uint8_t)~equal : equal);
+                }
+                continue;  // The skip mask predicates the next instruction
+            case UOP_ADD_XY:
+                for (int lane = 0; lane < VECTOR_LANES; lane++) {
+                    uint8_t sum = vx[lane] + vy[lane];
+                    uint8_t carry = sum < vx[lane];
+                    vx[lane] = (sum & mask[lane]) | (vx[lane] & ~mask[lane]);
+                    vf[lane] = (carry & mask[lane]) | (vf[lane] & ~mask[lane]);  // Set carry flag VF
+                }
+                break;
+            case UOP_LD_K:
+                memset(value, op->imm, sizeof(value));
+                vector_merge(vx, value, mask);
+                break;
+            case UOP_LD_Y:
+                vector_merge(vx, vy, mask);
+                break;
+            case UOP_ADD_K:
+                for (int lane = 0; lane < VECTOR_LANES; lane++) {
+                    value[lane] = vx[lane] + op->imm;
+                }
+                vector_merge(vx, value, mask);
+                break;
+            case UOP_OR:
+                for (int lane = 0; lane < VECTOR_LANES; lane++) {
+                    value[lane] = vx[lane] | vy[lane];
+                }
+                vector_merge(vx, value, mask);
+                break;
+            case UOP_AND:
+                for (int lane = 0; lane < VECTOR_LANES; lane++) {
+                    value[lane] = vx[lane] & vy[lane];
+                }
+                vector_merge(vx, value, mask);
+                break;
+            default:
+                for (int lane = 0; lane < VECTOR_LANES; lane++) {
+                    value[lane] = vx[lane] ^ vy[lane];
+                }
+                vector_merge(vx, value, mask);
+                break;
+        }
+        memset(group->skip, 0, sizeof(group->skip));
+    }
+}
+
+// Function to run a group in lockstep through translated blocks
+// Returns 1 when every lane halts together, 0 when lanes diverge at a control-flow instruction
+int vector_run(VectorGroup *group, IrCache *cache) {
+    CPU *cpu = &group->shared;
+    IrBlock scratch;
+
+    while (1) {
+        const IrBlock *block = ir_lookup(cache, cpu->position_in_memory, &scratch);
+        const MicroOp *last = &block->ops[block->length - 1];
+
+        vector_block_exec(group, block);
+        cpu->position_in_memory = (block->start_pc + 2 * (block->length - 1)) & ADDRESS_MASK;
+        cpu->cycles += block->length - 1;
+        if (last->kind == UOP_FALLTHROUGH) {
+            continue;  // Pending skips carry over into the next block
+        }
+
+        // Control flow runs once on the shared state, but only if no lane skipped past it
+        int diverged = 0;
+        for (int lane = 0; lane < VECTOR_LANES; lane++) {
+            diverged |= group->skip[lane];
+        }
+        if (diverged || last->kind == UOP_EXIT) {
+            return 0;  // The scalar path takes over
+        }
+        if (!execute(cpu, fetch(cpu))) {
+            return 1;  // Every lane reached HALT together
+        }
+    }
+}
+
+// Function to run many instances through the vector IR interpreter, VECTOR_LANES at a time, with scalar fallback
+void run_vector_ir(CPU *cpus, size_t count, IrCache *cache) {
+    VectorGroup *group = malloc(sizeof(VectorGroup));
+    if (group == NULL) {
+        printf("Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t base = 0; base < count; base += VECTOR_LANES) {
+        size_t lanes = count - base;
+        if (lanes > VECTOR_LANES) {
+            lanes = VECTOR_LANES;
+        }
+
+        int uniform = 1;
+        for (size_t lane = 1; lane < lanes && uniform; lane++) {
+            uniform = shares_machine_state(&cpus[base], &cpus[base + lane]);
+        }
+
+        if (uniform) {
+            if (memcmp(cache->memory, cpus[base].memory, sizeof(cache->memory)) != 0) {
+                ir_cache_rebind(cache, cpus[base].memory);
+            }
+
+            // Gather into structure-of-arrays form
+            memset(group, 0, sizeof(*group));
+            group->shared = cpus[base];
+            group->start_cycles = cpus[base].cycles;
+            group->start_delay_timer = cpus[base].delay_timer;
+            group->start_sound_timer = cpus[base].sound_timer;
+            group->start_writes = cpus[base].writes.clock;
+            for (size_t lane = 0; lane < lanes; lane++) {
+                group->live[lane] = 0xFF;
+                for (int x = 0; x < 16; x++) {
+                    group->registers[x][lane] = cpus[base + lane].registers[x];
+                }
+            }
+
+            int halted = vector_run(group, cache);
+
+            // Scatter back; lanes that skipped are one instruction ahead of the shared PC
+            uint64_t written = pages_written_since(&group->shared, group->start_writes);
+            for (size_t lane = 0; lane < lanes; lane++) {
+                WriteClock writes = cpus[base + lane].writes;  // Bookkeeping per instance, not shared state
+                cpus[base + lane] = group->shared;
+                cpus[base + lane].writes = writes;
+                mark_pages_written(&cpus[base + lane], written);
+                for (int x = 0; x < 16; x++) {
+                    cpus[base + lane].registers[x] = group->registers[x][lane];
+                }
+                settle_lane_clock(&cpus[base + lane], group->start_cycles, group->start_delay_timer,
+                                  group->start_sound_timer, group->shared.cycles - group->skipped[lane]);
+                if (group->skip[lane]) {
+                    cpus[base + lane].position_in_memory = (cpus[base + lane].position_in_memory + 2) & ADDRESS_MASK;
+                }
+            }
+            if (halted) {
+                continue;
+            }
+        }
+
+        for (size_t lane = 0; lane < lanes; lane++) {
+            run(&cpus[base + lane]);
+        }
+    }
+
+    free(group);
+}
+
+// Function to queue bytes for the output stream, writing in large chunks
+static void video_emit(VideoExporter *video, const uint8_t *data, size_t size) {
+    if (video->used + size > VIDEO_BUFFER_SIZE) {
+        fwrite(video->buffer, 1, video->used, video->file);
+        video->used = 0;
+    }
+    if (size > VIDEO_BUFFER_SIZE) {
+        fwrite(data, 1, size, video->file);
+        return;
+    }
+    memcpy(video->buffer + video->used, data, size);
+    video->used += size;
+}
+
+// Function to start a stream; Y4M gets its stream header straight away
+void video_open(VideoExporter *video, FILE *file, int format, int scale) {
+    memset(video, 0, sizeof(*video));
+    video->file = file;
+    video->format = format;
+    video->scale = scale;
+    video->buffer = malloc(VIDEO_BUFFER_SIZE);
+    // Largest frame: one luma byte per output pixel
+    video->frame = malloc((size_t)DISPLAY_WIDTH * DISPLAY_HEIGHT * scale * scale);
+    if (video->buffer == NULL || video->frame == NULL) {
+        printf("Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (format == VIDEO_Y4M) {
+        char header[96];
+        int length = snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F60:1 Ip A1:1 Cmono\n",
+                              DISPLAY_WIDTH * scale, DISPLAY_HEIGHT * scale);
+        video_emit(video, (const uint8_t *)header, (size_t)length);
+    }
+}
+
+// Function to expand one framebuffer row into scale-wide luma bytes (0x00 off, 0xFF on)
+static void video_expand_row(const uint64_t row[2], int scale, uint8_t *out) {
+    static uint8_t lut[256][8];     // Byte of 8 pixels -> 8 luma bytes, leftmost pixel first
+    static int lut_ready = 0;
+    if (!lut_ready) {
+        for (int byte = 0; byte < 256; byte++) {
+            for (int bit = 0; bit < 8; bit++) {
+                lut[byte][bit] = ((byte >> (7 - bit)) & 1) ? 0xFF : 0x00;
+            }
+        }
+        lut_ready = 1;
+    }
+
+    for (int word = 0; word < 2; word++) {
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            const uint8_t *pixels = lut[(row[word] >> shift) & 0xFF];
+            if (scale == 1) {
+                memcpy(out, pixels, 8);  // Eight pixels in one 64-bit store
+                out += 8;
+            } else {
+                for (int bit = 0; bit < 8; bit++) {
+                    memset(out, pixels[bit], (size_t)scale);
+                    out += scale;
+                }
+            }
+        }
+    }
+}
+
+// Function to pack one framebuffer row into scale-wide PBM bits (1 = black = pixel on)
+static void video_pack_row(const uint64_t row[2], int scale, uint8_t *out) {
+    size_t bytes = ((size_t)DISPLAY_WIDTH * scale + 7) / 8;
+    if (scale == 1) {
+        for (int word = 0; word < 2; word++) {
+            for (int shift = 56; shift >= 0; shift -= 8) {
+                *out++ = (uint8_t)(row[word] >> shift);
+            }
+        }
+        return;
+    }
+
+    memset(out, 0, bytes);
+    size_t bit_out = 0;
+    for (int x = 0; x < DISPLAY_WIDTH; x++) {
+        int on = (row[x / 64] >> (63 - x % 64)) & 1;
+        for (int repeat = 0; repeat < scale; repeat++, bit_out++) {
+            if (on) {
+                out[bit_out / 8] |= (uint8_t)(0x80 >> (bit_out % 8));
+            }
+        }
+    }
+}
+
+// Function to emit the held-back frame: its header with the repeat count, if any, then its pixel data
+static void video_flush_frame(VideoExporter *video) {
+    char header[96];
+    int length;
+
+    if (!video->pending) {
+        return;
+    }
+    if (video->format == VIDEO_Y4M) {
+        length = video->repeats ? snprintf(header, sizeof(header), "FRAME XREPEAT=%llu\n", (unsigned long long)video->repeats)
+                                : snprintf(header, sizeof(header), "FRAME\n");
+    } else {
+        length = snprintf(header, sizeof(header), "P4\n");
+        if (video->repeats) {
+            length += snprintf(header + length, sizeof(header) - length, "# repeat %llu\n", (unsigned long long)video->repeats);
+        }
+        length += snprintf(header + length, sizeof(header) - length, "%d %d\n",
+                           DISPLAY_WIDTH * video->scale, DISPLAY_HEIGHT * video->scale);
+    }
+    video_emit(video, (const uint8_t *)header, (size_t)length);
+    video_emit(video, video->frame, video->frame_size);
+    video->pending = 0;
+    video->repeats = 0;
+}
+
+// Function to append the current framebuffer as one frame; an unchanged one only adds to the last frame's repeat count
+// Frames are held back until the next different frame or video_close(), which writes the count
+void video_write_frame(VideoExporter *video, const CPU *cpu) {
+    video->frames++;
+    if (video->pending && memcmp(video->last, cpu->display, sizeof(video->last)) == 0) {
+        video->duplicates++;
+        video->repeats++;
+        return;
+    }
+    video_flush_frame(video);
+
+    int scale = video->scale;
+    size_t width = (size_t)DISPLAY_WIDTH * scale;
+    size_t row_bytes = (video->format == VIDEO_Y4M) ? width : (width + 7) / 8;
+    uint8_t *out = video->frame;
+
+    for (int row = 0; row < DISPLAY_HEIGHT; row++) {
+        if (video->format == VIDEO_Y4M) {
+            video_expand_row(cpu->display[row], scale, out);
+        } else {
+            video_pack_row(cpu->display[row], scale, out);
+        }
+        for (int repeat = 1; repeat < scale; repeat++) {
+            memcpy(out + repeat * row_bytes, out, row_bytes);  // Vertical scaling copies whole rows
+        }
+        out += row_bytes * scale;
+    }
+
+    video->frame_size = (size_t)(out - video->frame);
+    memcpy(video->last, cpu->display, sizeof(video->last));
+    video->pending = 1;
+}
+
+// Function to flush pending output and release the exporter's buffers (the stream stays open)
+void video_close(VideoExporter *video) {
+    video_flush_frame(video);
+    if (video->used > 0) {
+        fwrite(video->buffer, 1, video->used, video->file);
+        video->used = 0;
+    }
+    fflush(video->file);
+    free(video->buffer);
+    free(video->frame);
+    video->buffer = NULL;
+    video->frame = NULL;
+}
+
+// Function to prepare a renderer; the first frame is drawn in full
+void terminal_open(TerminalRenderer *term, int fd) {
+    memset(term, 0, sizeof(*term));
+    term->fd = fd;
+    term->buffer = malloc(TERMINAL_BUFFER_SIZE);
+    if (term->buffer == NULL) {
+        printf("Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Function to note that the terminal was resized; the next frame redraws everything
+void terminal_resize(TerminalRenderer *term) {
+    term->valid = 0;
+}
+
+// Function to pick the half-block glyph for a cell from the two pixel rows it covers: upper, lower, both or neither
+static const char *terminal_glyph(const uint64_t *upper_row, const uint64_t *lower_row, int column) {
+    static const char *glyphs[4] = {" ", "▄", "▀", "█"};  // Space, lower, upper, full block
+    int shift = 63 - column % 64;
+    int upper = (upper_row[column / 64] >> shift) & 1;
+    int lower = (lower_row[column / 64] >> shift) & 1;
+    return glyphs[(upper << 1) | lower];
+}
+
+// Function to draw a frame as cursor-addressed updates of the changed cells, in one write
+void terminal_render(TerminalRenderer *term, const CPU *cpu) {
+    char *out = term->buffer;
+    int full = !term->valid;
+
+    if (full) {
+        out += sprintf(out, "\x1b[?25l\x1b[H\x1b[2J");  // Hide the cursor and clear the screen
+    }
+
+    for (int row = 0; row < TERMINAL_ROWS; row++) {
+        // Whole cell rows whose two pixel rows are unchanged are skipped word by word
+        if (!full && memcmp(term->shown[2 * row], cpu->display[2 * row], 2 * sizeof(cpu->display[0])) == 0) {
+            continue;
+        }
+
+        int cursor = -1;  // Column the terminal cursor sits at on this row, if known
+        for (int column = 0; column < DISPLAY_WIDTH; column++) {
+            const char *glyph = terminal_glyph(cpu->display[2 * row], cpu->display[2 * row + 1], column);
+            if (!full && glyph == terminal_glyph(term->shown[2 * row], term->shown[2 * row + 1], column)) {
+                continue;
+            }
+
+            if (cursor >= 0 && column - cursor <= 2) {
+                // Re-sending one or two unchanged cells is shorter than a cursor move
+                while (cursor < column) {
+                    out += sprintf(out, "%s", terminal_glyph(cpu->display[2 * row], cpu->display[2 * row + 1], cursor++));
+                    term->cells_sent++;
+                }
+            } else if (cursor != column) {
+                out += sprintf(out, "\x1b[%d;%dH", row + 1, column + 1);
+            }
+            out += sprintf(out, "%s", glyph);
+            term->cells_sent++;
+            cursor = column + 1;
+        }
+    }
+
+    memcpy(term->shown, cpu->display, sizeof(term->shown));
+    term->valid = 1;
+    term->frames++;
+
+    size_t pending = (size_t)(out - term->buffer);
+    const char *next = term->buffer;
+    term->bytes_sent += pending;
+    while (pending > 0) {
+        ssize_t written = write(term->fd, next, pending);
+        if (written <= 0) {
+            break;  // Terminal gone; drop the rest of the frame
+        }
+        next += written;
+        pending -= (size_t)written;
+    }
+}
+
+// Function to restore the cursor and release the renderer
+void terminal_close(TerminalRenderer *term) {
+    static const char restore[] = "\x1b[?25h\n";
+    if (write(term->fd, restore, sizeof(restore) - 1) < 0) {
+        // Nothing left to restore on a closed terminal
+    }
+    free(term->buffer);
+    term->buffer = NULL;
+}
+
+// Function to empty an audio ring
+void audio_ring_init(AudioRing *ring) {
+    memset(ring->samples, 0, sizeof(ring->samples));
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->overruns = 0;
+    ring->underruns = 0;
+}
+
+// Function to publish samples without blocking; whatever does not fit is dropped and counted
+size_t audio_ring_push(AudioRing *ring, const int16_t *samples, size_t count) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t space = AUDIO_RING_SIZE - (head - tail);
+    size_t n = count < space ? count : space;
+
+    for (size_t i = 0; i < n; i++) {
+        ring->samples[(head + i) & (AUDIO_RING_SIZE - 1)] = samples[i];
+    }
+    atomic_store_explicit(&ring->head, head + n, memory_order_release);
+    ring->overruns += count - n;
+    return n;
+}
+
+// Function to take up to count samples that are ready; returns how many were taken
+size_t audio_ring_pop(AudioRing *ring, int16_t *samples, size_t count) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t ready = head - tail;
+    size_t n = count < ready ? count : ready;
+
+    for (size_t i = 0; i < n; i++) {
+        samples[i] = ring->samples[(tail + i) & (AUDIO_RING_SIZE - 1)];
+    }
+    atomic_store_explicit(&ring->tail, tail + n, memory_order_release);
+    return n;
+}
+
+// Function for a real-time sink: always fills count samples, padding with silence on underrun
+void audio_ring_pull(AudioRing *ring, int16_t *samples, size_t count) {
+    size_t n = audio_ring_pop(ring, samples, count);
+    if (n < count) {
+        memset(samples + n, 0, (count - n) * sizeof(samples[0]));
+        ring->underruns += count - n;
+    }
+}
+
+// Function to start generating audio from the CPU's current point in virtual time
+void audio_init(AudioGenerator *audio, AudioRing *ring, uint32_t sample_rate, const CPU *cpu) {
+    memset(audio, 0, sizeof(*audio));
+    audio->ring = ring;
+    audio->sample_rate = sample_rate;
+    audio->pitch = 64;
+    for (int i = 0; i < 16; i++) {
+        audio->pattern[i] = (i & 1) ? 0xFF : 0x00;  // Default square wave: 16-bit period, 250 Hz
+    }
+    audio->start_cycles = cpu->cycles;
+    audio->timer_cycles = cpu->cycles;
+    audio->timer = cpu->sound_timer;
+}
+
+// Function to compute the pattern step per sample, in 1/65536ths of a bit
+static uint32_t audio_phase_step(const AudioGenerator *audio) {
+    double rate = 4000.0;
+    for (int p = 64; p < audio->pitch; p++) {
+        rate *= 1.0145453349375237;  // 2^(1/48)
+    }
+    for (int p = audio->pitch; p < 64; p++) {
+        rate /= 1.0145453349375237;
+    }
+    return (uint32_t)(rate * 65536.0 / audio->sample_rate);
+}
+
+// Function to push the samples due by guest clock cycle, sounding the pattern or silence
+static void audio_fill(AudioGenerator *audio, uint64_t cycle, int playing, uint32_t step) {
+    uint64_t due = (cycle - audio->start_cycles) * audio->sample_rate / CYCLES_PER_SECOND;
+    int16_t block[AUDIO_BLOCK];
+
+    while (audio->samples < due) {
+        size_t n = due - audio->samples < AUDIO_BLOCK ? (size_t)(due - audio->samples) : AUDIO_BLOCK;
+        if (playing) {
+            for (size_t i = 0; i < n; i++) {
+                uint32_t bit = (audio->phase >> 16) & 127;
+                int on = (audio->pattern[bit >> 3] >> (7 - (bit & 7))) & 1;
+                block[i] = on ? AUDIO_AMPLITUDE : -AUDIO_AMPLITUDE;
+                audio->phase += step;
+            }
+        } else {
+            memset(block, 0, n * sizeof(block[0]));
+        }
+        // Samples that do not fit are dropped but still counted, so audio stays in step with guest time
+        audio_ring_push(audio->ring, block, n);
+        audio->samples += n;
+    }
+}
+
+// Function to generate samples from timer_cycles up to cycle while the sound timer counts down on its own
+// The tone stops at the tick that takes the timer to zero, not where the caller happens to look
+static void audio_play_until(AudioGenerator *audio, uint64_t cycle, uint32_t step) {
+    uint64_t ticks = cycle / CYCLES_PER_TICK - audio->timer_cycles / CYCLES_PER_TICK;
+
+    if (audio->timer > 0) {
+        uint64_t silent = (audio->timer_cycles / CYCLES_PER_TICK + audio->timer) * CYCLES_PER_TICK;
+        audio_fill(audio, silent < cycle ? silent : cycle, 1, step);
+    }
+    audio_fill(audio, cycle, 0, step);
+    audio->timer = ticks >= audio->timer ? 0 : audio->timer - (uint8_t)ticks;
+    audio->timer_cycles = cycle;
+}
+
+// Function to generate samples up to the CPU's virtual time; call it once per frame
+// Between calls the sound timer only counts down except where FX18 sets it; the latest FX18 is replayed at
+// its own cycle, so with several FX18 in one call's stretch only the last one is placed exactly
+void audio_generate(AudioGenerator *audio, const CPU *cpu) {
+    uint32_t step = audio_phase_step(audio);
+
+    if (cpu->cycles < audio->timer_cycles) {
+        audio->timer_cycles = cpu->cycles;  // The instance was rewound: carry on from its present
+    }
+    if (cpu->writes.sound_cycles > audio->timer_cycles && cpu->writes.sound_cycles <= cpu->cycles) {
+        audio_play_until(audio, cpu->writes.sound_cycles, step);
+        audio->timer = cpu->writes.sound_value;
+    }
+    audio_play_until(audio, cpu->cycles, step);
+    audio->timer = cpu->sound_timer;  // Agrees unless the instance was restored or edited behind our back
+}
+
+// Function to write a little-endian integer of the given width
+static void wav_put(FILE *file, uint32_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        fputc((value >> (8 * i)) & 0xFF, file);
+    }
+}
+
+// Function to write the WAV header; the sizes are filled in by wav_close
+static void wav_header(WavSink *wav) {
+    fwrite("RIFF", 1, 4, wav->file);
+    wav_put(wav->file, (uint32_t)(36 + wav->data_bytes), 4);
+    fwrite("WAVEfmt ", 1, 8, wav->file);
+    wav_put(wav->file, 16, 4);                    // Format chunk size
+    wav_put(wav->file, 1, 2);                     // PCM
+    wav_put(wav->file, 1, 2);                     // Mono
+    wav_put(wav->file, wav->sample_rate, 4);
+    wav_put(wav->file, wav->sample_rate * 2, 4);  // Bytes per second
+    wav_put(wav->file, 2, 2);                     // Bytes per sample frame
+    wav_put(wav->file, 16, 2);                    // Bits per sample
+    fwrite("data", 1, 4, wav->file);
+    wav_put(wav->file, (uint32_t)wav->data_bytes, 4);
+}
+
+// Function to start a WAV file
+void wav_open(WavSink *wav, FILE *file, uint32_t sample_rate) {
+    wav->file = file;
+    wav->sample_rate = sample_rate;
+    wav->data_bytes = 0;
+    wav_header(wav);
+}
+
+// Function to move every sample currently in the ring into the file
+void wav_drain(WavSink *wav, AudioRing *ring) {
+    int16_t block[AUDIO_BLOCK];
+    size_t n;
+    while ((n = audio_ring_pop(ring, block, AUDIO_BLOCK)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            wav_put(wav->file, (uint16_t)block[i], 2);
+        }
+        wav->data_bytes += n * 2;
+    }
+}
+
+// Function to complete the header with the final sizes
+void wav_close(WavSink *wav) {
+    fflush(wav->file);
+    if (fseek(wav->file, 0, SEEK_SET) == 0) {
+        wav_header(wav);
+    }
+    fflush(wav->file);
+}
+
+// Function to start an empty movie
+void movie_init(InputMovie *movie) {
+    memset(movie, 0, sizeof(*movie));
+}
+
+// Function to release a movie's runs
+void movie_free(InputMovie *movie) {
+    free(movie->runs);
+    movie_init(movie);
+}
+
+// Function to append a run, growing the array as needed
+static void movie_append(InputMovie *movie, uint16_t keys, uint32_t frames) {
+    if (movie->count == movie->capacity) {
+        movie->capacity = movie->capacity ? movie->capacity * 2 : 64;
+        movie->runs = realloc(movie->runs, movie->capacity * sizeof(MovieRun));
+        if (movie->runs == NULL) {
+            printf("Out of memory!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    movie->runs[movie->count].keys = keys;
+    movie->runs[movie->count].frames = frames;
+    movie->count++;
+    movie->frames += frames;
+}
+
+// Function to record the keys held for one more frame
+void movie_record(InputMovie *movie, uint16_t keys) {
+    MovieRun *last = movie->count ? &movie->runs[movie->count - 1] : NULL;
+    if (last != NULL && last->keys == keys && last->frames < UINT32_MAX) {
+        last->frames++;
+        movie->frames++;
+    } else {
+        movie_append(movie, keys, 1);
+    }
+}
+
+// Function to write an unsigned LEB128 varint
+static void movie_put_varint(FILE *file, uint32_t value) {
+    while (value >= 0x80) {
+        fputc((value & 0x7F) | 0x80, file);
+        value >>= 7;
+    }
+    fputc(value, file);
+}
+
+// Function to read an unsigned LEB128 varint; returns -1 on a truncated or oversized value
+static int movie_get_varint(FILE *file, uint32_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        int byte = fgetc(file);
+        if (byte == EOF) {
+            return -1;
+        }
+        *value |= (uint32_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Function to save a movie: magic, run count, then each run as 2 key bytes and a varint length
+void movie_save(const InputMovie *movie, FILE *file) {
+    fwrite(MOVIE_MAGIC, 1, 4, file);
+    movie_put_varint(file, (uint32_t)movie->count);
+    for (size_t i = 0; i < movie->count; i++) {
+        fputc(movie->runs[i].keys & 0xFF, file);
+        fputc(movie->runs[i].keys >> 8, file);
+        movie_put_varint(file, movie->runs[i].frames);
+    }
+}
+
+// Function to load a movie saved by movie_save; returns 0 on success, -1 on a malformed file
+int movie_load(InputMovie *movie, FILE *file) {
+    char magic[4];
+    uint32_t count;
+
+    movie_init(movie);
+    if (fread(magic, 1, 4, file) != 4 || memcmp(magic, MOVIE_MAGIC, 4) != 0 ||
+        movie_get_varint(file, &count) != 0) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        int low = fgetc(file);
+        int high = fgetc(file);
+        uint32_t frames;
+        if (low == EOF || high == EOF || movie_get_varint(file, &frames) != 0 || frames == 0) {
+            movie_free(movie);
+            return -1;
+        }
+        movie_append(movie, (uint16_t)(low | (high << 8)), frames);
+    }
+    return 0;
+}
+
+// Function to play a movie from the CPU's current state; returns the last RUN_* status
+int movie_play(CPU *cpu, const InputMovie *movie) {
+    uint64_t end = cpu->cycles;
+    int status = RUN_BUDGET;
+
+    for (size_t i = 0; i < movie->count; i++) {
+        // Keys change exactly on frame boundaries counted from the start of playback
+        cpu->keys = movie->runs[i].keys;
+        end += (uint64_t)movie->runs[i].frames * CYCLES_PER_FRAME;
+        status = run_for(cpu, end - cpu->cycles);
+        if (status == RUN_HALTED) {
+            break;
+        }
+    }
+    return status;
+}
+
+// Function to play a movie like movie_play, running through the cache's translated blocks
+int movie_play_ir(CPU *cpu, IrCache *cache, const InputMovie *movie) {
+    uint64_t end = cpu->cycles;
+    int status = RUN_BUDGET;
+
+    if (!ir_enter(cache, cpu)) {
+        return movie_play(cpu, movie);
+    }
+    for (size_t i = 0; i < movie->count; i++) {
+        cpu->keys = movie->runs[i].keys;
+        end += (uint64_t)movie->runs[i].frames * CYCLES_PER_FRAME;
+        status = ir_run_until(cpu, cache, end);
+        if (status == RUN_HALTED) {
+            break;
+        }
+    }
+    return status;
+}
+
+// Work shared by the movie playback threads
+typedef struct {
+    const CPU *start;               // State every movie starts from
+    const InputMovie *movies;       // Movies to play
+    CPU *results;                   // Final state of each movie
+    int *outcomes;                  // Final RUN_* status of each movie, or NULL
+    size_t count;                   // Number of movies
+    _Atomic size_t next;            // Next movie to hand out
+} MoviePool;
+
+// Function run by each worker: claim movies one at a time until none are left
+static void *movie_worker(void *arg) {
+    MoviePool *pool = arg;
+    size_t i;
+    while ((i = atomic_fetch_add(&pool->next, 1)) < pool->count) {
+        pool->results[i] = *pool->start;
+        int status = movie_play(&pool->results[i], &pool->movies[i]);
+        if (pool->outcomes != NULL) {
+            pool->outcomes[i] = status;
+        }
+    }
+    return NULL;
+}
+
+// Function to play many movies against one starting state on a pool of threads
+void play_movies(const CPU *start, const InputMovie *movies, size_t count, CPU *results, int *outcomes, int threads) {
+    MoviePool pool = {start, movies, results, outcomes, count, 0};
+    pthread_t *workers = malloc((size_t)threads * sizeof(pthread_t));
+    int started = 0;
+
+    if (workers == NULL) {
+        printf("Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    while (started < threads - 1 && pthread_create(&workers[started], NULL, movie_worker, &pool) == 0) {
+        started++;
+    }
+    movie_worker(&pool);  // The calling thread works too; it also covers any threads that failed to start
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+}
+
+// Function to copy every CPU field except the memory array
+static void copy_cpu_state(CPU *dst, const CPU *src) {
+    size_t before = offsetof(CPU, memory);
+    size_t after = offsetof(CPU, memory) + sizeof(src->memory);
+    memcpy(dst, src, before);
+    memcpy((uint8_t *)dst + after, (const uint8_t *)src + after, sizeof(CPU) - after);
+}
+
+// Function to copy the pages in mask from one memory image to another; returns the page count
+static int copy_pages(uint8_t *dst, const uint8_t *src, uint64_t mask) {
+    int copied = 0;
+    for (int page = 0; mask != 0; page++, mask >>= 1) {
+        if (mask & 1) {
+            memcpy(dst + (size_t)page * PAGE_SIZE, src + (size_t)page * PAGE_SIZE, PAGE_SIZE);
+            copied++;
+        }
+    }
+    return copied;
+}
+
+// Function to save a CPU; after the first take only pages written since the last take or restore are copied
+// Host code that changes memory without store() must call mark_pages_written(). Returns the pages copied
+int snapshot_take(CpuSnapshot *snapshot, CPU *cpu) {
+    int copied = MEMORY_PAGES;
+    if (!snapshot->valid) {
+        memcpy(snapshot->state.memory, cpu->memory, sizeof(cpu->memory));
+        snapshot->valid = 1;
+    } else {
+        copied = copy_pages(snapshot->state.memory, cpu->memory, pages_written_since(cpu, snapshot->mark));
+    }
+    copy_cpu_state(&snapshot->state, cpu);
+    snapshot->mark = cpu->writes.clock;
+    return copied;
+}
+
+// Function to put a CPU back to its last snapshot, copying only the pages written since; returns the pages copied
+// The restored pages count as written for every other consumer of the CPU's write clock
+int snapshot_restore(CpuSnapshot *snapshot, CPU *cpu) {
+    uint64_t pages = pages_written_since(cpu, snapshot->mark);
+    int copied = copy_pages(cpu->memory, snapshot->state.memory, pages);
+    WriteClock writes = cpu->writes;
+
+    copy_cpu_state(cpu, &snapshot->state);
+    cpu->writes = writes;
+    mark_pages_written(cpu, pages);
+    snapshot->mark = cpu->writes.clock;
+    return copied;
+}
+
+// Function to prepare run-ahead with the given number of speculative frames
+void run_ahead_init(RunAhead *ahead, int frames_ahead) {
+    memset(ahead, 0, sizeof(*ahead));
+    ahead->frames_ahead = frames_ahead;
+}
+
+// Function to run one real frame with keys, then frames_ahead more speculatively and roll them back
+// The speculative framebuffer is left in ahead->display; returns the real frame's RUN_* status
+// Audio and other outputs should be taken from the real CPU, never from speculative frames
+int run_ahead_frame(RunAhead *ahead, CPU *cpu, uint16_t keys) {
+    cpu->keys = keys;
+    int status = run_for(cpu, CYCLES_PER_FRAME);
+
+    if (status != RUN_HALTED && ahead->frames_ahead > 0) {
+        ahead->pages_copied += snapshot_take(&ahead->snapshot, cpu);
+
+        for (int frame = 0; frame < ahead->frames_ahead; frame++) {
+            if (run_for(cpu, CYCLES_PER_FRAME) == RUN_HALTED) {
+                break;
+            }
+        }
+        memcpy(ahead->display, cpu->display, sizeof(ahead->display));
+        ahead->hires = cpu->hires;
+
+        ahead->pages_copied += snapshot_restore(&ahead->snapshot, cpu);
+    } else {
+        memcpy(ahead->display, cpu->display, sizeof(ahead->display));
+        ahead->hires = cpu->hires;
+    }
+    return status;
+}
+
+// Function to start keeping rollback history from the CPU's current state
+void rollback_init(Rollback *rollback, CPU *cpu) {
+    memset(rollback, 0, sizeof(*rollback));
+    snapshot_take(&rollback->shadow, cpu);
+}
+
+// Function to simulate the next frame with keys, recording what is needed to undo it
+int rollback_advance(Rollback *rollback, CPU *cpu, uint16_t keys) {
+    RollbackFrame *slot = &rollback->frames[rollback->frame % ROLLBACK_FRAMES];
+
+    copy_cpu_state(&slot->start, cpu);
+    slot->keys = keys;
+    cpu->keys = keys;
+    int status = run_for(cpu, CYCLES_PER_FRAME);
+
+    // The shadow still holds the pages as they were before this frame
+    slot->pages = pages_written_since(cpu, rollback->shadow.mark);
+    for (int page = 0; page < MEMORY_PAGES; page++) {
+        if ((slot->pages >> page) & 1) {
+            memcpy(slot->undo[page], rollback->shadow.state.memory + (size_t)page * PAGE_SIZE, PAGE_SIZE);
+        }
+    }
+    snapshot_take(&rollback->shadow, cpu);
+
+    rollback->frame++;
+    if (rollback->frame - rollback->first > ROLLBACK_FRAMES) {
+        rollback->first++;  // The oldest frame's slot has just been reused
+    }
+    return status;
+}
+
+// Function to apply a late input for a past frame: rewind to that frame and simulate back to the present
+// Returns the frames re-simulated, 0 if the input matched history, or -1 if the frame is out of range
+int rollback_correct(Rollback *rollback, CPU *cpu, uint64_t frame, uint16_t keys) {
+    if (frame < rollback->first || frame >= rollback->frame) {
+        return -1;  // Too old to rewind to, or not simulated yet
+    }
+    if (rollback->frames[frame % ROLLBACK_FRAMES].keys == keys) {
+        return 0;
+    }
+
+    // Undo frames newest first, in the CPU and in the shadow alike
+    uint64_t present = rollback->frame;
+    uint64_t undone = 0;
+    WriteClock writes = cpu->writes;
+    for (uint64_t f = present; f-- > frame;) {
+        RollbackFrame *slot = &rollback->frames[f % ROLLBACK_FRAMES];
+        undone |= slot->pages;
+        for (int page = 0; page < MEMORY_PAGES; page++) {
+            if ((slot->pages >> page) & 1) {
+                memcpy(cpu->memory + (size_t)page * PAGE_SIZE, slot->undo[page], PAGE_SIZE);
+                memcpy(rollback->shadow.state.memory + (size_t)page * PAGE_SIZE, slot->undo[page], PAGE_SIZE);
+            }
+        }
+    }
+    copy_cpu_state(cpu, &rollback->frames[frame % ROLLBACK_FRAMES].start);
+    cpu->writes = writes;
+    mark_pages_written(cpu, undone);
+    rollback->shadow.mark = cpu->writes.clock;  // The shadow got the same undo
+    rollback->frames[frame % ROLLBACK_FRAMES].keys = keys;
+    rollback->frame = frame;
+    rollback->rollbacks++;
+
+    // Re-simulate with the corrected input and the inputs already recorded for later frames
+    int count = 0;
+    while (rollback->frame < present) {
+        count++;
+        if (rollback_advance(rollback, cpu, rollback->frames[rollback->frame % ROLLBACK_FRAMES].keys) == RUN_HALTED) {
+            break;
+        }
+    }
+    rollback->resimulated += count;
+    return count;
+}
+
+// Function to scramble one 64-bit word for hashing
+static uint64_t hash_mix(uint64_t word) {
+    word *= 0xC2B2AE3D27D4EB4FULL;
+    word = (word << 31) | (word >> 33);
+    return word * 0x9E3779B97F4A7C15ULL;
+}
+
+// Function to hash a byte range, eight bytes per step, into 64 bits; chain calls through seed
+uint64_t hash64(const void *data, size_t size, uint64_t seed) {
+    const uint8_t *bytes = data;
+    uint64_t h = seed ^ (size * 0x9E3779B97F4A7C15ULL);
+    uint64_t word;
+
+    for (; size >= 8; bytes += 8, size -= 8) {
+        memcpy(&word, bytes, 8);
+        h ^= hash_mix(word);
+        h = ((h << 27) | (h >> 37)) * 0x9E3779B97F4A7C15ULL + 0x85EBCA77C2B2AE63ULL;
+    }
+    word = 0;
+    memcpy(&word, bytes, size);
+    h ^= hash_mix(word ^ size);
+
+    // Final avalanche so every input bit reaches every output bit
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    return h ^ (h >> 33);
+}
+
+// Function to hash the machine state and input of a job field by field (skipping struct padding)
+static uint64_t job_hash(const CPU *start, const InputMovie *movie, uint64_t h) {
+    uint64_t sp = start->stack_pointer;
+    h = hash64(start->registers, sizeof(start->registers), h);
+    h = hash64(&start->position_in_memory, sizeof(start->position_in_memory), h);
+    h = hash64(&start->index, sizeof(start->index), h);
+    h = hash64(start->memory, sizeof(start->memory), h);
+    h = hash64(start->stack, sizeof(start->stack), h);
+    h = hash64(&sp, sizeof(sp), h);
+    h = hash64(&start->delay_timer, sizeof(start->delay_timer), h);
+    h = hash64(&start->sound_timer, sizeof(start->sound_timer), h);
+    h = hash64(&start->keys, sizeof(start->keys), h);
+    h = hash64(&start->cycles, sizeof(start->cycles), h);
+    h = hash64(start->display, sizeof(start->display), h);
+    h = hash64(&start->hires, sizeof(start->hires), h);
+    for (size_t i = 0; i < movie->count; i++) {
+        uint64_t run = ((uint64_t)movie->runs[i].keys << 32) | movie->runs[i].frames;
+        h = hash64(&run, sizeof(run), h);
+    }
+    return h;
+}
+
+// Function to compute the content address of a job
+JobKey job_key(const CPU *start, const InputMovie *movie) {
+    JobKey key = {{job_hash(start, movie, 0x243F6A8885A308D3ULL), job_hash(start, movie, 0x13198A2E03707344ULL)}};
+    return key;
+}
+
+// Function to prepare a result cache holding capacity results in memory, with an optional disk directory
+void result_cache_init(ResultCache *cache, size_t capacity, const char *directory) {
+    size_t buckets = 1;
+    while (buckets < 2 * capacity) {
+        buckets <<= 1;
+    }
+
+    memset(cache, 0, sizeof(*cache));
+    cache->entries = malloc(capacity * sizeof(ResultEntry));
+    cache->buckets = malloc(buckets * sizeof(size_t));
+    if ((capacity > 0 && cache->entries == NULL) || cache->buckets == NULL) {
+        printf("Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t b = 0; b < buckets; b++) {
+        cache->buckets[b] = RESULT_NONE;
+    }
+    cache->capacity = capacity;
+    cache->bucket_mask = buckets - 1;
+    cache->newest = RESULT_NONE;
+    cache->oldest = RESULT_NONE;
+    cache->directory = directory;
+}
+
+// Function to release a result cache's memory tier; the disk tier is left in place
+void result_cache_free(ResultCache *cache) {
+    free(cache->entries);
+    free(cache->buckets);
+    cache->entries = NULL;
+    cache->buckets = NULL;
+}
+
+// Function to unlink an entry from the LRU list
+static void result_unlink(ResultCache *cache, size_t i) {
+    ResultEntry *entry = &cache->entries[i];
+    if (entry->newer != RESULT_NONE) {
+        cache->entries[entry->newer].older = entry->older;
+    } else {
+        cache->newest = entry->older;
+    }
+    if (entry->older != RESULT_NONE) {
+        cache->entries[entry->older].newer = entry->newer;
+    } else {
+        cache->oldest = entry->newer;
+    }
+}
+
+// Function to make an entry the most recently used
+static void result_push_newest(ResultCache *cache, size_t i) {
+    cache->entries[i].newer = RESULT_NONE;
+    cache->entries[i].older = cache->newest;
+    if (cache->newest != RESULT_NONE) {
+        cache->entries[cache->newest].newer = i;
+    } else {
+        cache->oldest = i;
+    }
+    cache->newest = i;
+}
+
+// Function to append a little-endian integer of the given width to a blob
+static uint8_t *blob_put(uint8_t *out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        *out++ = (value >> (8 * i)) & 0xFF;
+    }
+    return out;
+}
+
+// Function to read a little-endian integer of the given width from a blob
+static uint64_t blob_get(const uint8_t **in, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value |= (uint64_t)*(*in)++ << (8 * i);
+    }
+    return value;
+}
+
+// Function to write all of a buffer to a file descriptor; returns 0 on success, -1 on error
+static int write_all(int fd, const uint8_t *data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written <= 0) {
+            return -1;
+        }
+        data += written;
+        size -= (size_t)written;
+    }
+    return 0;
+}
+
+// Memory image disk tier entries are encoded against: only pages with a non-zero byte are stored
+static const uint8_t result_blank[MEMORY_SIZE];
+
+// Function to build the disk tier path of a key
+static void result_path(const ResultCache *cache, JobKey key, char *path, size_t size) {
+    snprintf(path, size, "%s/%016llx%016llx.job", cache->directory,
+             (unsigned long long)key.hash[0], (unsigned long long)key.hash[1]);
+}
+
+// Function to find a result in memory; returns the entry index or RESULT_NONE
+static size_t result_find(const ResultCache *cache, JobKey key) {
+    size_t i = cache->buckets[key.hash[0] & cache->bucket_mask];
+    while (i != RESULT_NONE && memcmp(&cache->entries[i].key, &key, sizeof(key)) != 0) {
+        i = cache->entries[i].chain;
+    }
+    return i;
+}
+
+// Function to place a result in the memory tier, evicting the least recently used entry when full
+static void result_remember(ResultCache *cache, JobKey key, const CPU *result, int status) {
+    if (cache->capacity == 0) {
+        return;
+    }
+
+    size_t i = result_find(cache, key);
+    if (i != RESULT_NONE) {
+        result_unlink(cache, i);
+    } else {
+        if (cache->used < cache->capacity) {
+            i = cache->used++;
+        } else {
+            // Evict the oldest entry, removing it from its bucket chain
+            i = cache->oldest;
+            result_unlink(cache, i);
+            size_t *link = &cache->buckets[cache->entries[i].key.hash[0] & cache->bucket_mask];
+            while (*link != i) {
+                link = &cache->entries[*link].chain;
+            }
+            *link = cache->entries[i].chain;
+        }
+        size_t *bucket = &cache->buckets[key.hash[0] & cache->bucket_mask];
+        cache->entries[i].key = key;
+        cache->entries[i].chain = *bucket;
+        *bucket = i;
+    }
+    cache->entries[i].result = *result;
+    cache->entries[i].status = status;
+    result_push_newest(cache, i);
+}
+
+// Function to look a job up, in memory first and then on disk; returns 1 on a hit
+int result_cache_lookup(ResultCache *cache, JobKey key, CPU *result, int *status) {
+    cache->lookups++;
+
+    size_t i = result_find(cache, key);
+    if (i != RESULT_NONE) {
+        result_unlink(cache, i);
+        result_push_newest(cache, i);
+        *result = cache->entries[i].result;
+        *status = cache->entries[i].status;
+        cache->hits++;
+        return 1;
+    }
+
+    if (cache->directory != NULL) {
+        char path[4096];
+        uint8_t entry[RESULT_HEADER + MIGRATION_MAX_BLOB + 1];
+        result_path(cache, key, path, sizeof(path));
+        FILE *file = fopen(path, "rb");
+        if (file != NULL) {
+            size_t size = fread(entry, 1, sizeof(entry), file);
+            fclose(file);
+
+            // Entries from another format version or a foreign writer are misses, never garbage states
+            const uint8_t *in = entry + 4;
+            if (size >= RESULT_HEADER && memcmp(entry, RESULT_MAGIC, 4) == 0 &&
+                blob_get(&in, 2) == RESULT_VERSION) {
+                int stored = (int32_t)blob_get(&in, 4);
+                size_t blob_size = blob_get(&in, 4);
+                if (blob_size == size - RESULT_HEADER && migration_decode(in, blob_size, result_blank, result) == 0) {
+                    *status = stored;
+                    result_remember(cache, key, result, stored);  // Promote to the memory tier
+                    cache->disk_hits++;
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+// Function to store a job's result in memory and, when configured, on disk
+// The entry is written to a temporary file and renamed into place, so readers see all of it or none
+void result_cache_insert(ResultCache *cache, JobKey key, const CPU *result, int status) {
+    result_remember(cache, key, result, status);
+
+    if (cache->directory != NULL) {
+        char path[4096];
+        char temp[4096 + 8];
+        uint8_t entry[RESULT_HEADER + MIGRATION_MAX_BLOB];
+
+        size_t blob_size = migration_encode(result, result_blank, entry + RESULT_HEADER);
+        memcpy(entry, RESULT_MAGIC, 4);
+        uint8_t *out = blob_put(entry + 4, RESULT_VERSION, 2);
+        out = blob_put(out, (uint32_t)status, 4);
+        blob_put(out, blob_size, 4);
+
+        result_path(cache, key, path, sizeof(path));
+        snprintf(temp, sizeof(temp), "%s.XXXXXX", path);
+        int fd = mkstemp(temp);
+        if (fd < 0) {
+            return;
+        }
+        int ok = write_all(fd, entry, RESULT_HEADER + blob_size) == 0;
+        if (close(fd) != 0 || !ok || rename(temp, path) != 0) {
+            remove(temp);  // Never leave a truncated entry behind
+        }
+    }
+}
+
+// Function to report the fraction of lookups answered by either tier
+double result_cache_hit_rate(const ResultCache *cache) {
+    if (cache->lookups == 0) {
+        return 0.0;
+    }
+    return (double)(cache->hits + cache->disk_hits) / (double)cache->lookups;
+}
+
+// Function to run a job through the cache: a repeat returns the stored final state without executing
+int run_job_cached(ResultCache *cache, const CPU *start, const InputMovie *movie, CPU *result) {
+    JobKey key = job_key(start, movie);
+    int status;
+
+    if (result_cache_lookup(cache, key, result, &status)) {
+        return status;
+    }
+    *result = *start;
+    status = movie_play(result, movie);
+    result_cache_insert(cache, key, result, status);
+    return status;
+}
+
+// Function to prepare an empty checkpoint trie holding at most capacity checkpoints
+void checkpoint_trie_init(CheckpointTrie *trie, size_t capacity) {
+    size_t buckets = 1;
+    while (buckets < 2 * capacity) {
+        buckets <<= 1;
+    }
+
+    memset(trie, 0, sizeof(*trie));
+    trie->nodes = malloc(capacity * sizeof(Checkpoint));
+    trie->buckets = malloc(buckets * sizeof(size_t));
+    if ((capacity > 0 && trie->nodes == NULL) || trie->buckets == NULL) {
+        printf("Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t b = 0; b < buckets; b++) {
+        trie->buckets[b] = RESULT_NONE;
+    }
+    trie->capacity = capacity;
+    trie->bucket_mask = buckets - 1;
+    trie->newest = RESULT_NONE;
+    trie->oldest = RESULT_NONE;
+}
+
+// Function to release every checkpoint
+void checkpoint_trie_free(CheckpointTrie *trie) {
+    free(trie->nodes);
+    free(trie->buckets);
+    trie->nodes = NULL;
+    trie->buckets = NULL;
+}
+
+// Function to find the checkpoint for a prefix key; returns its node or RESULT_NONE
+static size_t checkpoint_find(const CheckpointTrie *trie, JobKey key) {
+    size_t i = trie->buckets[key.hash[0] & trie->bucket_mask];
+    while (i != RESULT_NONE && memcmp(&trie->nodes[i].key, &key, sizeof(key)) != 0) {
+        i = trie->nodes[i].chain;
+    }
+    return i;
+}
+
+// Function to unlink a leaf from the LRU leaf list
+static void checkpoint_leaf_unlink(CheckpointTrie *trie, size_t i) {
+    Checkpoint *node = &trie->nodes[i];
+    if (node->newer != RESULT_NONE) {
+        trie->nodes[node->newer].older = node->older;
+    } else {
+        trie->newest = node->older;
+    }
+    if (node->older != RESULT_NONE) {
+        trie->nodes[node->older].newer = node->newer;
+    } else {
+        trie->oldest = node->newer;
+    }
+}
+
+// Function to link a leaf at the most recently used end of the leaf list
+static void checkpoint_leaf_push_newest(CheckpointTrie *trie, size_t i) {
+    trie->nodes[i].newer = RESULT_NONE;
+    trie->nodes[i].older = trie->newest;
+    if (trie->newest != RESULT_NONE) {
+        trie->nodes[trie->newest].newer = i;
+    } else {
+        trie->oldest = i;
+    }
+    trie->newest = i;
+}
+
+// Function to link a leaf at the least recently used end of the leaf list
+static void checkpoint_leaf_push_oldest(CheckpointTrie *trie, size_t i) {
+    trie->nodes[i].older = RESULT_NONE;
+    trie->nodes[i].newer = trie->oldest;
+    if (trie->oldest != RESULT_NONE) {
+        trie->nodes[trie->oldest].older = i;
+    } else {
+        trie->newest = i;
+    }
+    trie->oldest = i;
+}
+
+// Function to free a node for reuse: the pool's next unused node, else the least recently used leaf
+static size_t checkpoint_claim(CheckpointTrie *trie, size_t keep) {
+    if (trie->used < trie->capacity) {
+        return trie->used++;
+    }
+
+    size_t victim = trie->oldest;
+    if (victim == keep && victim != RESULT_NONE) {
+        victim = trie->nodes[victim].newer;
+    }
+    if (victim == RESULT_NONE) {
+        return RESULT_NONE;  // Only the path being extended is left
+    }
+
+    Checkpoint *node = &trie->nodes[victim];
+    size_t *link = &trie->buckets[node->key.hash[0] & trie->bucket_mask];
+    while (*link != victim) {
+        link = &trie->nodes[*link].chain;
+    }
+    *link = node->chain;
+    checkpoint_leaf_unlink(trie, victim);
+    // A parent was used before its child, and the child was the oldest leaf, so the parent is now the oldest
+    if (node->parent != RESULT_NONE && --trie->nodes[node->parent].children == 0) {
+        checkpoint_leaf_push_oldest(trie, node->parent);
+    }
+    trie->evictions++;
+    return victim;
+}
+
+// Function to record the state after a prefix as a child of parent; returns the node or RESULT_NONE
+static size_t checkpoint_insert(CheckpointTrie *trie, JobKey key, uint64_t frames, size_t parent,
+                                const CPU *state, int status) {
+    size_t i = checkpoint_claim(trie, parent);
+    if (i == RESULT_NONE) {
+        return RESULT_NONE;
+    }
+
+    Checkpoint *node = &trie->nodes[i];
+    node->key = key;
+    node->frames = frames;
+    node->parent = parent;
+    node->children = 0;
+    node->status = status;
+    node->state = *state;
+    node->chain = trie->buckets[key.hash[0] & trie->bucket_mask];
+    trie->buckets[key.hash[0] & trie->bucket_mask] = i;
+    checkpoint_leaf_push_newest(trie, i);
+    if (parent != RESULT_NONE && trie->nodes[parent].children++ == 0) {
+        checkpoint_leaf_unlink(trie, parent);
+    }
+    return i;
+}
+
+// Position inside a movie's runs
+typedef struct {
+    size_t run;                     // Run being played
+    uint32_t frame;                 // Frames of that run already consumed
+} MovieCursor;
+
+// Function to hash one piece of input onto both halves of a prefix key
+static void prefix_key_add(JobKey *key, uint64_t piece) {
+    key->hash[0] = hash64(&piece, sizeof(piece), key->hash[0]);
+    key->hash[1] = hash64(&piece, sizeof(piece), key->hash[1]);
+}
+
+// Function to hash the next CHECKPOINT_INTERVAL frames of input onto a prefix key, advancing the cursor
+// Equal keys are hashed as one (keys, frames) piece, so the runs never need expanding to frames
+static JobKey movie_hash_interval(const InputMovie *movie, MovieCursor *cursor, JobKey key) {
+    uint64_t piece = 0;
+    uint32_t left = CHECKPOINT_INTERVAL;
+
+    while (left > 0) {
+        const MovieRun *run = &movie->runs[cursor->run];
+        uint32_t take = run->frames - cursor->frame < left ? run->frames - cursor->frame : left;
+        if (piece != 0 && (uint16_t)(piece >> 32) != run->keys) {
+            prefix_key_add(&key, piece);
+            piece = 0;
+        }
+        piece = ((uint64_t)run->keys << 32) | ((uint32_t)piece + take);
+        left -= take;
+        cursor->frame += take;
+        if (cursor->frame == run->frames) {
+            cursor->run++;
+            cursor->frame = 0;
+        }
+    }
+    prefix_key_add(&key, piece);
+    return key;
+}
+
+// Function to run a job, resuming from the deepest checkpoint that shares its input prefix
+// New checkpoints are left every CHECKPOINT_INTERVAL frames for later jobs to resume from
+int run_job_resumable(CheckpointTrie *trie, const CPU *start, const InputMovie *movie, CPU *result) {
+    InputMovie empty = {0};
+    uint64_t segments = movie->frames / CHECKPOINT_INTERVAL;
+
+    // Deepest checkpoint on this prefix, hashing one interval at a time
+    MovieCursor scan = {0, 0};
+    JobKey prefix = job_key(start, &empty);
+    size_t node = RESULT_NONE;
+    uint64_t depth = 0;
+    JobKey key = prefix;
+    MovieCursor resume = scan;
+    for (uint64_t s = 1; s <= segments; s++) {
+        prefix = movie_hash_interval(movie, &scan, prefix);
+        size_t found = checkpoint_find(trie, prefix);
+        if (found != RESULT_NONE) {
+            node = found;
+            depth = s;
+            key = prefix;
+            resume = scan;
+        }
+    }
+
+    int status = RUN_BUDGET;
+    trie->jobs++;
+    if (node != RESULT_NONE) {
+        if (trie->nodes[node].children == 0) {
+            checkpoint_leaf_unlink(trie, node);
+            checkpoint_leaf_push_newest(trie, node);
+        }
+        *result = trie->nodes[node].state;
+        status = trie->nodes[node].status;
+        trie->frames_resumed += depth * CHECKPOINT_INTERVAL;
+    } else {
+        *result = *start;
+    }
+
+    // Play from the resume point; hashed trails play by up to one interval to key each new checkpoint
+    MovieCursor play = resume;
+    MovieCursor hashed = resume;
+    for (uint64_t frame = depth * CHECKPOINT_INTERVAL; frame < movie->frames && status != RUN_HALTED; frame++) {
+        result->keys = movie->runs[play.run].keys;
+        if (++play.frame == movie->runs[play.run].frames) {
+            play.run++;
+            play.frame = 0;
+        }
+        status = run_for(result, CYCLES_PER_FRAME);
+        trie->frames_run++;
+        if ((frame + 1) % CHECKPOINT_INTERVAL == 0) {
+            key = movie_hash_interval(movie, &hashed, key);
+            node = checkpoint_insert(trie, key, frame + 1, node, result, status);
+        }
+    }
+    return status;
+}
+
+// Function to emit an LZ length that did not fit in its 4-bit token field
+static uint8_t *lz_put_length(uint8_t *out, size_t length) {
+    for (; length >= 255; length -= 255) {
+        *out++ = 255;
+    }
+    *out++ = (uint8_t)length;
+    return out;
+}
+
+// Function to emit one sequence: a token, literals, then an optional back-reference
+static uint8_t *lz_put_sequence(uint8_t *out, const uint8_t *literals, size_t literal_count,
+                                size_t offset, size_t match_length) {
+    uint8_t *token = out++;
+    size_t extra = match_length ? match_length - LZ_MIN_MATCH : 0;
+
+    *token = (uint8_t)(((literal_count < 15 ? literal_count : 15) << 4) | (extra < 15 ? extra : 15));
+    if (literal_count >= 15) {
+        out = lz_put_length(out, literal_count - 15);
+    }
+    memcpy(out, literals, literal_count);
+    out += literal_count;
+    if (match_length) {
+        *out++ = offset & 0xFF;
+        *out++ = offset >> 8;
+        if (extra >= 15) {
+            out = lz_put_length(out, extra - 15);
+        }
+    }
+    return out;
+}
+
+// Function to compress with a greedy LZ77 codec (LZ4-style sequences, 64 KB window)
+// dst must hold LZ_BOUND(size) bytes; returns the compressed size
+size_t lz_compress(const uint8_t *src, size_t size, uint8_t *dst) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    const uint8_t *anchor = src;
+    uint8_t *out = dst;
+    size_t pos = 0;
+
+    memset(table, 0xFF, sizeof(table));
+    while (pos + LZ_MIN_MATCH <= size) {
+        uint32_t word;
+        memcpy(&word, src + pos, 4);
+        uint32_t slot = (word * 2654435761u) >> (32 - LZ_HASH_BITS);
+        uint32_t candidate = table[slot];
+        table[slot] = (uint32_t)pos;
+
+        if (candidate == 0xFFFFFFFFu || pos - candidate > 0xFFFF || memcmp(src + candidate, src + pos, 4) != 0) {
+            pos++;
+            continue;
+        }
+        size_t length = LZ_MIN_MATCH;
+        while (pos + length < size && src[candidate + length] == src[pos + length]) {
+            length++;
+        }
+        out = lz_put_sequence(out, anchor, (size_t)(src + pos - anchor), pos - candidate, length);
+        pos += length;
+        anchor = src + pos;
+    }
+    out = lz_put_sequence(out, anchor, (size_t)(src + size - anchor), 0, 0);
+    return (size_t)(out - dst);
+}
+
+// Function to read an extended LZ length; returns 0 if the input ends early
+static int lz_get_length(const uint8_t **in, const uint8_t *end, size_t *length) {
+    uint8_t byte;
+    do {
+        if (*in >= end) {
+            return 0;
+        }
+        byte = *(*in)++;
+        *length += byte;
+    } while (byte == 255);
+    return 1;
+}
+
+// Function to decompress lz_compress output; returns the decompressed size, or -1 if the input is malformed
+long lz_decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity) {
+    const uint8_t *in = src;
+    const uint8_t *end = src + size;
+    size_t pos = 0;
+
+    while (in < end) {
+        uint8_t token = *in++;
+        size_t literals = token >> 4;
+        if (literals == 15 && !lz_get_length(&in, end, &literals)) {
+            return -1;
+        }
+        if (literals > (size_t)(end - in) || literals > capacity - pos) {
+            return -1;
+        }
+        memcpy(dst + pos, in, literals);
+        in += literals;
+        pos += literals;
+        if (in == end) {
+            break;  // The last sequence has no match
+        }
+
+        if (end - in < 2) {
+            return -1;
+        }
+        size_t offset = in[0] | (in[1] << 8);
+        size_t length = token & 0x0F;
+        in += 2;
+        if (length == 15 && !lz_get_length(&in, end, &length)) {
+            return -1;
+        }
+        length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > pos || length > capacity - pos) {
+            return -1;
+        }
+        for (size_t i = 0; i < length; i++, pos++) {
+            dst[pos] = dst[pos - offset];  // Byte by byte: matches may overlap their own output
+        }
+    }
+    return (long)pos;
+}
+
+// Function to read the monotonic clock in nanoseconds
+static uint64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+// Function to compress a CPU: a mask of all-zero memory pages, then the LZ-coded state without them
+// Pages in shared are held elsewhere and left out of the blob as well
+static uint8_t *park_compress(const CPU *cpu, uint64_t shared, size_t *blob_size) {
+    uint8_t *plain = malloc(sizeof(CPU));
+    uint8_t *packed = malloc(sizeof(uint64_t) + LZ_BOUND(sizeof(CPU)));
+    if (plain == NULL || packed == NULL) {
+        printf("Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // State outside the memory array goes first, then only the pages holding something
+    size_t before = offsetof(CPU, memory);
+    size_t after = offsetof(CPU, memory) + sizeof(cpu->memory);
+    size_t used = 0;
+    uint64_t zero_pages = 0;
+    memcpy(plain, cpu, before);
+    memcpy(plain + before, (const uint8_t *)cpu + after, sizeof(CPU) - after);
+    used = before + sizeof(CPU) - after;
+    for (int page = 0; page < MEMORY_PAGES; page++) {
+        const uint8_t *bytes = cpu->memory + (size_t)page * PAGE_SIZE;
+        if (bytes[0] == 0 && memcmp(bytes, bytes + 1, PAGE_SIZE - 1) == 0) {
+            zero_pages |= (uint64_t)1 << page;
+        } else if (!((shared >> page) & 1)) {
+            memcpy(plain + used, bytes, PAGE_SIZE);
+            used += PAGE_SIZE;
+        }
+    }
+
+    memcpy(packed, &zero_pages, sizeof(zero_pages));
+    *blob_size = sizeof(zero_pages) + lz_compress(plain, used, packed + sizeof(zero_pages));
+    free(plain);
+    uint8_t *blob = realloc(packed, *blob_size);  // Keep only what the compressed image needs
+    return blob != NULL ? blob : packed;
+}
+
+// Function to rebuild a CPU from park_compress output; pages in shared are left zero for the caller
+static void park_decompress(const uint8_t *blob, size_t blob_size, uint64_t shared, CPU *cpu) {
+    uint8_t *plain = malloc(sizeof(CPU));
+    uint64_t zero_pages;
+    if (plain == NULL) {
+        printf("Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(&zero_pages, blob, sizeof(zero_pages));
+    long size = lz_decompress(blob + sizeof(zero_pages), blob_size - sizeof(zero_pages), plain, sizeof(CPU));
+    size_t before = offsetof(CPU, memory);
+    size_t after = offsetof(CPU, memory) + sizeof(cpu->memory);
+    size_t used = before + sizeof(CPU) - after;
+    assert(size >= 0);  // Blobs never leave the process, so a bad one is a bug
+
+    memcpy(cpu, plain, before);
+    memcpy((uint8_t *)cpu + after, plain + before, sizeof(CPU) - after);
+    memset(cpu->memory, 0, sizeof(cpu->memory));  // Also restores the zero guard
+    for (int page = 0; page < MEMORY_PAGES; page++) {
+        if (!(((zero_pages | shared) >> page) & 1)) {
+            memcpy(cpu->memory + (size_t)page * PAGE_SIZE, plain + used, PAGE_SIZE);
+            used += PAGE_SIZE;
+        }
+    }
+    free(plain);
+}
+
+// Function to take a reference on the pool page holding data; returns its id, or POOL_NONE if there is none
+static uint32_t pool_find(PagePool *pool, const uint8_t *data, uint64_t hash) {
+    for (uint32_t id = pool->buckets[hash & (POOL_BUCKETS - 1)]; id != POOL_NONE; id = pool->pages[id].chain) {
+        if (pool->pages[id].hash == hash && memcmp(pool->pages[id].data, data, PAGE_SIZE) == 0) {
+            pool->pages[id].refs++;
+            return id;
+        }
+    }
+    return POOL_NONE;
+}
+
+// Function to take a reference on the pool page holding data, adding the page if it is new
+// Returns the page id and sets *merged when an identical page was already there
+static uint32_t pool_acquire(PagePool *pool, const uint8_t *data, uint64_t hash, int *merged) {
+    uint32_t *bucket = &pool->buckets[hash & (POOL_BUCKETS - 1)];
+    uint32_t found = pool_find(pool, data, hash);
+    if (found != POOL_NONE) {
+        *merged = 1;
+        return found;
+    }
+
+    uint32_t id = pool->free_list;
+    if (id != POOL_NONE) {
+        pool->free_list = pool->pages[id].chain;
+    } else {
+        if (pool->count == pool->capacity) {
+            pool->capacity = pool->capacity ? pool->capacity * 2 : 256;
+            pool->pages = realloc(pool->pages, pool->capacity * sizeof(SharedPage));
+            if (pool->pages == NULL) {
+                printf("Out of memory!\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        id = pool->count++;
+    }
+    memcpy(pool->pages[id].data, data, PAGE_SIZE);
+    pool->pages[id].hash = hash;
+    pool->pages[id].refs = 1;
+    pool->live++;
+    pool->pages[id].chain = *bucket;
+    *bucket = id;
+    *merged = 0;
+    return id;
+}
+
+// Function to drop a reference on a pool page; returns 1 if other references remain
+static int pool_release(PagePool *pool, uint32_t id) {
+    SharedPage *page = &pool->pages[id];
+    if (--page->refs > 0) {
+        return 1;
+    }
+
+    uint32_t *link = &pool->buckets[page->hash & (POOL_BUCKETS - 1)];
+    while (*link != id) {
+        link = &pool->pages[*link].chain;
+    }
+    *link = page->chain;
+    page->chain = pool->free_list;
+    pool->free_list = id;
+    pool->live--;
+    return 0;
+}
+
+// Function to move one parked slot's duplicated pages into the shared pool and re-encode its blob without them
+// A page moves only when the pool already holds it or a sighting shows another parked slot with the same
+// hash; that slot is then scanned again to share the pooled copy. Unique pages stay compressed in the blob
+// Called with the lock held; the slot is marked busy while the lock is dropped for the heavy work
+static void park_dedup_slot(ParkingLot *lot, ParkSlot *slot) {
+    size_t id = (size_t)(slot - lot->slots);
+    CPU *cpu = malloc(sizeof(CPU));
+    if (cpu == NULL) {
+        printf("Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    slot->state = PARK_BUSY;
+    pthread_mutex_unlock(&lot->lock);
+    park_decompress(slot->blob, slot->blob_size, slot->shared_pages, cpu);
+    uint64_t hashes[MEMORY_PAGES];
+    uint64_t candidates = 0;
+    for (int page = 0; page < MEMORY_PAGES; page++) {
+        const uint8_t *bytes = cpu->memory + (size_t)page * PAGE_SIZE;
+        if (!((slot->shared_pages >> page) & 1) && !(bytes[0] == 0 && memcmp(bytes, bytes + 1, PAGE_SIZE - 1) == 0)) {
+            hashes[page] = hash64(bytes, PAGE_SIZE, 0);
+            candidates |= (uint64_t)1 << page;
+        }
+    }
+    pthread_mutex_lock(&lot->lock);
+
+    uint64_t moved = 0;
+    for (int page = 0; page < MEMORY_PAGES; page++) {
+        if (!((candidates >> page) & 1)) {
+            continue;
+        }
+        const uint8_t *bytes = cpu->memory + (size_t)page * PAGE_SIZE;
+        PageSighting *sighting = &lot->sightings[hashes[page] & (POOL_SIGHTINGS - 1)];
+        uint32_t shared = pool_find(&lot->pool, bytes, hashes[page]);
+        lot->dedup_scanned_pages++;
+
+        if (shared != POOL_NONE) {
+            lot->reclaimed_bytes += PAGE_SIZE;
+        } else if (sighting->slot != RESULT_NONE && sighting->slot != id && sighting->hash == hashes[page] &&
+                   lot->slots[sighting->slot].state == PARK_PARKED) {
+            // Second copy: pool it and let the first holder merge on its next scan
+            int merged;
+            shared = pool_acquire(&lot->pool, bytes, hashes[page], &merged);
+            lot->slots[sighting->slot].scanned = 0;
+            sighting->slot = RESULT_NONE;
+        } else {
+            sighting->hash = hashes[page];
+            sighting->slot = id;
+            continue;
+        }
+        slot->page_ids[page] = shared;
+        moved |= (uint64_t)1 << page;
+    }
+
+    if (moved != 0) {
+        slot->shared_pages |= moved;
+        pthread_mutex_unlock(&lot->lock);
+        size_t blob_size;
+        uint8_t *blob = park_compress(cpu, slot->shared_pages, &blob_size);
+        pthread_mutex_lock(&lot->lock);
+
+        free(slot->blob);
+        lot->parked_bytes += blob_size;
+        lot->parked_bytes -= slot->blob_size;
+        slot->blob = blob;
+        slot->blob_size = blob_size;
+    }
+    free(cpu);
+    slot->scanned = 1;
+    slot->state = PARK_PARKED;
+    pthread_cond_broadcast(&lot->parked);
+}
+
+// Function to find a parked slot the deduplicator has not scanned yet; returns RESULT_NONE if none
+static size_t park_next_unscanned(ParkingLot *lot) {
+    for (size_t n = 0; n < lot->count; n++) {
+        size_t id = (lot->dedup_cursor + n) % lot->count;
+        if (lot->slots[id].state == PARK_PARKED && !lot->slots[id].scanned) {
+            lot->dedup_cursor = (id + 1) % lot->count;
+            return id;
+        }
+    }
+    return RESULT_NONE;
+}
+
+// Function run by the background thread: compress queued instances until the lot is freed
+// When nothing is queued it deduplicates parked instances, never faster than dedup_rate pages per second
+static void *park_compressor(void *arg) {
+    ParkingLot *lot = arg;
+
+    pthread_mutex_lock(&lot->lock);
+    while (!lot->stopping) {
+        if (lot->queue_head == lot->queue_tail) {
+            size_t id = lot->dedup_rate > 0 ? park_next_unscanned(lot) : RESULT_NONE;
+            if (id == RESULT_NONE) {
+                pthread_cond_wait(&lot->work, &lot->lock);
+                continue;
+            }
+
+            uint64_t now = monotonic_ns();
+            lot->dedup_tokens += (double)(now - lot->dedup_refill_ns) * 1e-9 * lot->dedup_rate;
+            lot->dedup_tokens = lot->dedup_tokens < lot->dedup_rate + MEMORY_PAGES ? lot->dedup_tokens
+                                                                                  : lot->dedup_rate + MEMORY_PAGES;
+            lot->dedup_refill_ns = now;
+            if (lot->dedup_tokens < MEMORY_PAGES) {
+                // Sleep until a whole instance's worth of pages is allowed, or until new work arrives
+                uint64_t wait_ns = (uint64_t)((MEMORY_PAGES - lot->dedup_tokens) / lot->dedup_rate * 1e9);
+                struct timespec until;
+                clock_gettime(CLOCK_MONOTONIC, &until);  // The condition variable waits on this clock
+                until.tv_sec += (time_t)(wait_ns / 1000000000ull);
+                until.tv_nsec += (long)(wait_ns % 1000000000ull);
+                if (until.tv_nsec >= 1000000000L) {
+                    until.tv_sec++;
+                    until.tv_nsec -= 1000000000L;
+                }
+                lot->dedup_cursor = id;  // Come back to the same slot
+                pthread_cond_timedwait(&lot->work, &lot->lock, &until);
+                continue;
+            }
+            lot->dedup_tokens -= MEMORY_PAGES;
+            park_dedup_slot(lot, &lot->slots[id]);
+            continue;
+        }
+        size_t id = lot->queue[lot->queue_head];
+        lot->queue_head = (lot->queue_head + 1) % (lot->count + 1);
+        ParkSlot *slot = &lot->slots[id];
+        slot->in_queue = 0;
+        if (slot->state != PARK_QUEUED) {
+            continue;  // Resumed before its turn came
+        }
+
+        // Compress without the lock; a resumer that arrives now waits on parked
+        slot->state = PARK_BUSY;
+        pthread_mutex_unlock(&lot->lock);
+        size_t blob_size;
+        uint8_t *blob = park_compress(slot->cpu, 0, &blob_size);
+        pthread_mutex_lock(&lot->lock);
+
+        free(slot->cpu);
+        slot->cpu = NULL;
+        slot->blob = blob;
+        slot->blob_size = blob_size;
+        slot->state = PARK_PARKED;
+        lot->parked_instances++;
+        lot->parked_bytes += blob_size;
+        lot->parks++;
+        pthread_cond_broadcast(&lot->parked);
+    }
+    pthread_mutex_unlock(&lot->lock);
+    return NULL;
+}
+
+// Function to create count zeroed instances and start the background compressor
+void parking_init(ParkingLot *lot, size_t count, uint32_t idle_threshold) {
+    memset(lot, 0, sizeof(*lot));
+    lot->slots = calloc(count, sizeof(ParkSlot));
+    lot->queue = malloc((count + 1) * sizeof(size_t));
+    if (lot->slots == NULL || lot->queue == NULL) {
+        printf("Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t id = 0; id < count; id++) {
+        lot->slots[id].cpu = calloc(1, sizeof(CPU));
+        if (lot->slots[id].cpu == NULL) {
+            printf("Out of memory!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    lot->count = count;
+    lot->idle_threshold = idle_threshold;
+    lot->pool.free_list = POOL_NONE;
+    for (size_t i = 0; i < POOL_SIGHTINGS; i++) {
+        lot->sightings[i].slot = RESULT_NONE;
+    }
+    memset(lot->pool.buckets, 0xFF, sizeof(lot->pool.buckets));
+    pthread_mutex_init(&lot->lock, NULL);
+    // Timed waits measure a monotonic clock, so a wall clock step cannot stretch or cut short a nap
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&lot->work, &attributes);
+    pthread_condattr_destroy(&attributes);
+    pthread_cond_init(&lot->parked, NULL);
+    if (pthread_create(&lot->compressor, NULL, park_compressor, lot) != 0) {
+        printf("Cannot start the compressor thread!\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Function to stop the compressor and release every instance
+void parking_free(ParkingLot *lot) {
+    pthread_mutex_lock(&lot->lock);
+    lot->stopping = 1;
+    pthread_cond_signal(&lot->work);
+    pthread_mutex_unlock(&lot->lock);
+    pthread_join(lot->compressor, NULL);
+
+    for (size_t id = 0; id < lot->count; id++) {
+        free(lot->slots[id].cpu);
+        free(lot->slots[id].blob);
+    }
+    free(lot->slots);
+    free(lot->queue);
+    free(lot->pool.pages);
+    pthread_mutex_destroy(&lot->lock);
+    pthread_cond_destroy(&lot->work);
+    pthread_cond_destroy(&lot->parked);
+}
+
+// Function to get an instance ready to run, decompressing it if it was parked
+// The returned CPU stays valid until the instance is next reported idle through parking_note_run
+CPU *parking_acquire(ParkingLot *lot, size_t id) {
+    ParkSlot *slot = &lot->slots[id];
+
+    pthread_mutex_lock(&lot->lock);
+    while (slot->state == PARK_BUSY) {
+        pthread_cond_wait(&lot->parked, &lot->lock);
+    }
+    if (slot->state == PARK_QUEUED) {
+        slot->state = PARK_LIVE;  // Cancel: the compressor skips it
+        slot->idle_runs = 0;
+    } else if (slot->state == PARK_PARKED) {
+        uint64_t start = monotonic_ns();
+        slot->cpu = malloc(sizeof(CPU));
+        if (slot->cpu == NULL) {
+            printf("Out of memory!\n");
+            exit(EXIT_FAILURE);
+        }
+        park_decompress(slot->blob, slot->blob_size, slot->shared_pages, slot->cpu);
+        for (int page = 0; page < MEMORY_PAGES; page++) {
+            if ((slot->shared_pages >> page) & 1) {
+                memcpy(slot->cpu->memory + (size_t)page * PAGE_SIZE, lot->pool.pages[slot->page_ids[page]].data, PAGE_SIZE);
+                lot->reclaimed_bytes -= pool_release(&lot->pool, slot->page_ids[page]) ? PAGE_SIZE : 0;
+            }
+        }
+        slot->shared_pages = 0;
+        slot->scanned = 0;
+        free(slot->blob);
+        lot->parked_bytes -= slot->blob_size;
+        lot->parked_instances--;
+        slot->blob = NULL;
+        slot->blob_size = 0;
+        slot->state = PARK_LIVE;
+        slot->idle_runs = 0;
+
+        uint64_t elapsed = monotonic_ns() - start;
+        lot->resumes++;
+        lot->resume_ns_total += elapsed;
+        if (elapsed > lot->resume_ns_max) {
+            lot->resume_ns_max = elapsed;
+        }
+    }
+    CPU *cpu = slot->cpu;
+    pthread_mutex_unlock(&lot->lock);
+    return cpu;
+}
+
+// Function to enable the background deduplicator of parked pages at a rate limit, or disable it with 0
+void parking_set_dedup_rate(ParkingLot *lot, double pages_per_second) {
+    pthread_mutex_lock(&lot->lock);
+    lot->dedup_rate = pages_per_second;
+    lot->dedup_tokens = 0;
+    lot->dedup_refill_ns = monotonic_ns();
+    pthread_cond_signal(&lot->work);
+    pthread_mutex_unlock(&lot->lock);
+}
+
+// Function to report how an instance's latest run_for() ended; enough idle runs in a row park it
+void parking_note_run(ParkingLot *lot, size_t id, int status) {
+    ParkSlot *slot = &lot->slots[id];
+
+    pthread_mutex_lock(&lot->lock);
+    if (status != RUN_IDLE) {
+        slot->idle_runs = 0;
+    } else if (++slot->idle_runs >= lot->idle_threshold && slot->state == PARK_LIVE) {
+        slot->state = PARK_QUEUED;
+        if (!slot->in_queue) {
+            // A slot resumed while queued keeps its old entry, so the ring never holds more than count
+            slot->in_queue = 1;
+            lot->queue[lot->queue_tail] = id;
+            lot->queue_tail = (lot->queue_tail + 1) % (lot->count + 1);
+        }
+        pthread_cond_signal(&lot->work);
+    }
+    pthread_mutex_unlock(&lot->lock);
+}
+
+// Function to serialize an instance paused between instructions, relative to the ROM both workers hold
+// Only pages that differ from rom are sent; the framebuffer is LZ coded. Returns the blob size
+size_t migration_encode(const CPU *cpu, const uint8_t *rom, uint8_t *blob) {
+    uint8_t *out = blob;
+    uint64_t changed = 0;
+
+    for (int page = 0; page < MEMORY_PAGES; page++) {
+        if (memcmp(cpu->memory + (size_t)page * PAGE_SIZE, rom + (size_t)page * PAGE_SIZE, PAGE_SIZE) != 0) {
+            changed |= (uint64_t)1 << page;
+        }
+    }
+
+    out = blob_put(out, MIGRATION_MAGIC, 2);
+    memcpy(out, cpu->registers, sizeof(cpu->registers));
+    out += sizeof(cpu->registers);
+    out = blob_put(out, cpu->position_in_memory, 2);
+    out = blob_put(out, cpu->index, 2);
+    out = blob_put(out, cpu->stack_pointer, 1);
+    for (size_t i = 0; i < cpu->stack_pointer; i++) {
+        out = blob_put(out, cpu->stack[i], 2);  // Slots above the stack pointer are dead
+    }
+    out = blob_put(out, cpu->delay_timer, 1);
+    out = blob_put(out, cpu->sound_timer, 1);
+    out = blob_put(out, cpu->keys, 2);
+    out = blob_put(out, cpu->cycles, 8);
+    out = blob_put(out, cpu->hires, 1);
+
+    out = blob_put(out, changed, 8);
+    for (int page = 0; page < MEMORY_PAGES; page++) {
+        if ((changed >> page) & 1) {
+            memcpy(out, cpu->memory + (size_t)page * PAGE_SIZE, PAGE_SIZE);
+            out += PAGE_SIZE;
+        }
+    }
+
+    uint8_t *length = out;
+    out += 2;
+    size_t packed = lz_compress((const uint8_t *)cpu->display, sizeof(cpu->display), out);
+    blob_put(length, packed, 2);
+    return (size_t)(out + packed - blob);
+}
+
+// Function to rebuild an instance from a blob; returns 0 on success, -1 if the blob is malformed
+int migration_decode(const uint8_t *blob, size_t size, const uint8_t *rom, CPU *cpu) {
+    const uint8_t *in = blob;
+    const uint8_t *end = blob + size;
+
+    // Fixed part: magic, registers, PC, I, stack pointer
+    if (size < 2 + 16 + 2 + 2 + 1 || blob_get(&in, 2) != MIGRATION_MAGIC) {
+        return -1;
+    }
+    memset(cpu, 0, sizeof(*cpu));
+    memcpy(cpu->registers, in, sizeof(cpu->registers));
+    in += sizeof(cpu->registers);
+    cpu->position_in_memory = blob_get(&in, 2) & ADDRESS_MASK;
+    cpu->index = blob_get(&in, 2) & ADDRESS_MASK;
+    cpu->stack_pointer = blob_get(&in, 1);
+    if (cpu->stack_pointer > sizeof(cpu->stack) / sizeof(cpu->stack[0]) ||
+        (size_t)(end - in) < 2 * cpu->stack_pointer + 1 + 1 + 2 + 8 + 1 + 8) {
+        return -1;
+    }
+    for (size_t i = 0; i < cpu->stack_pointer; i++) {
+        cpu->stack[i] = blob_get(&in, 2);
+    }
+    cpu->delay_timer = blob_get(&in, 1);
+    cpu->sound_timer = blob_get(&in, 1);
+    cpu->keys = blob_get(&in, 2);
+    cpu->cycles = blob_get(&in, 8);
+    cpu->hires = blob_get(&in, 1) != 0;
+
+    uint64_t changed = blob_get(&in, 8);
+    memcpy(cpu->memory, rom, MEMORY_SIZE);
+    for (int page = 0; page < MEMORY_PAGES; page++) {
+        if ((changed >> page) & 1) {
+            if (end - in < PAGE_SIZE) {
+                return -1;
+            }
+            memcpy(cpu->memory + (size_t)page * PAGE_SIZE, in, PAGE_SIZE);
+            in += PAGE_SIZE;
+        }
+    }
+    mark_pages_written(cpu, ~(uint64_t)0);
+
+    if (end - in < 2) {
+        return -1;
+    }
+    size_t packed = blob_get(&in, 2);
+    if ((size_t)(end - in) != packed ||
+        lz_decompress(in, packed, (uint8_t *)cpu->display, sizeof(cpu->display)) != (long)sizeof(cpu->display)) {
+        return -1;
+    }
+    return 0;
+}
+
+// Function to read exactly size bytes from a file descriptor; returns 0 on success, -1 on error or EOF
+static int read_all(int fd, uint8_t *data, size_t size) {
+    while (size > 0) {
+        ssize_t got = read(fd, data, size);
+        if (got <= 0) {
+            return -1;
+        }
+        data += got;
+        size -= (size_t)got;
+    }
+    return 0;
+}
+
+// Function to send an instance over a connected socket as a length-prefixed blob
+int migrate_send(int fd, const CPU *cpu, const uint8_t *rom) {
+    uint8_t blob[4 + MIGRATION_MAX_BLOB];
+    size_t size = migration_encode(cpu, rom, blob + 4);
+    blob_put(blob, size, 4);
+    return write_all(fd, blob, 4 + size);  // One write for the whole blob in the common case
+}
+
+// Function to receive an instance sent by migrate_send; returns 0 on success, -1 on error
+// Write clocks do not travel: every page of the instance arrives as freshly written
+int migrate_receive(int fd, const uint8_t *rom, CPU *cpu) {
+    uint8_t blob[MIGRATION_MAX_BLOB];
+    uint8_t header[4];
+    const uint8_t *in = header;
+
+    if (read_all(fd, header, sizeof(header)) != 0) {
+        return -1;
+    }
+    size_t size = blob_get(&in, 4);
+    if (size > sizeof(blob) || read_all(fd, blob, size) != 0) {
+        return -1;
+    }
+    return migration_decode(blob, size, rom, cpu);
+}
+
+// Page the fork server shares with its children
+typedef struct {
+    pthread_mutex_t lock;           // Process-shared and robust: one child writes its response at a time
+    uint64_t startup_ns[FORK_MAX_CHILDREN];  // Time to first guest instruction, reported by the child in each slot
+} ForkShared;
+
+// Function to run one job in a forked child and write its response; never returns
+// A job plays its movie from the warm state, or with no input runs to HALT, on the warm block cache
+// Nothing here allocates or frees: another thread of the parent may have held the allocator's lock at fork()
+static void fork_server_child(int result_fd, const CPU *warm, IrCache *cache, const InputMovie *movie,
+                              uint32_t job, uint64_t requested_ns, ForkShared *shared, int slot, CPU *cpu, uint8_t *response) {
+    signal(SIGALRM, SIG_DFL);
+    alarm(FORK_JOB_SECONDS);  // A guest that never halts must not wedge the server
+    *cpu = *warm;
+    cache->frozen = 1;        // The child's copy of the cache: run hot blocks, but allocate nothing
+
+    shared->startup_ns[slot] = monotonic_ns() - requested_ns;
+    int status = RUN_HALTED;
+    if (movie->count > 0) {
+        status = movie_play_ir(cpu, cache, movie);
+    } else {
+        run_ir(cpu, cache);
+    }
+    alarm(0);                 // The job is done: a timeout must not cut a response short under the lock
+
+    // Response: job id, RUN_* status, startup time, then the final state as a migration blob
+    uint8_t *out = blob_put(response, job, 4);
+    out = blob_put(out, (uint32_t)status, 4);
+    out = blob_put(out, shared->startup_ns[slot], 8);
+    size_t size = migration_encode(cpu, warm->memory, out + 4);
+    blob_put(out, size, 4);
+
+    // Responses are larger than a pipe writes atomically, so children take turns
+    if (pthread_mutex_lock(&shared->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&shared->lock);  // A child crashed mid-write; its response is already lost
+    }
+    int written = write_all(result_fd, response, (size_t)(out + 4 + size - response));
+    pthread_mutex_unlock(&shared->lock);
+    _exit(written == 0 ? 0 : EXIT_FAILURE);
+}
+
+// Function to wait for one fork server child, blocking or not, and count how its job ended
+// Returns 1 if a child was reaped; children of the process the server did not start are reaped and ignored
+static int fork_server_reap(pid_t *children, int *running, const ForkShared *shared, int options, ForkServerStats *stats) {
+    int child_status = 0;
+    pid_t child = waitpid(-1, &child_status, options);
+    int slot = 0;
+
+    if (child < 0 && errno == ECHILD) {
+        // Something else reaped the jobs still counted as running: their outcome is unknown
+        for (; slot < FORK_MAX_CHILDREN; slot++) {
+            stats->failures += children[slot] != 0;
+            children[slot] = 0;
+        }
+        *running = 0;
+        return 0;
+    }
+    if (child <= 0) {
+        return 0;
+    }
+    while (slot < FORK_MAX_CHILDREN && children[slot] != child) {
+        slot++;
+    }
+    if (slot == FORK_MAX_CHILDREN) {
+        return 1;
+    }
+    children[slot] = 0;
+    (*running)--;
+
+    if (!WIFEXITED(child_status) || WEXITSTATUS(child_status) != 0) {
+        stats->failures++;
+        if (WIFSIGNALED(child_status) && WTERMSIG(child_status) == SIGALRM) {
+            stats->timeouts++;
+        }
+    } else {
+        stats->jobs++;
+        stats->startup_ns_total += shared->startup_ns[slot];
+        if (shared->startup_ns[slot] > stats->startup_ns_max) {
+            stats->startup_ns_max = shared->startup_ns[slot];
+        }
+    }
+    return 1;
+}
+
+// Function to serve jobs from a warm, fully initialized process by forking one child per job
+// Each request is a 4-byte job id followed by a movie in movie_save format, read until end of input
+// Children share the warm ROM, tables and block cache copy-on-write, so per-job startup is a fork
+// Up to FORK_MAX_CHILDREN jobs run at once and responses arrive in completion order, each whole
+// A child still running after FORK_JOB_SECONDS is killed and counted as a failed job (and a timeout)
+// The server reaps every child of the calling process while it runs, so run it where nothing else forks
+// Returns 0 at end of input, or -1 if a request is malformed; either way every started job is waited for
+int fork_server(int request_fd, int result_fd, const CPU *warm, IrCache *cache, ForkServerStats *stats) {
+    int fd = dup(request_fd);
+    FILE *requests = fd >= 0 ? fdopen(fd, "rb") : NULL;
+    ForkShared *shared = mmap(NULL, sizeof(ForkShared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    CPU *cpu = malloc(sizeof(CPU));  // Children work in these copy-on-write buffers and never call malloc
+    uint8_t *response = malloc(4 + 4 + 8 + 4 + MIGRATION_MAX_BLOB);
+    pid_t children[FORK_MAX_CHILDREN] = {0};
+    pthread_mutexattr_t attributes;
+    int running = 0;
+    int result = 0;
+
+    if (cpu == NULL || response == NULL) {
+        printf("Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    if (requests == NULL || shared == MAP_FAILED) {
+        printf("Cannot start the fork server!\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&shared->lock, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+    fflush(stdout);  // Children must not inherit and repeat buffered output
+
+    while (1) {
+        uint8_t header[4];
+        const uint8_t *in = header;
+        InputMovie movie;
+
+        // Collect finished jobs without blocking, then wait only while every slot is busy
+        while (running > 0 && fork_server_reap(children, &running, shared, WNOHANG, stats)) {
+        }
+        while (running == FORK_MAX_CHILDREN) {
+            fork_server_reap(children, &running, shared, 0, stats);
+        }
+
+        if (fread(header, 1, sizeof(header), requests) != sizeof(header)) {
+            break;  // End of requests
+        }
+        uint32_t job = (uint32_t)blob_get(&in, 4);
+        if (movie_load(&movie, requests) != 0) {
+            result = -1;
+            break;
+        }
+
+        int slot = 0;
+        while (children[slot] != 0) {
+            slot++;
+        }
+        uint64_t requested_ns = monotonic_ns();
+        pid_t child = fork();
+        if (child == 0) {
+            fork_server_child(result_fd, warm, cache, &movie, job, requested_ns, shared, slot, cpu, response);
+        }
+        if (child < 0) {
+            stats->failures++;
+        } else {
+            children[slot] = child;
+            running++;
+        }
+        movie_free(&movie);
+    }
+
+    while (running > 0) {
+        fork_server_reap(children, &running, shared, 0, stats);
+    }
+    pthread_mutex_destroy(&shared->lock);
+    munmap(shared, sizeof(ForkShared));
+    fclose(requests);
+    free(cpu);
+    free(response);
+    return result;
+}
+
+// Function to give the default costs: control flow and memory cost more than register operations
+GasSchedule gas_default_schedule(void) {
+    GasSchedule schedule;
+    schedule.cost[GAS_HALT] = 1;
+    schedule.cost[GAS_ALU] = 1;
+    schedule.cost[GAS_SKIP] = 2;
+    schedule.cost[GAS_JUMP] = 2;
+    schedule.cost[GAS_CALL] = 5;
+    schedule.cost[GAS_RET] = 5;
+    schedule.cost[GAS_DISPLAY] = 8;
+    schedule.cost[GAS_TIMER] = 2;
+    schedule.cost[GAS_KEY] = 2;
+    schedule.cost[GAS_MEMORY] = 4;
+    schedule.cost[GAS_OTHER] = 1;
+    return schedule;
+}
+
+// Function to find the gas an opcode costs under a schedule, at least 1
+// Every metered engine prices instructions through here, so a free instruction cannot loop forever anywhere
+uint8_t gas_cost(const GasSchedule *schedule, uint16_t opcode) {
+    uint8_t cost = schedule->cost[op_info[decode_opcode(opcode)].gas_class];
+    return cost != 0 ? cost : 1;
+}
+
+// Function to switch the costs stamped into a cache's blocks; NULL stops metering
+void ir_cache_set_schedule(IrCache *cache, const GasSchedule *schedule) {
+    ir_cache_free(cache);  // Blocks translated so far carry the old costs
+    cache->schedule = schedule;
+}
+
+// Function to run until HALT or until the next instruction costs more gas than is left
+// The reference semantics: every metered engine stops at the same instruction with the same gas left
+int run_metered(CPU *cpu, const GasSchedule *schedule, uint64_t *gas) {
+    while (1) {
+        uint16_t opcode = fetch(cpu);
+        uint8_t cost = gas_cost(schedule, opcode);
+        if (*gas < cost) {
+            return RUN_OUT_OF_GAS;
+        }
+        *gas -= cost;
+        if (!execute(cpu, opcode)) {
+            return RUN_HALTED;
+        }
+    }
+}
+
+// Function to run metered through translated blocks, charging each block's summed gas once at entry
+// Ops skipped by SE/SNE are refunded; a block whose full cost is not affordable runs instruction by
+// instruction, so the stopping point matches run_metered exactly, and translated blocks resume after it
+// The cache must have a schedule set through ir_cache_set_schedule
+int run_ir_metered(CPU *cpu, IrCache *cache, uint64_t *gas) {
+    IrBlock scratch;
+
+    if (!ir_enter(cache, cpu)) {
+        return run_metered(cpu, cache->schedule, gas);
+    }
+
+    while (1) {
+        const IrBlock *block = ir_lookup(cache, cpu->position_in_memory, &scratch);
+        uint32_t refund;
+        if (*gas < block->gas) {
+            // Under one block's worth of gas remains: interpret this block until control leaves it
+            uint16_t instructions = block->length - (block->ops[block->length - 1].kind == UOP_FALLTHROUGH);
+            uint16_t offset = 0;
+            uint16_t last;
+            do {
+                uint16_t opcode = fetch(cpu);
+                uint8_t cost = gas_cost(cache->schedule, opcode);
+                if (*gas < cost) {
+                    return RUN_OUT_OF_GAS;
+                }
+                *gas -= cost;
+                if (!execute(cpu, opcode)) {
+                    return RUN_HALTED;
+                }
+                last = offset;
+                offset = (cpu->position_in_memory - block->start_pc) & ADDRESS_MASK;
+            } while (offset > last && offset < 2 * instructions);
+            if (cache->synced != cpu || cache->synced_writes != cpu->writes.clock) {
+                ir_cache_sync(cache, cpu);  // The interpreted stretch may have reached an opcode that stores
+            }
+            continue;
+        }
+        *gas -= block->gas;
+        int running = ir_exec_block(cpu, block, &refund);
+        *gas += refund;
+        if (!running) {
+            return RUN_HALTED;
+        }
+        if (block->ops[block->length - 1].kind == UOP_EXIT &&
+            (cache->synced != cpu || cache->synced_writes != cpu->writes.clock)) {
+            ir_cache_sync(cache, cpu);
+        }
+    }
+}
+
+// SHA-256 round constants
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+// Function to rotate a 32-bit word right
+static inline uint32_t rotr32(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+// Function to fill one padded 64-byte block of a message: its bytes, then 0x80, zeros and the bit length
+static void sha256_block(const uint8_t *message, size_t size, size_t block, size_t blocks, uint8_t bytes[64]) {
+    size_t start = block * 64;
+
+    memset(bytes, 0, 64);
+    if (start < size) {
+        memcpy(bytes, message + start, size - start < 64 ? size - start : 64);
+    }
+    if (size >= start && size < start + 64) {
+        bytes[size - start] = 0x80;
+    }
+    if (block == blocks - 1) {
+        uint64_t bits = (uint64_t)size * 8;
+        for (int i = 0; i < 8; i++) {
+            bytes[63 - i] = (bits >> (8 * i)) & 0xFF;
+        }
+    }
+}
+
+// Function to compute the SHA-256 digests of count messages of the same size, SHA256_LANES at a time
+void sha256_many(const uint8_t *const *messages, size_t size, size_t count, uint8_t (*digests)[SHA256_SIZE]) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    size_t blocks = (size + 9 + 63) / 64;
+
+    for (size_t base = 0; base < count; base += SHA256_LANES) {
+        size_t lanes = count - base;
+        if (lanes > SHA256_LANES) {
+            lanes = SHA256_LANES;
+        }
+
+        // Every array below is [word][lane], so each loop over lanes is one vector instruction
+        uint32_t h[8][SHA256_LANES];
+        for (int i = 0; i < 8; i++) {
+            for (int lane = 0; lane < SHA256_LANES; lane++) {
+                h[i][lane] = initial[i];
+            }
+        }
+
+        for (size_t block = 0; block < blocks; block++) {
+            uint32_t w[64][SHA256_LANES];
+            for (int lane = 0; lane < SHA256_LANES; lane++) {
+                uint8_t bytes[64];
+                // Spare lanes rehash the first message; their digests are dropped
+                sha256_block(messages[base + ((size_t)lane < lanes ? (size_t)lane : 0)], size, block, blocks, bytes);
+                for (int t = 0; t < 16; t++) {
+                    w[t][lane] = (uint32_t)bytes[4 * t] << 24 | (uint32_t)bytes[4 * t + 1] << 16 |
+                                 (uint32_t)bytes[4 * t + 2] << 8 | bytes[4 * t + 3];
+                }
+            }
+            for (int t = 16; t < 64; t++) {
+                for (int lane = 0; lane < SHA256_LANES; lane++) {
+                    uint32_t w15 = w[t - 15][lane];
+                    uint32_t w2 = w[t - 2][lane];
+                    w[t][lane] = w[t - 16][lane] + (rotr32(w15, 7) ^ rotr32(w15, 18) ^ (w15 >> 3)) +
+                                 w[t - 7][lane] + (rotr32(w2, 17) ^ rotr32(w2, 19) ^ (w2 >> 10));
+                }
+            }
+
+            uint32_t a[SHA256_LANES], b[SHA256_LANES], c[SHA256_LANES], d[SHA256_LANES];
+            uint32_t e[SHA256_LANES], f[SHA256_LANES], g[SHA256_LANES], k[SHA256_LANES];
+            for (int lane = 0; lane < SHA256_LANES; lane++) {
+                a[lane] = h[0][lane]; b[lane] = h[1][lane]; c[lane] = h[2][lane]; d[lane] = h[3][lane];
+                e[lane] = h[4][lane]; f[lane] = h[5][lane]; g[lane] = h[6][lane]; k[lane] = h[7][lane];
+            }
+            for (int t = 0; t < 64; t++) {
+                for (int lane = 0; lane < SHA256_LANES; lane++) {
+                    uint32_t t1 = k[lane] + (rotr32(e[lane], 6) ^ rotr32(e[lane], 11) ^ rotr32(e[lane], 25)) +
+                                  ((e[lane] & f[lane]) ^ (~e[lane] & g[lane])) + sha256_k[t] + w[t][lane];
+                    uint32_t t2 = (rotr32(a[lane], 2) ^ rotr32(a[lane], 13) ^ rotr32(a[lane], 22)) +
+                                  ((a[lane] & b[lane]) ^ (a[lane] & c[lane]) ^ (b[lane] & c[lane]));
+                    k[lane] = g[lane]; g[lane] = f[lane]; f[lane] = e[lane]; e[lane] = d[lane] + t1;
+                    d[lane] = c[lane]; c[lane] = b[lane]; b[lane] = a[lane]; a[lane] = t1 + t2;
+                }
+            }
+            for (int lane = 0; lane < SHA256_LANES; lane++) {
+                h[0][lane] += a[lane]; h[1][lane] += b[lane]; h[2][lane] += c[lane]; h[3][lane] += d[lane];
+                h[4][lane] += e[lane]; h[5][lane] += f[lane]; h[6][lane] += g[lane]; h[7][lane] += k[lane];
+            }
+        }
+
+        for (size_t lane = 0; lane < lanes; lane++) {
+            for (int i = 0; i < 8; i++) {
+                digests[base + lane][4 * i] = h[i][lane] >> 24;
+                digests[base + lane][4 * i + 1] = (h[i][lane] >> 16) & 0xFF;
+                digests[base + lane][4 * i + 2] = (h[i][lane] >> 8) & 0xFF;
+                digests[base + lane][4 * i + 3] = h[i][lane] & 0xFF;
+            }
+        }
+    }
+}
+
+// Function to reset a Merkle tree so its first commit hashes everything
+void merkle_init(MerkleTree *tree) {
+    memset(tree, 0, sizeof(*tree));
+    tree->stale = ~(uint64_t)0;
+}
+
+// Pending node hashes, collected across trees so that each level fills the SHA-256 lanes; lives on the stack and is hashed whenever it fills
+typedef struct {
+    uint8_t messages[MERKLE_BATCH][MERKLE_MESSAGE_SIZE];  // Domain byte plus the 64 bytes to hash
+    const uint8_t *pointers[MERKLE_BATCH];  // messages[i], as sha256_many takes them
+    uint8_t *targets[MERKLE_BATCH]; // Where each digest goes
+    uint8_t digests[MERKLE_BATCH][SHA256_SIZE];
+    size_t count;                   // Messages queued
+    size_t hashed;                  // Messages hashed so far
+} MerkleBatch;
+
+// Function to hash every queued message and store the digests
+static void merkle_flush(MerkleBatch *batch) {
+    sha256_many(batch->pointers, MERKLE_MESSAGE_SIZE, batch->count, batch->digests);
+    for (size_t i = 0; i < batch->count; i++) {
+        memcpy(batch->targets[i], batch->digests[i], SHA256_SIZE);
+    }
+    batch->hashed += batch->count;
+    batch->count = 0;
+}
+
+// Function to queue the hash of a domain byte and 64 bytes (or one full message when second is NULL and domain is 0x02), to be written to target
+static void merkle_queue(MerkleBatch *batch, MerkleTree *owner, uint8_t domain, const uint8_t *first, const uint8_t *second, uint8_t *target) {
+    uint8_t *message;
+
+    // Every message queued so far only reads nodes of finished levels, so hashing early is safe
+    if (batch->count == MERKLE_BATCH) {
+        merkle_flush(batch);
+    }
+    message = batch->messages[batch->count];
+    if (domain == 0x02) {
+        memcpy(message, first, MERKLE_MESSAGE_SIZE);
+    } else {
+        message[0] = domain;
+        memcpy(message + 1, first, second != NULL ? SHA256_SIZE : PAGE_SIZE);
+        if (second != NULL) {
+            memcpy(message + 1 + SHA256_SIZE, second, SHA256_SIZE);
+        }
+    }
+    batch->pointers[batch->count] = message;
+    batch->targets[batch->count] = target;
+    batch->count++;
+    owner->hashes++;
+}
+
+// Function to lay out the register state as the two register leaf messages, stack slots past the pointer as zeros
+static void merkle_state_messages(const CPU *cpu, uint8_t messages[2][MERKLE_MESSAGE_SIZE]) {
+    uint8_t *out = messages[0];
+
+    memset(messages, 0, 2 * MERKLE_MESSAGE_SIZE);
+    *out++ = 0x02;
+    memcpy(out, cpu->registers, sizeof(cpu->registers));
+    out += sizeof(cpu->registers);
+    out = blob_put(out, cpu->position_in_memory, 2);
+    out = blob_put(out, cpu->index, 2);
+    for (size_t i = 0; i < sizeof(cpu->stack) / sizeof(cpu->stack[0]); i++) {
+        out = blob_put(out, i < cpu->stack_pointer ? cpu->stack[i] : 0, 2);
+    }
+    out = blob_put(out, cpu->delay_timer, 1);
+    out = blob_put(out, cpu->sound_timer, 1);
+    out = blob_put(out, cpu->keys, 2);
+    out = blob_put(out, cpu->hires, 1);
+    assert(out <= messages[0] + MERKLE_MESSAGE_SIZE);
+
+    out = messages[1];
+    *out++ = 0x02;
+    out = blob_put(out, cpu->stack_pointer, 8);  // Full width: a wrapped byte would let two stack depths share a root
+    blob_put(out, cpu->cycles, 8);
+}
+
+// Function to lay out framebuffer band b as a leaf body: its rows' words, most significant byte first
+static void merkle_display_band(const CPU *cpu, int band, uint8_t data[PAGE_SIZE]) {
+    int rows = DISPLAY_HEIGHT / MERKLE_DISPLAY_LEAVES;
+
+    for (int r = 0; r < rows; r++) {
+        for (int word = 0; word < 2; word++) {
+            for (int byte = 0; byte < 8; byte++) {
+                data[16 * r + 8 * word + byte] = (uint8_t)(cpu->display[band * rows + r][word] >> (56 - 8 * byte));
+            }
+        }
+    }
+}
+
+// Function to bring the roots of many trees up to date, hashing each level of all trees together; returns messages hashed
+// Pages are found from each instance's write clock, so memory changed behind store() must be reported with mark_pages_written()
+size_t merkle_commit_batch(MerkleTree *trees, const CPU *cpus, size_t count) {
+    MerkleBatch batch;
+    int rows = DISPLAY_HEIGHT / MERKLE_DISPLAY_LEAVES;
+
+    batch.count = 0;
+    batch.hashed = 0;
+
+    // Leaves: every page the instance's write clock shows written since the last commit, and every changed band
+    for (size_t i = 0; i < count; i++) {
+        MerkleTree *tree = &trees[i];
+        uint64_t pages = tree->stale;
+
+        if (tree->synced != &cpus[i]) {
+            pages = ~(uint64_t)0;
+        } else {
+            pages |= pages_written_since(&cpus[i], tree->mark);
+        }
+        tree->synced = &cpus[i];
+        tree->mark = cpus[i].writes.clock;
+        tree->changed = pages;
+        for (; pages != 0; pages &= pages - 1) {
+            int page = __builtin_ctzll(pages);
+            merkle_queue(&batch, tree, 0x00, cpus[i].memory + page * PAGE_SIZE, NULL, tree->nodes[MEMORY_PAGES + page]);
+        }
+
+        tree->display_changed = 0;
+        for (int band = 0; band < MERKLE_DISPLAY_LEAVES; band++) {
+            size_t bytes = (size_t)rows * sizeof(cpus[i].display[0]);
+            if (tree->stale != 0 || memcmp(tree->shadow_display[band * rows], cpus[i].display[band * rows], bytes) != 0) {
+                uint8_t data[PAGE_SIZE];
+                memcpy(tree->shadow_display[band * rows], cpus[i].display[band * rows], bytes);
+                merkle_display_band(&cpus[i], band, data);
+                merkle_queue(&batch, tree, 0x03, data, NULL, tree->display[MERKLE_DISPLAY_LEAVES + band]);
+                tree->display_changed |= (uint64_t)1 << band;
+            }
+        }
+    }
+    merkle_flush(&batch);
+
+    // Interior levels: only the parents of changed nodes, one level of every tree at a time
+    for (int level = MERKLE_DEPTH - 1; level >= 0; level--) {
+        for (size_t i = 0; i < count; i++) {
+            MerkleTree *tree = &trees[i];
+            uint64_t parents = 0;
+
+            for (uint64_t nodes = tree->changed; nodes != 0; nodes &= nodes - 1) {
+                parents |= (uint64_t)1 << (__builtin_ctzll(nodes) >> 1);
+            }
+            tree->changed = parents;
+            for (uint64_t nodes = parents; nodes != 0; nodes &= nodes - 1) {
+                size_t node = ((size_t)1 << level) + __builtin_ctzll(nodes);
+                merkle_queue(&batch, tree, 0x01, tree->nodes[2 * node], tree->nodes[2 * node + 1], tree->nodes[node]);
+            }
+
+            // The framebuffer tree is shallower: its levels run alongside the last ones of the page tree
+            if (level < MERKLE_DISPLAY_DEPTH) {
+                parents = 0;
+                for (uint64_t nodes = tree->display_changed; nodes != 0; nodes &= nodes - 1) {
+                    parents |= (uint64_t)1 << (__builtin_ctzll(nodes) >> 1);
+                }
+                tree->display_changed = parents;
+                for (uint64_t nodes = parents; nodes != 0; nodes &= nodes - 1) {
+                    size_t node = ((size_t)1 << level) + __builtin_ctzll(nodes);
+                    merkle_queue(&batch, tree, 0x01, tree->display[2 * node], tree->display[2 * node + 1], tree->display[node]);
+                }
+            }
+        }
+        merkle_flush(&batch);
+    }
+
+    // Register leaves, then core, state and root wherever something below them changed
+    uint8_t rehash[MERKLE_BATCH];
+    for (size_t start = 0; start < count; start += MERKLE_BATCH / 2) {
+        size_t end = count - start < MERKLE_BATCH / 2 ? count : start + MERKLE_BATCH / 2;
+
+        for (size_t i = start; i < end; i++) {
+            MerkleTree *tree = &trees[i];
+            uint8_t messages[2][MERKLE_MESSAGE_SIZE];
+
+            merkle_state_messages(&cpus[i], messages);
+            rehash[i - start] = tree->stale != 0;
+            for (int leaf = 0; leaf < 2; leaf++) {
+                if (tree->stale != 0 || memcmp(messages[leaf], tree->shadow_state[leaf], MERKLE_MESSAGE_SIZE) != 0) {
+                    memcpy(tree->shadow_state[leaf], messages[leaf], MERKLE_MESSAGE_SIZE);
+                    merkle_queue(&batch, tree, 0x02, tree->shadow_state[leaf], NULL, tree->leaves[leaf]);
+                    rehash[i - start] = 1;
+                }
+            }
+        }
+        merkle_flush(&batch);
+        for (size_t i = start; i < end; i++) {
+            if (rehash[i - start]) {
+                merkle_queue(&batch, &trees[i], 0x01, trees[i].leaves[0], trees[i].leaves[1], trees[i].core);
+            }
+        }
+        merkle_flush(&batch);
+        for (size_t i = start; i < end; i++) {
+            rehash[i - start] |= trees[i].display_changed != 0;
+            if (rehash[i - start]) {
+                merkle_queue(&batch, &trees[i], 0x01, trees[i].core, trees[i].display[1], trees[i].state);
+            }
+        }
+        merkle_flush(&batch);
+        for (size_t i = start; i < end; i++) {
+            MerkleTree *tree = &trees[i];
+            if (rehash[i - start] || tree->changed != 0 || tree->stale != 0) {
+                merkle_queue(&batch, tree, 0x01, tree->nodes[1], tree->state, tree->root);
+            }
+            tree->stale = 0;
+            tree->changed = 0;
+            tree->display_changed = 0;
+        }
+        merkle_flush(&batch);
+    }
+    return batch.hashed;
+}
+
+// Function to bring one tree's root up to date; returns messages hashed
+size_t merkle_commit(MerkleTree *tree, const CPU *cpu) {
+    return merkle_commit_batch(tree, cpu, 1);
+}
+
+// Function to collect the siblings from a page's leaf up to the page root, then the state subtree root
+void merkle_prove_page(const MerkleTree *tree, int page, uint8_t path[MERKLE_DEPTH + 1][SHA256_SIZE]) {
+    size_t node = MEMORY_PAGES + page;
+
+    for (int level = 0; level < MERKLE_DEPTH; level++, node >>= 1) {
+        memcpy(path[level], tree->nodes[node ^ 1], SHA256_SIZE);
+    }
+    memcpy(path[MERKLE_DEPTH], tree->state, SHA256_SIZE);
+}
+
+// Function to check that a page holds data under a committed root; returns 1 if the proof holds
+int merkle_verify_page(const uint8_t root[SHA256_SIZE], int page, const uint8_t *data, const uint8_t path[MERKLE_DEPTH + 1][SHA256_SIZE]) {
+    uint8_t message[MERKLE_MESSAGE_SIZE];
+    const uint8_t *pointer = message;
+    uint8_t digest[1][SHA256_SIZE];
+
+    if (page < 0 || page >= MEMORY_PAGES) {
+        return 0;
+    }
+    message[0] = 0x00;
+    memcpy(message + 1, data, PAGE_SIZE);
+    sha256_many(&pointer, sizeof(message), 1, digest);
+
+    for (int level = 0; level <= MERKLE_DEPTH; level++) {
+        int right = level < MERKLE_DEPTH && ((page >> level) & 1);
+        message[0] = 0x01;
+        memcpy(message + 1, right ? path[level] : digest[0], SHA256_SIZE);
+        memcpy(message + 1 + SHA256_SIZE, right ? digest[0] : path[level], SHA256_SIZE);
+        sha256_many(&pointer, sizeof(message), 1, digest);
+    }
+    return memcmp(digest[0], root, SHA256_SIZE) == 0;
+}
+
+// Function to prepare an empty trace with a commitment every interval instructions
+// and a stored state every checkpoint_every commitments
+void trace_init(ExecutionTrace *trace, uint64_t interval, uint64_t checkpoint_every) {
+    memset(trace, 0, sizeof(*trace));
+    trace->interval = interval ? interval : 1;
+    trace->checkpoint_every = checkpoint_every ? checkpoint_every : 1;
+    merkle_init(&trace->tree);
+}
+
+// Function to release a trace's commitments and stored states
+void trace_free(ExecutionTrace *trace) {
+    free(trace->roots);
+    free(trace->checkpoints);
+    trace->roots = NULL;
+    trace->checkpoints = NULL;
+    trace->count = trace->capacity = 0;
+    trace->checkpoint_count = trace->checkpoint_capacity = 0;
+}
+
+// Function to commit to the state at a multiple of the interval, storing it too every checkpoint_every commitments
+static void trace_commit(ExecutionTrace *trace, const CPU *cpu) {
+    if (trace->count == trace->capacity) {
+        trace->capacity = trace->capacity ? trace->capacity * 2 : 64;
+        trace->roots = realloc(trace->roots, trace->capacity * sizeof(*trace->roots));
+        if (trace->roots == NULL) {
+            printf("Out of memory!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    merkle_commit(&trace->tree, cpu);
+    memcpy(trace->roots[trace->count], trace->tree.root, SHA256_SIZE);
+
+    if (trace->count % trace->checkpoint_every == 0) {
+        if (trace->checkpoint_count == trace->checkpoint_capacity) {
+            trace->checkpoint_capacity = trace->checkpoint_capacity ? trace->checkpoint_capacity * 2 : 16;
+            trace->checkpoints = realloc(trace->checkpoints, trace->checkpoint_capacity * sizeof(CPU));
+            if (trace->checkpoints == NULL) {
+                printf("Out of memory!\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        trace->checkpoints[trace->checkpoint_count++] = *cpu;
+    }
+    trace->count++;
+}
+
+// Function to run like run(), committing to the state every interval instructions, for at most max_steps
+// instructions in all; returns RUN_HALTED or RUN_BUDGET. Calling it again continues the same trace,
+// except that once the run has halted it stays halted
+int trace_run(ExecutionTrace *trace, CPU *cpu, uint64_t max_steps) {
+    int running = 1;
+
+    if (trace->halted) {
+        return RUN_HALTED;
+    }
+    if (trace->count == 0) {
+        trace_commit(trace, cpu);  // Step 0: the starting state
+    }
+    while (running && trace->steps < max_steps) {
+        uint64_t boundary = (trace->steps / trace->interval + 1) * trace->interval;
+        uint64_t stop = boundary < max_steps ? boundary : max_steps;
+
+        // The hot loop does no more than run() does, plus one counter
+        while (running && trace->steps < stop) {
+            running = execute(cpu, fetch(cpu));
+            trace->steps++;
+        }
+        if (trace->steps == boundary) {
+            trace_commit(trace, cpu);
+        }
+    }
+
+    merkle_commit(&trace->tree, cpu);
+    memcpy(trace->end_root, trace->tree.root, SHA256_SIZE);
+    trace->halted = !running;
+    return running ? RUN_BUDGET : RUN_HALTED;
+}
+
+// Function to compute the commitment to one state from scratch
+static void state_root(const CPU *cpu, uint8_t root[SHA256_SIZE]) {
+    MerkleTree tree;
+
+    merkle_init(&tree);
+    merkle_commit(&tree, cpu);
+    memcpy(root, tree.root, SHA256_SIZE);
+}
+
+// Function to re-execute steps a..b of a trace from the nearest stored state, committing every stride
+// steps from a on (roots may be NULL); the state at b goes to state if it is not NULL
+// Returns the number of roots produced, or -1 if the interval is not within the trace
+long trace_replay(const ExecutionTrace *trace, uint64_t a, uint64_t b, uint64_t stride, uint8_t (*roots)[SHA256_SIZE], CPU *state) {
+    uint64_t span = trace->interval * trace->checkpoint_every;
+    size_t checkpoint;
+    uint64_t step;
+    long produced = 0;
+    MerkleTree tree;
+    CPU cpu;
+
+    if (a > b || b > trace->steps || trace->checkpoint_count == 0 || stride == 0) {
+        return -1;
+    }
+    checkpoint = a / span;
+    if (checkpoint >= trace->checkpoint_count) {
+        checkpoint = trace->checkpoint_count - 1;
+    }
+    cpu = trace->checkpoints[checkpoint];
+    step = checkpoint * span;
+
+    while (step < a) {
+        execute(&cpu, fetch(&cpu));  // b is within the trace, so HALT can only be its last step
+        step++;
+    }
+    merkle_init(&tree);
+    while (1) {
+        if ((step - a) % stride == 0) {
+            if (roots != NULL) {
+                merkle_commit(&tree, &cpu);
+                memcpy(roots[produced], tree.root, SHA256_SIZE);
+            }
+            produced++;
+        }
+        if (step == b) {
+            break;
+        }
+        execute(&cpu, fetch(&cpu));
+        step++;
+    }
+
+    if (state != NULL) {
+        *state = cpu;
+    }
+    return produced;
+}
+
+// Function to execute one instruction of a disputed step: returns -1 where execute() would end the
+// process (unknown opcode, stack overflow or underflow), else what execute() returns
+static int step_execute(CPU *cpu, uint16_t opcode) {
+    if (op_would_fault(cpu, decode_opcode(opcode))) {
+        return -1;
+    }
+    return execute(cpu, opcode);
+}
+
+// Function to build the proof for instruction number step of a trace (step counts from 0)
+// Returns 0, or -1 if the trace has no such instruction
+int step_prove(const ExecutionTrace *trace, uint64_t step, StepProof *proof) {
+    CPU post;
+
+    if (step >= trace->steps || trace_replay(trace, step, step, 1, NULL, &proof->pre) < 0) {
+        return -1;
+    }
+    proof->step = step;
+    proof->opcode = fetch(&proof->pre);
+    post = proof->pre;
+    if (step_execute(&post, proof->opcode) < 0) {
+        return -1;  // A traced run never executes a faulting instruction; the trace is corrupt
+    }
+    state_root(&proof->pre, proof->pre_root);
+    state_root(&post, proof->post_root);
+    return 0;
+}
+
+// Function to check a step proof against the roots from the dispute: pre_root is the commitment both
+// parties agree on, post_root the one claimed after the step. The pre-state must match pre_root, the
+// opcode must be the one at its PC, and executing it must yield post_root; returns 1 if all hold
+// The pre-state comes from the prover, so one no run can reach (guard bytes set, stack pointer past the
+// stack, PC or I past memory) or an instruction that would fault is rejected before anything runs
+int step_verify(const StepProof *proof, const uint8_t pre_root[SHA256_SIZE], const uint8_t post_root[SHA256_SIZE]) {
+    uint8_t root[SHA256_SIZE];
+    CPU post = proof->pre;
+
+    for (size_t i = 0; i < MEMORY_GUARD; i++) {
+        if (proof->pre.memory[MEMORY_SIZE + i] != 0) {
+            return 0;
+        }
+    }
+    if (proof->pre.stack_pointer > sizeof(proof->pre.stack) / sizeof(proof->pre.stack[0]) ||
+        proof->pre.position_in_memory > ADDRESS_MASK || proof->pre.index > ADDRESS_MASK) {
+        return 0;
+    }
+    state_root(&proof->pre, root);
+    if (memcmp(root, pre_root, SHA256_SIZE) != 0 || fetch(&proof->pre) != proof->opcode) {
+        return 0;
+    }
+    if (step_execute(&post, proof->opcode) < 0) {
+        return 0;
+    }
+    state_root(&post, root);
+    return memcmp(root, post_root, SHA256_SIZE) == 0;
+}
+
+// Function to run transactions one after another over shared memory: the reference for run_transactions
+// Each runs from its own registers and PC against the memory left by the previous one, for at most
+// budget instructions; memory ends as the last one left it, and results[i] holds memory after transaction i
+void run_transactions_serial(uint8_t *memory, const CPU *txs, size_t count, uint64_t budget, CPU *results, int *outcomes) {
+    for (size_t i = 0; i < count; i++) {
+        CPU *cpu = &results[i];
+        int running = 1;
+
+        copy_cpu_state(cpu, &txs[i]);
+        memcpy(cpu->memory, memory, MEMORY_SIZE);
+        memset(cpu->memory + MEMORY_SIZE, 0, MEMORY_GUARD);
+        for (uint64_t step = 0; running && step < budget; step++) {
+            running = execute(cpu, fetch(cpu));
+        }
+        memcpy(memory, cpu->memory, MEMORY_SIZE);
+        if (outcomes != NULL) {
+            outcomes[i] = running ? RUN_BUDGET : RUN_HALTED;
+        }
+    }
+}
+
+#define STM_STORAGE 0xFFFFFFFFu     // Writer of a byte read from the memory the batch started with
+#define STM_FAULT -1                // Outcome of an incarnation stopped before an instruction that ends the process
+
+#define STM_READY 0                 // Incarnation waiting to be executed
+#define STM_EXECUTING 1             // Incarnation running
+#define STM_EXECUTED 2              // Incarnation finished; its writes are visible
+#define STM_ABORTING 3              // Incarnation found stale or blocked; the next one is coming
+
+// One transaction's write to a byte, as seen by higher transactions
+typedef struct {
+    uint32_t tx;                    // Writer
+    uint32_t incarnation;           // Writer's incarnation
+    uint8_t value;                  // Byte written
+    uint8_t estimate;               // 1 once the writer aborted: readers wait for its next incarnation
+} StmVersion;
+
+// Every transaction's write to one byte, ordered by transaction
+typedef struct {
+    StmVersion *versions;
+    uint32_t count;
+    uint32_t capacity;
+} StmLocation;
+
+// One byte a transaction read, and which write it saw
+typedef struct {
+    uint16_t addr;
+    uint32_t tx;                    // Writer seen, or STM_STORAGE
+    uint32_t incarnation;           // Writer's incarnation
+} StmRead;
+
+// Scheduling state and the last finished incarnation of one transaction
+typedef struct {
+    pthread_mutex_t lock;           // Guards everything below
+    int status;                     // STM_* status of the current incarnation
+    uint32_t incarnation;           // Current incarnation
+    size_t *dependents;             // Transactions waiting for this one to finish executing
+    size_t dependent_count;
+    size_t dependent_capacity;
+    StmRead *reads;                 // Read set of the last finished incarnation
+    size_t read_count;
+    uint16_t *writes;               // Bytes written by the last finished incarnation
+    uint8_t *values;                // Their values
+    size_t write_count;
+    CPU result;                     // Final state of the last finished incarnation (memory not filled in)
+    int outcome;                    // RUN_HALTED or RUN_BUDGET
+} StmTx;
+
+// Block-STM engine: multi-version memory plus the collaborative scheduler
+typedef struct {
+    const uint8_t *storage;         // Memory before the batch
+    const CPU *txs;                 // Transactions in their serial order
+    size_t count;
+    uint64_t budget;                // Instructions each transaction may run
+    StmTx *tx;                      // Per-transaction state
+    StmLocation locations[MEMORY_SIZE];  // Writes to each byte
+    pthread_mutex_t page_locks[MEMORY_PAGES];  // Guard the locations of each page
+    _Atomic size_t execution_index; // Lowest transaction that may need executing
+    _Atomic size_t validation_index;  // Lowest transaction that may need validating
+    _Atomic size_t decrease_count;  // Times an index moved down, so completion is not declared early
+    _Atomic size_t active_tasks;    // Tasks handed out and not finished
+    _Atomic int done;
+    _Atomic uint64_t incarnations;
+    _Atomic uint64_t validations;
+    _Atomic uint64_t aborts;
+    _Atomic uint64_t dependencies;
+} StmEngine;
+
+#define STM_TASK_NONE 0
+#define STM_TASK_EXECUTE 1
+#define STM_TASK_VALIDATE 2
+
+// A unit of work handed to a worker
+typedef struct {
+    int kind;                       // STM_TASK_*
+    size_t tx;
+    uint32_t incarnation;
+} StmTask;
+
+// Per-thread buffers for executing one incarnation
+typedef struct {
+    CPU cpu;
+    uint8_t known[MEMORY_SIZE];     // 1 for bytes read into cpu.memory, 2 for bytes written by the incarnation
+    StmRead reads[MEMORY_SIZE];
+    size_t read_count;
+    uint16_t writes[MEMORY_SIZE];
+    size_t write_count;
+} StmWorker;
+
+// Function to move a scheduler index down to target if it is higher
+static void stm_lower(StmEngine *engine, _Atomic size_t *index, size_t target) {
+    size_t current = atomic_load(index);
+    while (current > target && !atomic_compare_exchange_weak(index, &current, target)) {
+        // current was reloaded; retry
+    }
+    atomic_fetch_add(&engine->decrease_count, 1);
+}
+
+// Function to find the highest write to addr by a transaction below tx, or NULL; the page lock must be held
+static StmVersion *stm_latest_below(StmLocation *location, size_t tx) {
+    for (uint32_t i = location->count; i > 0; i--) {
+        if (location->versions[i - 1].tx < tx) {
+            return &location->versions[i - 1];
+        }
+    }
+    return NULL;
+}
+
+// Function to find a transaction's own write to addr, or NULL; the page lock must be held
+static StmVersion *stm_own_version(StmLocation *location, size_t tx) {
+    for (uint32_t i = 0; i < location->count; i++) {
+        if (location->versions[i].tx == tx) {
+            return &location->versions[i];
+        }
+    }
+    return NULL;
+}
+
+// Function to declare the batch finished once no index can move and no task is in flight
+static void stm_check_done(StmEngine *engine) {
+    size_t observed = atomic_load(&engine->decrease_count);
+    if (atomic_load(&engine->execution_index) >= engine->count &&
+        atomic_load(&engine->validation_index) >= engine->count &&
+        atomic_load(&engine->active_tasks) == 0 && observed == atomic_load(&engine->decrease_count)) {
+        atomic_store(&engine->done, 1);
+    }
+}
+
+// Function to claim the next incarnation of tx if it is ready to execute
+static StmTask stm_try_incarnate(StmEngine *engine, size_t tx) {
+    StmTask task = {STM_TASK_NONE, tx, 0};
+
+    if (tx < engine->count) {
+        pthread_mutex_lock(&engine->tx[tx].lock);
+        if (engine->tx[tx].status == STM_READY) {
+            engine->tx[tx].status = STM_EXECUTING;
+            task.kind = STM_TASK_EXECUTE;
+            task.incarnation = engine->tx[tx].incarnation;
+        }
+        pthread_mutex_unlock(&engine->tx[tx].lock);
+    }
+    if (task.kind == STM_TASK_NONE) {
+        atomic_fetch_sub(&engine->active_tasks, 1);
+    }
+    return task;
+}
+
+// Function to pick the next task: validations of lower transactions come before executions of higher ones
+static StmTask stm_next_task(StmEngine *engine) {
+    StmTask task = {STM_TASK_NONE, 0, 0};
+
+    if (atomic_load(&engine->validation_index) < atomic_load(&engine->execution_index)) {
+        if (atomic_load(&engine->validation_index) >= engine->count) {
+            stm_check_done(engine);
+            return task;
+        }
+        atomic_fetch_add(&engine->active_tasks, 1);
+        size_t tx = atomic_fetch_add(&engine->validation_index, 1);
+        if (tx < engine->count) {
+            pthread_mutex_lock(&engine->tx[tx].lock);
+            if (engine->tx[tx].status == STM_EXECUTED) {
+                task.kind = STM_TASK_VALIDATE;
+                task.tx = tx;
+                task.incarnation = engine->tx[tx].incarnation;
+            }
+            pthread_mutex_unlock(&engine->tx[tx].lock);
+        }
+        if (task.kind == STM_TASK_NONE) {
+            atomic_fetch_sub(&engine->active_tasks, 1);
+        }
+        return task;
+    }
+
+    if (atomic_load(&engine->execution_index) >= engine->count) {
+        stm_check_done(engine);
+        return task;
+    }
+    atomic_fetch_add(&engine->active_tasks, 1);
+    return stm_try_incarnate(engine, atomic_fetch_add(&engine->execution_index, 1));
+}
+
+// Function to let an aborted or blocked transaction run its next incarnation; tx's lock must be held
+static void stm_set_ready(StmTx *tx) {
+    tx->incarnation++;
+    tx->status = STM_READY;
+}
+
+// Function to park tx until blocking finishes executing; returns 0 if blocking already finished
+static int stm_add_dependency(StmEngine *engine, size_t tx, size_t blocking) {
+    pthread_mutex_lock(&engine->tx[blocking].lock);  // Locks are taken lowest transaction first
+    if (engine->tx[blocking].status == STM_EXECUTED) {
+        pthread_mutex_unlock(&engine->tx[blocking].lock);
+        return 0;
+    }
+    StmTx *waiting = &engine->tx[blocking];
+    if (waiting->dependent_count == waiting->dependent_capacity) {
+        waiting->dependent_capacity = waiting->dependent_capacity ? waiting->dependent_capacity * 2 : 8;
+        waiting->dependents = realloc(waiting->dependents, waiting->dependent_capacity * sizeof(size_t));
+        if (waiting->dependents == NULL) {
+            printf("Out of memory!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    waiting->dependents[waiting->dependent_count++] = tx;
+    pthread_mutex_lock(&engine->tx[tx].lock);
+    engine->tx[tx].status = STM_ABORTING;
+    pthread_mutex_unlock(&engine->tx[tx].lock);
+    pthread_mutex_unlock(&engine->tx[blocking].lock);
+
+    atomic_fetch_sub(&engine->active_tasks, 1);
+    return 1;
+}
+
+// Function to read one byte for tx into the worker's CPU, recording which write it saw
+// Returns 0, or 1 with *blocking set when the byte comes from an aborted write
+static int stm_load(StmEngine *engine, StmWorker *worker, size_t tx, uint16_t addr, size_t *blocking) {
+    if (addr >= MEMORY_SIZE || worker->known[addr] != 0) {
+        return 0;  // The guard byte, or already read or written by this incarnation
+    }
+    pthread_mutex_t *lock = &engine->page_locks[addr / PAGE_SIZE];
+    pthread_mutex_lock(lock);
+    StmVersion *version = stm_latest_below(&engine->locations[addr], tx);
+    if (version != NULL && version->estimate) {
+        *blocking = version->tx;
+        pthread_mutex_unlock(lock);
+        return 1;
+    }
+    StmRead *read = &worker->reads[worker->read_count++];
+    read->addr = addr;
+    read->tx = version != NULL ? version->tx : STM_STORAGE;
+    read->incarnation = version != NULL ? version->incarnation : 0;
+    worker->cpu.memory[addr] = version != NULL ? version->value : engine->storage[addr];
+    pthread_mutex_unlock(lock);
+
+    worker->known[addr] = 1;
+    return 0;
+}
+
+// Function to note a byte written by the running incarnation
+static void stm_note_write(StmWorker *worker, uint16_t addr) {
+    addr &= ADDRESS_MASK;
+    if (worker->known[addr] != 2) {
+        worker->known[addr] = 2;
+        worker->writes[worker->write_count++] = addr;
+    }
+}
+
+// Function to run one incarnation against the multi-version memory
+// Returns 0 when it finished, or 1 with *blocking set when it read a byte whose writer aborted
+static int stm_run_incarnation(StmEngine *engine, StmWorker *worker, size_t tx, int *outcome, size_t *blocking) {
+    CPU *cpu = &worker->cpu;
+    int running = 1;
+
+    copy_cpu_state(cpu, &engine->txs[tx]);
+    cpu->memory[MEMORY_SIZE] = 0;
+    memset(worker->known, 0, sizeof(worker->known));
+    worker->read_count = 0;
+    worker->write_count = 0;
+
+    for (uint64_t step = 0; running && step < engine->budget; step++) {
+        uint16_t pc = cpu->position_in_memory;
+        if (stm_load(engine, worker, tx, pc, blocking) || stm_load(engine, worker, tx, pc + 1, blocking)) {
+            return 1;
+        }
+        uint16_t opcode = fetch(cpu);
+        int op = decode_opcode(opcode);
+        int span = opcode_memory_span(opcode);
+        uint16_t base = cpu->index;
+
+        if (op_would_fault(cpu, op)) {
+            *outcome = STM_FAULT;  // Validation decides whether a serial run really gets here
+            return 0;
+        }
+
+        if (op_info[op].flags & OPF_LOADS) {
+            for (int r = 0; r < span; r++) {
+                if (stm_load(engine, worker, tx, (base + r) & ADDRESS_MASK, blocking)) {
+                    return 1;
+                }
+            }
+        }
+        running = execute(cpu, opcode);
+        if (op_info[op].flags & OPF_STORES) {
+            for (int r = 0; r < span; r++) {
+                stm_note_write(worker, base + r);
+            }
+        }
+    }
+    *outcome = running ? RUN_BUDGET : RUN_HALTED;
+    return 0;
+}
+
+// Function to publish a finished incarnation's writes and read set; returns 1 if it wrote a byte the previous one did not
+static int stm_record(StmEngine *engine, StmWorker *worker, size_t tx, uint32_t incarnation, int outcome) {
+    StmTx *state = &engine->tx[tx];
+    int wrote_new = 0;
+
+    for (size_t i = 0; i < worker->write_count; i++) {
+        uint16_t addr = worker->writes[i];
+        StmLocation *location = &engine->locations[addr];
+        pthread_mutex_lock(&engine->page_locks[addr / PAGE_SIZE]);
+        StmVersion *version = stm_own_version(location, tx);
+        if (version == NULL) {
+            if (location->count == location->capacity) {
+                location->capacity = location->capacity ? location->capacity * 2 : 4;
+                location->versions = realloc(location->versions, location->capacity * sizeof(StmVersion));
+                if (location->versions == NULL) {
+                    printf("Out of memory!\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            uint32_t at = location->count;
+            while (at > 0 && location->versions[at - 1].tx > tx) {
+                location->versions[at] = location->versions[at - 1];
+                at--;
+            }
+            location->count++;
+            version = &location->versions[at];
+            version->tx = (uint32_t)tx;
+            wrote_new = 1;
+        }
+        version->incarnation = incarnation;
+        version->value = worker->cpu.memory[addr];
+        version->estimate = 0;
+        pthread_mutex_unlock(&engine->page_locks[addr / PAGE_SIZE]);
+    }
+
+    // Bytes the previous incarnation wrote and this one did not now fall through to lower writers
+    for (size_t i = 0; i < state->write_count; i++) {
+        uint16_t addr = state->writes[i];
+        if (worker->known[addr] == 2) {
+            continue;
+        }
+        StmLocation *location = &engine->locations[addr];
+        pthread_mutex_lock(&engine->page_locks[addr / PAGE_SIZE]);
+        StmVersion *version = stm_own_version(location, tx);
+        if (version != NULL) {
+            memmove(version, version + 1, (location->versions + location->count - (version + 1)) * sizeof(StmVersion));
+            location->count--;
+        }
+        pthread_mutex_unlock(&engine->page_locks[addr / PAGE_SIZE]);
+    }
+
+    pthread_mutex_lock(&state->lock);
+    state->reads = realloc(state->reads, (worker->read_count ? worker->read_count : 1) * sizeof(StmRead));
+    state->writes = realloc(state->writes, (worker->write_count ? worker->write_count : 1) * sizeof(uint16_t));
+    state->values = realloc(state->values, worker->write_count ? worker->write_count : 1);
+    if (state->reads == NULL || state->writes == NULL || state->values == NULL) {
+        printf("Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(state->reads, worker->reads, worker->read_count * sizeof(StmRead));
+    state->read_count = worker->read_count;
+    for (size_t i = 0; i < worker->write_count; i++) {
+        state->writes[i] = worker->writes[i];
+        state->values[i] = worker->cpu.memory[worker->writes[i]];
+    }
+    state->write_count = worker->write_count;
+    copy_cpu_state(&state->result, &worker->cpu);
+    state->outcome = outcome;
+    pthread_mutex_unlock(&state->lock);
+    return wrote_new;
+}
+
+// Function to mark an incarnation executed, wake its dependents and choose what to validate next
+static StmTask stm_finish_execution(StmEngine *engine, size_t tx, uint32_t incarnation, int wrote_new) {
+    StmTask task = {STM_TASK_NONE, tx, incarnation};
+    StmTx *state = &engine->tx[tx];
+    size_t *dependents;
+    size_t dependent_count;
+
+    pthread_mutex_lock(&state->lock);
+    state->status = STM_EXECUTED;
+    dependents = state->dependents;
+    dependent_count = state->dependent_count;
+    state->dependents = NULL;
+    state->dependent_count = state->dependent_capacity = 0;
+    pthread_mutex_unlock(&state->lock);
+
+    if (dependent_count > 0) {
+        size_t lowest = engine->count;
+        for (size_t i = 0; i < dependent_count; i++) {
+            pthread_mutex_lock(&engine->tx[dependents[i]].lock);
+            stm_set_ready(&engine->tx[dependents[i]]);
+            pthread_mutex_unlock(&engine->tx[dependents[i]].lock);
+            if (dependents[i] < lowest) {
+                lowest = dependents[i];
+            }
+        }
+        stm_lower(engine, &engine->execution_index, lowest);
+    }
+    free(dependents);
+
+    if (atomic_load(&engine->validation_index) > tx) {
+        if (wrote_new) {
+            stm_lower(engine, &engine->validation_index, tx);  // Higher transactions may have missed the new byte
+        } else {
+            task.kind = STM_TASK_VALIDATE;  // Only this transaction needs checking
+            return task;
+        }
+    }
+    atomic_fetch_sub(&engine->active_tasks, 1);
+    return task;
+}
+
+// Function to execute an incarnation and record it; returns a follow-up task
+static StmTask stm_try_execute(StmEngine *engine, StmWorker *worker, StmTask task) {
+    while (1) {
+        int outcome;
+        size_t blocking;
+
+        atomic_fetch_add(&engine->incarnations, 1);
+        if (stm_run_incarnation(engine, worker, task.tx, &outcome, &blocking) == 0) {
+            int wrote_new = stm_record(engine, worker, task.tx, task.incarnation, outcome);
+            return stm_finish_execution(engine, task.tx, task.incarnation, wrote_new);
+        }
+        atomic_fetch_add(&engine->dependencies, 1);
+        if (stm_add_dependency(engine, task.tx, blocking)) {
+            StmTask none = {STM_TASK_NONE, 0, 0};
+            return none;
+        }
+        // The blocking transaction finished in the meantime: run again with its writes
+    }
+}
+
+// Function to check that every byte a transaction read still comes from the same write
+static int stm_validate(StmEngine *engine, size_t tx) {
+    StmTx *state = &engine->tx[tx];
+    int valid = 1;
+
+    pthread_mutex_lock(&state->lock);
+    for (size_t i = 0; valid && i < state->read_count; i++) {
+        const StmRead *read = &state->reads[i];
+        pthread_mutex_lock(&engine->page_locks[read->addr / PAGE_SIZE]);
+        StmVersion *version = stm_latest_below(&engine->locations[read->addr], tx);
+        if (version == NULL) {
+            valid = read->tx == STM_STORAGE;
+        } else {
+            valid = !version->estimate && version->tx == read->tx && version->incarnation == read->incarnation;
+        }
+        pthread_mutex_unlock(&engine->page_locks[read->addr / PAGE_SIZE]);
+    }
+    pthread_mutex_unlock(&state->lock);
+    return valid;
+}
+
+// Function to validate an incarnation, aborting it if its reads are stale; returns a follow-up task
+static StmTask stm_try_validate(StmEngine *engine, StmTask task) {
+    StmTask next = {STM_TASK_NONE, task.tx, 0};
+    StmTx *state = &engine->tx[task.tx];
+    int aborted = 0;
+
+    atomic_fetch_add(&engine->validations, 1);
+    if (!stm_validate(engine, task.tx)) {
+        pthread_mutex_lock(&state->lock);
+        if (state->status == STM_EXECUTED && state->incarnation == task.incarnation) {
+            state->status = STM_ABORTING;
+            aborted = 1;
+        }
+        pthread_mutex_unlock(&state->lock);
+    }
+    if (!aborted) {
+        atomic_fetch_sub(&engine->active_tasks, 1);
+        return next;
+    }
+
+    // Readers of the aborted writes wait for the next incarnation rather than run on stale bytes
+    atomic_fetch_add(&engine->aborts, 1);
+    for (size_t i = 0; i < state->write_count; i++) {
+        uint16_t addr = state->writes[i];
+        pthread_mutex_lock(&engine->page_locks[addr / PAGE_SIZE]);
+        StmVersion *version = stm_own_version(&engine->locations[addr], task.tx);
+        if (version != NULL) {
+            version->estimate = 1;
+        }
+        pthread_mutex_unlock(&engine->page_locks[addr / PAGE_SIZE]);
+    }
+    pthread_mutex_lock(&state->lock);
+    stm_set_ready(state);
+    pthread_mutex_unlock(&state->lock);
+    stm_lower(engine, &engine->validation_index, task.tx + 1);
+    if (atomic_load(&engine->execution_index) > task.tx) {
+        return stm_try_incarnate(engine, task.tx);
+    }
+    atomic_fetch_sub(&engine->active_tasks, 1);
+    return next;
+}
+
+// Function run by each worker: take tasks until the scheduler declares the batch done
+static void *stm_worker(void *arg) {
+    StmEngine *engine = arg;
+    StmWorker *worker = malloc(sizeof(StmWorker));
+    StmTask task = {STM_TASK_NONE, 0, 0};
+
+    if (worker == NULL) {
+        printf("Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    while (!atomic_load(&engine->done)) {
+        if (task.kind == STM_TASK_EXECUTE) {
+            task = stm_try_execute(engine, worker, task);
+        } else if (task.kind == STM_TASK_VALIDATE) {
+            task = stm_try_validate(engine, task);
+        } else {
+            task = stm_next_task(engine);
+        }
+    }
+    free(worker);
+    return NULL;
+}
+
+// Function to run transactions speculatively in parallel over shared memory (Block-STM)
+// Reads and writes are tracked per byte; transactions are validated in order and re-executed when a lower
+// one changed what they read. Memory, results and outcomes end exactly as run_transactions_serial leaves them
+void run_transactions(uint8_t *memory, const CPU *txs, size_t count, uint64_t budget, CPU *results, int *outcomes, int threads, StmStats *stats) {
+    StmEngine *engine = calloc(1, sizeof(StmEngine));
+    pthread_t *workers = malloc((size_t)(threads > 1 ? threads : 1) * sizeof(pthread_t));
+    int started = 0;
+
+    if (engine == NULL || workers == NULL || (engine->tx = calloc(count ? count : 1, sizeof(StmTx))) == NULL) {
+        printf("Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    engine->storage = memory;
+    engine->txs = txs;
+    engine->count = count;
+    engine->budget = budget;
+    for (int page = 0; page < MEMORY_PAGES; page++) {
+        pthread_mutex_init(&engine->page_locks[page], NULL);
+    }
+    for (size_t i = 0; i < count; i++) {
+        pthread_mutex_init(&engine->tx[i].lock, NULL);
+    }
+
+    while (started < threads - 1 && pthread_create(&workers[started], NULL, stm_worker, engine) == 0) {
+        started++;
+    }
+    stm_worker(engine);  // The calling thread works too; it also covers any threads that failed to start
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    // Every transaction is validated against the final versions: replay the write sets in order
+    for (size_t i = 0; i < count; i++) {
+        StmTx *state = &engine->tx[i];
+        for (size_t w = 0; w < state->write_count; w++) {
+            memory[state->writes[w]] = state->values[w];
+        }
+        copy_cpu_state(&results[i], &state->result);
+        memcpy(results[i].memory, memory, MEMORY_SIZE);
+        memset(results[i].memory + MEMORY_SIZE, 0, MEMORY_GUARD);
+        if (state->outcome == STM_FAULT) {
+            execute(&results[i], fetch(&results[i]));  // Fails exactly as the serial run would
+        }
+        if (outcomes != NULL) {
+            outcomes[i] = state->outcome;
+        }
+        pthread_mutex_destroy(&state->lock);
+        free(state->dependents);
+        free(state->reads);
+        free(state->writes);
+        free(state->values);
+    }
+    if (stats != NULL) {
+        stats->incarnations += atomic_load(&engine->incarnations);
+        stats->validations += atomic_load(&engine->validations);
+        stats->aborts += atomic_load(&engine->aborts);
+        stats->dependencies += atomic_load(&engine->dependencies);
+    }
+    for (int page = 0; page < MEMORY_PAGES; page++) {
+        pthread_mutex_destroy(&engine->page_locks[page]);
+    }
+    for (size_t addr = 0; addr < MEMORY_SIZE; addr++) {
+        free(engine->locations[addr].versions);
+    }
+    free(engine->tx);
+    free(engine);
+    free(workers);
+}
+
+// Function to allocate a committed page holding a copy of data
+static StorePage *store_new_page(PageStore *store, const uint8_t *data) {
+    StorePage *page = malloc(sizeof(StorePage));
+    if (page == NULL) {
+        printf("Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(page->data, data, PAGE_SIZE);
+    page->retired = 0;
+    store->live_pages++;
+    return page;
+}
+
+// Function to start a store whose version 0 is a copy of memory
+void store_init(PageStore *store, const uint8_t *memory) {
+    StoreVersion *version = malloc(sizeof(StoreVersion));
+
+    memset(store, 0, sizeof(*store));
+    if (version == NULL) {
+        printf("Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    version->number = 0;
+    for (int page = 0; page < MEMORY_PAGES; page++) {
+        version->pages[page] = store_new_page(store, memory + page * PAGE_SIZE);
+    }
+    for (int reader = 0; reader < STORE_READERS; reader++) {
+        atomic_init(&store->readers[reader], STORE_IDLE);
+    }
+    for (int slot = 0; slot < STORE_VERSIONS; slot++) {
+        atomic_init(&store->ring[slot], NULL);
+    }
+    atomic_init(&store->ring[0], version);
+    atomic_init(&store->latest, 0);
+    atomic_init(&store->oldest, 0);
+    pthread_mutex_init(&store->commit_lock, NULL);
+}
+
+// Function to free every version and page; no reader may still hold a snapshot
+void store_free(PageStore *store) {
+    uint64_t latest = atomic_load(&store->latest);
+    StoreVersion *newest = atomic_load(&store->ring[latest % STORE_VERSIONS]);
+
+    // Each page is either in the latest version or waiting in the retired queue, never both
+    for (size_t i = store->retired_head; i < store->retired_count; i++) {
+        free(store->retired[i]);
+    }
+    for (int page = 0; page < MEMORY_PAGES; page++) {
+        free(newest->pages[page]);
+    }
+    for (uint64_t number = store->collected; number <= latest; number++) {
+        free(atomic_load(&store->ring[number % STORE_VERSIONS]));
+    }
+    free(store->retired);
+    pthread_mutex_destroy(&store->commit_lock);
+    memset(store, 0, sizeof(*store));
+}
+
+// Function to pin a version for reading without taking any lock; STORE_LATEST pins the newest
+// Returns NULL if the version was never committed or has been collected. A reader holds one snapshot at a time
+const StoreVersion *store_open(PageStore *store, int reader, uint64_t number) {
+    while (1) {
+        uint64_t latest = atomic_load(&store->latest);
+        uint64_t wanted = number == STORE_LATEST ? latest : number;
+
+        if (wanted > latest) {
+            return NULL;
+        }
+        // Announce first, then check: a collector either sees the announcement or has already raised oldest
+        atomic_store(&store->readers[reader], wanted);
+        if (wanted >= atomic_load(&store->oldest)) {
+            return atomic_load(&store->ring[wanted % STORE_VERSIONS]);
+        }
+        atomic_store(&store->readers[reader], STORE_IDLE);
+        if (number != STORE_LATEST) {
+            return NULL;
+        }
+        // The newest version moved on while we announced; try again with the new one
+    }
+}
+
+// Function to release a reader's snapshot so its version can be collected
+void store_close(PageStore *store, int reader) {
+    atomic_store(&store->readers[reader], STORE_IDLE);
+}
+
+// Function to read one page of a pinned version: a single table lookup whatever the version's age
+const uint8_t *store_page(const StoreVersion *version, int page) {
+    return version->pages[page]->data;
+}
+
+// Function to load a pinned version into a CPU's memory, as the base of its next store_commit()
+// Returns the CPU's write clock once it matches the version, which that commit takes as since
+uint64_t store_checkout(const StoreVersion *version, CPU *cpu) {
+    for (int page = 0; page < MEMORY_PAGES; page++) {
+        memcpy(cpu->memory + page * PAGE_SIZE, version->pages[page]->data, PAGE_SIZE);
+    }
+    mark_pages_written(cpu, ~(uint64_t)0);
+    return cpu->writes.clock;
+}
+
+// Function to free the versions no reader can reach any more, and the pages only they held
+// The commit lock must be held
+static void store_collect(PageStore *store) {
+    uint64_t floor = atomic_load(&store->latest);
+
+    for (int reader = 0; reader < STORE_READERS; reader++) {
+        uint64_t held = atomic_load(&store->readers[reader]);
+        if (held < floor) {
+            floor = held;
+        }
+    }
+    if (floor > atomic_load(&store->oldest)) {
+        atomic_store(&store->oldest, floor);
+    }
+    // Readers that announced before seeing the new oldest keep their versions until the next collection
+    for (int reader = 0; reader < STORE_READERS; reader++) {
+        uint64_t held = atomic_load(&store->readers[reader]);
+        if (held < floor) {
+            floor = held;
+        }
+    }
+
+    while (store->collected < floor) {
+        free(atomic_exchange(&store->ring[store->collected % STORE_VERSIONS], NULL));
+        store->collected++;
+    }
+    // A page retired at version r is held only by versions below r
+    while (store->retired_head < store->retired_count && store->retired[store->retired_head]->retired <= store->collected) {
+        free(store->retired[store->retired_head++]);
+        store->live_pages--;
+    }
+    if (store->retired_head > store->retired_capacity / 2) {
+        memmove(store->retired, store->retired + store->retired_head, (store->retired_count - store->retired_head) * sizeof(StorePage *));
+        store->retired_count -= store->retired_head;
+        store->retired_head = 0;
+    }
+}
+
+// Function to commit the pages where a CPU's memory differs from base, which the caller holds open
+// *since is the CPU's write clock when its memory last matched base (from store_checkout() or the previous
+// commit): only pages written after it are compared, so memory changed behind store() must be reported
+// with mark_pages_written(). The new version shares every other page with the latest one. A page also
+// changed by another commit since base is a write-write conflict (first committer wins). On success
+// *number is the version holding the writes, the CPU's memory is brought up to that version and *since
+// is moved to match it
+int store_commit(PageStore *store, CPU *cpu, const StoreVersion *base, uint64_t *since, uint64_t *number) {
+    uint64_t written = pages_written_since(cpu, *since);
+    uint64_t changed = 0;
+    uint64_t caught_up = 0;
+
+    pthread_mutex_lock(&store->commit_lock);
+    store_collect(store);
+
+    uint64_t latest_number = atomic_load(&store->latest);
+    StoreVersion *latest = atomic_load(&store->ring[latest_number % STORE_VERSIONS]);
+    for (; written != 0; written &= written - 1) {
+        int page = __builtin_ctzll(written);
+        if (memcmp(cpu->memory + page * PAGE_SIZE, base->pages[page]->data, PAGE_SIZE) != 0) {
+            if (latest->pages[page] != base->pages[page]) {
+                store->conflicts++;
+                pthread_mutex_unlock(&store->commit_lock);
+                return STORE_CONFLICT;
+            }
+            changed |= (uint64_t)1 << page;
+        }
+    }
+
+    StoreVersion *version = latest;
+    if (changed != 0) {
+        uint64_t next = latest_number + 1;
+        if (atomic_load(&store->ring[next % STORE_VERSIONS]) != NULL) {
+            pthread_mutex_unlock(&store->commit_lock);
+            return STORE_FULL;
+        }
+        version = malloc(sizeof(StoreVersion));
+        if (version == NULL) {
+            printf("Out of memory!\n");
+            exit(EXIT_FAILURE);
+        }
+        *version = *latest;
+        version->number = next;
+        for (uint64_t pages = changed; pages != 0; pages &= pages - 1) {
+            int page = __builtin_ctzll(pages);
+            if (store->retired_count == store->retired_capacity) {
+                store->retired_capacity = store->retired_capacity ? store->retired_capacity * 2 : 256;
+                store->retired = realloc(store->retired, store->retired_capacity * sizeof(StorePage *));
+                if (store->retired == NULL) {
+                    printf("Out of memory!\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            latest->pages[page]->retired = next;
+            store->retired[store->retired_count++] = latest->pages[page];
+            version->pages[page] = store_new_page(store, cpu->memory + page * PAGE_SIZE);
+        }
+        // Publish the table before the number, so a reader that sees the number finds the table
+        atomic_store(&store->ring[next % STORE_VERSIONS], version);
+        atomic_store(&store->latest, next);
+        store->commits++;
+    }
+
+    // Pages other commits changed since base: bring the CPU up to the version it is now based on
+    for (int page = 0; page < MEMORY_PAGES; page++) {
+        if (version->pages[page] != base->pages[page] && !((changed >> page) & 1)) {
+            memcpy(cpu->memory + page * PAGE_SIZE, version->pages[page]->data, PAGE_SIZE);
+            caught_up |= (uint64_t)1 << page;
+        }
+    }
+    mark_pages_written(cpu, caught_up);
+    *since = cpu->writes.clock;
+    *number = version->number;
+    pthread_mutex_unlock(&store->commit_lock);
+    return STORE_OK;
+}
+
+// Shared state of the page store check in main(): readers verify every snapshot while one thread commits
+typedef struct {
+    PageStore *store;               // Store under test
+    int reader;                     // Reader slot of this thread
+    _Atomic int *stop;              // Set once the writer is done
+    long failures;                  // Snapshots that were not internally consistent
+} StoreCheck;
+
+// Function run by each reader of the store check: version n holds n at page 0 and at the page byte 8 names
+static void *store_check_reader(void *arg) {
+    StoreCheck *check = arg;
+    while (!atomic_load(check->stop)) {
+        const StoreVersion *version = store_open(check->store, check->reader, STORE_LATEST);
+        uint64_t head, copy;
+        if (version == NULL) {
+            check->failures++;
+            continue;
+        }
+        memcpy(&head, store_page(version, 0), sizeof(head));
+        memcpy(&copy, store_page(version, store_page(version, 0)[8] % MEMORY_PAGES), sizeof(copy));
+        if (head != version->number || (version->number != 0 && copy != head)) {
+            check->failures++;
+        }
+        store_close(check->store, check->reader);
+    }
+    return NULL;
+}
+
+// The main function where the program execution begins
+int main() {
+    // Initialize the CPU structure with zeros
+    CPU cpu = {0};
+
+    cpu.position_in_memory = 0;  // Start execution at address 0
+
+    // Initialize registers with given values
+    cpu.registers[0] = 5;    // V0 = 5
+    cpu.registers[1] = 10;   // V1 = 10
+
+    // Load instructions into memory
+    uint8_t *mem = cpu.memory;  // Pointer to the memory array for convenience
+
+    // Main program
+    mem[0x0000] = 0x21; mem[0x0001] = 0x00;  // Address 0x0000: CALL 0x0100
+    mem[0x0002] = 0x21; mem[0x0003] = 0x00;  // Address 0x0002: CALL 0x0100
+
+    // Subroutine at address 0x0100
+    mem[0x0100] = 0x80; mem[0x0101] = 0x14;  // Address 0x0100: ADD V0, V1
+    mem[0x0102] = 0x80; mem[0x0103] = 0x14;  // Address 0x0102: ADD V0, V1
+    mem[0x0104] = 0x00; mem[0x0105] = 0xEE;  // Address 0x0104: ADD V0, V1
+
+    run(&cpu);  // Start the CPU execution
+
+    // After execution, check that the result is as expected
+    assert(cpu.registers[0] == 45);  // V0 should now be 420
+
+    // Print the result of the computation
+    printf("0 + (70 * 3) + (70 * 3) = %d\n", cpu.registers[0]);
+
+    // A test program: 16 rounds of V0 += 7, V1 += V0, counting in V3 the rounds without a carry
+    static CPU program;
+    static const uint16_t rounds[] = {0x6210, 0x7007, 0x8104, 0x3F01, 0x7301, 0x72FF, 0x3200, 0x1202, 0x0000};
+    program.position_in_memory = 0x200;
+    for (size_t i = 0; i < sizeof(rounds) / sizeof(rounds[0]); i++) {
+        program.memory[0x200 + 2 * i] = rounds[i] >> 8;
+        program.memory[0x201 + 2 * i] = rounds[i] & 0xFF;
+    }
+
+    // Instances that differ only in registers must end as if each had been run on its own
+    static CPU scalar[100], lanes[100];
+    for (size_t i = 0; i < 100; i++) {
+        scalar[i] = program;
+        scalar[i].registers[0] = (uint8_t)(i * 37);
+        scalar[i].registers[1] = (uint8_t)i;
+        lanes[i] = scalar[i];
+        run(&scalar[i]);
+    }
+    run_bitsliced(lanes, 100);
+    for (size_t i = 0; i < 100; i++) {
+        assert(shares_machine_state(&scalar[i], &lanes[i]));
+        assert(memcmp(scalar[i].registers, lanes[i].registers, sizeof(lanes[i].registers)) == 0);
+    }
+    printf("Bitsliced instances match scalar runs (V3 of instance 1 = %d)\n", lanes[1].registers[3]);
+
+
+    // Instances that enter the loop with different round counts diverge; regrouped runs must still match
+    LaneStats lane_stats = {0};
+    for (size_t i = 0; i < 100; i++) {
+        scalar[i] = program;
+        scalar[i].position_in_memory = 0x202;
+        scalar[i].registers[0] = (uint8_t)(i * 37);
+        scalar[i].registers[2] = (uint8_t)(1 + i % 5);
+        lanes[i] = scalar[i];
+        run(&scalar[i]);
+    }
+    run_regrouped(lanes, 100, 16, 8, &lane_stats);
+    for (size_t i = 0; i < 100; i++) {
+        assert(shares_machine_state(&scalar[i], &lanes[i]));
+        assert(memcmp(scalar[i].registers, lanes[i].registers, sizeof(lanes[i].registers)) == 0);
+    }
+    assert(lane_utilization(&lane_stats) > 0.0 && lane_utilization(&lane_stats) <= 1.0);
+    printf("Regrouped instances match scalar runs (%.0f%% lane utilization)\n", 100.0 * lane_utilization(&lane_stats));
+
+
+    // Lockstep lane groups on translated blocks must also end as if each instance had been run on its own
+    static IrCache ir_cache;
+    ir_cache_init(&ir_cache, program.memory);
+    for (size_t i = 0; i < 100; i++) {
+        scalar[i] = program;
+        scalar[i].registers[0] = (uint8_t)(i * 37);
+        scalar[i].registers[1] = (uint8_t)i;
+        lanes[i] = scalar[i];
+        run(&scalar[i]);
+    }
+    run_vector_ir(lanes, 100, &ir_cache);
+    for (size_t i = 0; i < 100; i++) {
+        assert(shares_machine_state(&scalar[i], &lanes[i]));
+        assert(memcmp(scalar[i].registers, lanes[i].registers, sizeof(lanes[i].registers)) == 0);
+    }
+    ir_cache_free(&ir_cache);
+    printf("Vector lane groups match scalar runs\n");
+
+
+    // Every block translated from the program must verify, and running translated blocks must match run()
+    static IrBlock block;
+    for (uint16_t pc = 0x200; pc < 0x200 + sizeof(rounds); pc += 2) {
+        ir_build_block(program.memory, pc, &block);
+        assert(ir_verify(&block) == NULL);
+    }
+    ir_cache_init(&ir_cache, program.memory);
+    for (size_t i = 0; i < 10; i++) {
+        lanes[i] = program;
+        lanes[i].registers[0] = (uint8_t)(i * 37);
+        lanes[i].registers[1] = (uint8_t)i;
+        run_ir(&lanes[i], &ir_cache);
+        assert(shares_machine_state(&scalar[i], &lanes[i]));
+        assert(memcmp(scalar[i].registers, lanes[i].registers, sizeof(lanes[i].registers)) == 0);
+    }
+    assert(ir_cache.hits > 0);
+    ir_cache_free(&ir_cache);
+    printf("Translated blocks verify and match run()\n");
+
+
+    // The first program never nests calls deeper than one, so its blocks can drop the stack checks
+    static CPU unchecked;
+    memcpy(unchecked.memory, cpu.memory, sizeof(unchecked.memory));
+    unchecked.registers[0] = 5;
+    unchecked.registers[1] = 10;
+    StackAnalysis analysis = analyze_stack_depth(unchecked.memory, 0);
+    assert(analysis.bounded && analysis.max_depth == 1);
+    ir_cache_init(&ir_cache, unchecked.memory);
+    assert(ir_cache_elide_stack_checks(&ir_cache, 0) == 1);
+    run_ir(&unchecked, &ir_cache);
+    assert(unchecked.registers[0] == 45 && unchecked.stack_pointer == 0);
+    ir_cache_free(&ir_cache);
+    unchecked.memory[0x300] = 0x23;  // CALL 0x300: unbounded recursion
+    assert(!analyze_stack_depth(unchecked.memory, 0x300).bounded);
+    printf("Stack analysis bounds the first program at depth %d\n", analysis.max_depth);
+
+
+    // Execution runs off the top of memory into address 0, and stores at 0xFFF wrap instead of touching the guard
+    static CPU wrapped;
+    wrapped.position_in_memory = 0xFFE;
+    wrapped.index = 0xFFF;
+    wrapped.registers[1] = 0xCD;
+    wrapped.memory[0xFFE] = 0x70; wrapped.memory[0xFFF] = 0x01;  // ADD V0, 1
+    wrapped.memory[0x000] = 0xF1; wrapped.memory[0x001] = 0x55;  // LD [I], V0..V1
+    run(&wrapped);
+    assert(wrapped.registers[0] == 1 && wrapped.memory[0xFFF] == 1 && wrapped.memory[0x000] == 0xCD);
+    assert(wrapped.memory[MEMORY_SIZE] == 0 && wrapped.position_in_memory <= ADDRESS_MASK);
+    printf("PC and stores wrap at 12 bits; the guard byte stays zero\n");
+
+
+    // Fast-forwarding a delay-timer wait loop must land exactly where stepping through it does
+    static CPU stepped, skipped;
+    static const uint16_t wait[] = {0x6078, 0xF015, 0xF107, 0x3100, 0x1204, 0x0000, 0xE09E, 0x120C};
+    for (size_t i = 0; i < sizeof(wait) / sizeof(wait[0]); i++) {
+        stepped.memory[0x200 + 2 * i] = wait[i] >> 8;
+        stepped.memory[0x201 + 2 * i] = wait[i] & 0xFF;
+    }
+    stepped.position_in_memory = 0x200;
+    skipped = stepped;
+    run(&stepped);
+    assert(run_for(&skipped, 1000000) == RUN_HALTED);
+    assert(shares_machine_state(&stepped, &skipped));
+    assert(memcmp(stepped.registers, skipped.registers, sizeof(skipped.registers)) == 0);
+
+    // A loop waiting on key 0 only parks: the whole budget passes
+    skipped.position_in_memory = 0x20C;
+    uint64_t parked = skipped.cycles;
+    assert(run_for(&skipped, 1000000) == RUN_IDLE);
+    assert(skipped.cycles - parked > 1000000 - 2 && skipped.position_in_memory == 0x20C);
+    printf("Wait loops fast-forward to the same state (%llu instructions stepped)\n", (unsigned long long)stepped.cycles);
+
+
+    // A hi-res 16x16 sprite across the word boundary must scroll as one 128-bit row and erase itself on redraw
+    static CPU screen;
+    static const uint64_t dark[DISPLAY_HEIGHT][2];
+    screen.hires = 1;
+    screen.index = 0x300;
+    memset(&screen.memory[0x300], 0xFF, 32);
+    screen.registers[0] = 60;
+    draw(&screen, 0, 1, 0);
+    assert(screen.registers[0xF] == 0 && screen.display[15][0] == 0xF && screen.display[15][1] == 0xFFF0000000000000);
+    scroll_right(&screen);
+    assert(screen.display[0][0] == 0 && screen.display[0][1] == 0xFFFF000000000000);
+    scroll_left(&screen);
+    scroll_down(&screen, 2);
+    assert(screen.display[1][1] == 0 && screen.display[2][0] == 0xF && screen.display[17][1] == 0xFFF0000000000000);
+    screen.registers[1] = 2;
+    draw(&screen, 0, 1, 0);
+    assert(screen.registers[0xF] == 1 && memcmp(screen.display, dark, sizeof(dark)) == 0);
+    printf("Hi-res sprites draw, scroll and collide across the word boundary\n");
+
+
+    // Three identical frames and one different one must export as two PBM images, the first repeated twice
+    char *stream = NULL;
+    size_t stream_size = 0;
+    FILE *memory_file = open_memstream(&stream, &stream_size);
+    VideoExporter video;
+    assert(memory_file != NULL);
+    video_open(&video, memory_file, VIDEO_PBM, 1);
+    for (int frame = 0; frame < 3; frame++) {
+        video_write_frame(&video, &screen);
+    }
+    draw(&screen, 0, 1, 0);
+    video_write_frame(&video, &screen);
+    video_close(&video);
+    fclose(memory_file);
+    static const char repeated[] = "P4\n# repeat 2\n128 64\n";
+    assert(video.duplicates == 2 && stream_size == sizeof(repeated) - 1 + 1024 + strlen("P4\n128 64\n") + 1024);
+    assert(memcmp(stream, repeated, sizeof(repeated) - 1) == 0);
+    free(stream);
+    printf("Video export writes unchanged frames as a repeat count (%zu bytes)\n", stream_size);
+
+
+    // The terminal gets every cell once, nothing for an unchanged frame and a single cell for a one-pixel change
+    TerminalRenderer term;
+    int terminal_pipe[2];
+    assert(pipe(terminal_pipe) == 0);
+    terminal_open(&term, terminal_pipe[1]);
+    terminal_render(&term, &screen);
+    uint64_t full_bytes = term.bytes_sent;
+    terminal_render(&term, &screen);
+    assert(term.cells_sent == DISPLAY_WIDTH * TERMINAL_ROWS && term.bytes_sent == full_bytes);
+    screen.display[40][1] ^= 1;
+    terminal_render(&term, &screen);
+    assert(term.cells_sent == DISPLAY_WIDTH * TERMINAL_ROWS + 1 && term.bytes_sent - full_bytes < 16);
+    terminal_close(&term);
+    close(terminal_pipe[0]);
+    close(terminal_pipe[1]);
+    screen.display[40][1] ^= 1;
+    printf("Terminal sends a one-pixel change in %llu bytes\n", (unsigned long long)(term.bytes_sent - full_bytes));
+
+
+    // FX18 at cycle 9 sets the sound timer to 3: the tone must sound from that cycle to the tick at cycle 30
+    static CPU beeper;
+    static AudioRing ring;
+    static int16_t pcm[AUDIO_RING_SIZE];
+    static const uint16_t beep[] = {0x6003, 0x7100, 0x7100, 0x7100, 0x7100, 0x7100, 0x7100, 0x7100, 0xF018, 0x1212};
+    AudioGenerator audio;
+    for (size_t i = 0; i < sizeof(beep) / sizeof(beep[0]); i++) {
+        beeper.memory[0x200 + 2 * i] = beep[i] >> 8;
+        beeper.memory[0x201 + 2 * i] = beep[i] & 0xFF;
+    }
+    beeper.position_in_memory = 0x200;
+    audio_ring_init(&ring);
+    audio_init(&audio, &ring, 48000, &beeper);
+    for (int frame = 0; frame < 10; frame++) {
+        run_for(&beeper, CYCLES_PER_FRAME);
+        audio_generate(&audio, &beeper);
+    }
+    size_t samples_per_cycle = 48000 / CYCLES_PER_SECOND;
+    size_t pcm_count = audio_ring_pop(&ring, pcm, AUDIO_RING_SIZE);
+    assert(pcm_count == 100 * samples_per_cycle);
+    for (size_t i = 0; i < pcm_count; i++) {
+        assert((pcm[i] != 0) == (i >= 9 * samples_per_cycle && i < 30 * samples_per_cycle));
+    }
+
+    // The same samples must come out of the ring as a 16-bit mono WAV file with the sizes filled in
+    WavSink wav;
+    uint8_t wav_header_bytes[44];
+    FILE *wav_file = tmpfile();
+    assert(wav_file != NULL);
+    wav_open(&wav, wav_file, 48000);
+    audio_ring_push(&ring, pcm, pcm_count);
+    wav_drain(&wav, &ring);
+    wav_close(&wav);
+    assert(fseek(wav_file, 0, SEEK_END) == 0 && ftell(wav_file) == (long)(44 + 2 * pcm_count));
+    rewind(wav_file);
+    assert(fread(wav_header_bytes, 1, 44, wav_file) == 44);
+    assert(memcmp(wav_header_bytes, "RIFF", 4) == 0 && memcmp(wav_header_bytes + 36, "data", 4) == 0);
+    assert(wav_header_bytes[40] + (wav_header_bytes[41] << 8) == (int)(2 * pcm_count));
+    fclose(wav_file);
+    printf("Sound timer tone spans cycles 9 to 30 (%zu samples written as WAV)\n", pcm_count);
+
+
+    // A program counting loop iterations with key 1 held, and two movies: a 3-frame press, and key 1 throughout
+    static CPU player, played[2], replayed;
+    static const uint16_t counting[] = {0x6101, 0xE1A1, 0x7001, 0x1202};
+    InputMovie movies[2], loaded;
+    int movie_status[2];
+    for (size_t i = 0; i < sizeof(counting) / sizeof(counting[0]); i++) {
+        player.memory[0x200 + 2 * i] = counting[i] >> 8;
+        player.memory[0x201 + 2 * i] = counting[i] & 0xFF;
+    }
+    player.position_in_memory = 0x200;
+    movie_init(&movies[0]);
+    movie_init(&movies[1]);
+    for (int frame = 0; frame < 12; frame++) {
+        movie_record(&movies[0], (frame >= 5 && frame < 8) ? 0x0002 : 0);
+        movie_record(&movies[1], 0x0002);
+    }
+
+    // A saved movie must load back, and every way of playing it must end in the same state
+    FILE *movie_file = tmpfile();
+    assert(movie_file != NULL);
+    movie_save(&movies[0], movie_file);
+    rewind(movie_file);
+    assert(movie_load(&loaded, movie_file) == 0 && loaded.count == 3 && loaded.frames == 12);
+    fclose(movie_file);
+    play_movies(&player, movies, 2, played, movie_status, 2);
+    ir_cache_init(&ir_cache, player.memory);
+    for (int m = 0; m < 2; m++) {
+        replayed = player;
+        assert(movie_play(&replayed, m == 0 ? &loaded : &movies[1]) == movie_status[m]);
+        assert(shares_machine_state(&replayed, &played[m]));
+        assert(memcmp(replayed.registers, played[m].registers, sizeof(replayed.registers)) == 0);
+        replayed = player;
+        movie_play_ir(&replayed, &ir_cache, &movies[m]);
+        assert(shares_machine_state(&replayed, &played[m]) && replayed.registers[0] == played[m].registers[0]);
+    }
+    assert(played[0].registers[0] > 0 && played[0].registers[0] < played[1].registers[0]);
+    ir_cache_free(&ir_cache);
+    movie_free(&movies[0]);
+    movie_free(&movies[1]);
+    movie_free(&loaded);
+    printf("Movies replay identically (V0 = %d and %d)\n", played[0].registers[0], played[1].registers[0]);
+
+
+    // A program storing the BCD digits of its count of iterations with key 1 held, run frame by frame
+    static CPU counter_bcd, shown;
+    static const uint16_t bcd_counting[] = {0x6101, 0xA900, 0xE1A1, 0x7001, 0xF033, 0x1204};
+    for (size_t i = 0; i < sizeof(bcd_counting) / sizeof(bcd_counting[0]); i++) {
+        counter_bcd.memory[0x200 + 2 * i] = bcd_counting[i] >> 8;
+        counter_bcd.memory[0x201 + 2 * i] = bcd_counting[i] & 0xFF;
+    }
+    counter_bcd.position_in_memory = 0x200;
+
+    // Speculative frames must be rolled back: run-ahead leaves the state of plain frame-by-frame runs
+    static RunAhead ahead;
+    shown = counter_bcd;
+    replayed = counter_bcd;
+    run_ahead_init(&ahead, 2);
+    for (int frame = 0; frame < 10; frame++) {
+        uint16_t keys = (frame % 3 == 0) ? 0x0002 : 0;
+        run_ahead_frame(&ahead, &shown, keys);
+        replayed.keys = keys;
+        run_for(&replayed, CYCLES_PER_FRAME);
+    }
+    assert(shares_machine_state(&shown, &replayed));
+    assert(memcmp(shown.registers, replayed.registers, sizeof(shown.registers)) == 0);
+    assert(ahead.pages_copied < 10 * 2 * MEMORY_PAGES);
+    printf("Run-ahead restores the real state (%llu pages copied)\n", (unsigned long long)ahead.pages_copied);
+
+
+    // A late key press for frame 3 must rewrite history into what pressing it on time would have produced
+    static Rollback rollback;
+    shown = counter_bcd;
+    replayed = counter_bcd;
+    rollback_init(&rollback, &shown);
+    for (int frame = 0; frame < 10; frame++) {
+        rollback_advance(&rollback, &shown, 0);
+        replayed.keys = (frame == 3) ? 0x0002 : 0;
+        run_for(&replayed, CYCLES_PER_FRAME);
+    }
+    assert(rollback_correct(&rollback, &shown, 3, 0x0002) == 7);
+    assert(rollback_correct(&rollback, &shown, 3, 0x0002) == 0);
+    assert(shares_machine_state(&shown, &replayed));
+    assert(memcmp(shown.registers, replayed.registers, sizeof(shown.registers)) == 0 && shown.registers[0] > 0);
+    printf("Rollback re-simulates a late input into the on-time result (V0 = %d)\n", shown.registers[0]);
+
+
+    // A repeated job must come from the result cache unchanged; a different start state must miss
+    static ResultCache results;
+    static CPU cached, direct;
+    movie_init(&movies[0]);
+    for (int frame = 0; frame < 40; frame++) {
+        movie_record(&movies[0], (frame / 4) % 2 ? 0x0002 : 0);
+    }
+    result_cache_init(&results, 4, NULL);
+    direct = counter_bcd;
+    int direct_status = movie_play(&direct, &movies[0]);
+    assert(run_job_cached(&results, &counter_bcd, &movies[0], &cached) == direct_status);
+    assert(run_job_cached(&results, &counter_bcd, &movies[0], &cached) == direct_status && results.hits == 1);
+    assert(shares_machine_state(&cached, &direct) && memcmp(cached.registers, direct.registers, sizeof(direct.registers)) == 0);
+    shown = counter_bcd;
+    shown.registers[5] = 1;
+    run_job_cached(&results, &shown, &movies[0], &cached);
+    assert(results.hits == 1 && cached.registers[5] == 1);
+    result_cache_free(&results);
+    movie_free(&movies[0]);
+    printf("Result cache answers the repeated job (hit rate %.2f)\n", result_cache_hit_rate(&results));
+
+
+    // Two jobs sharing their first 64 frames: the second must resume from a checkpoint and still match movie_play
+    static CheckpointTrie trie;
+    movie_init(&movies[0]);
+    movie_init(&movies[1]);
+    for (int frame = 0; frame < 80; frame++) {
+        movie_record(&movies[0], (frame / 4) % 2 ? 0x0002 : 0);
+        movie_record(&movies[1], frame < 64 && (frame / 4) % 2 ? 0x0002 : 0);
+    }
+    checkpoint_trie_init(&trie, 16);
+    for (int m = 0; m < 2; m++) {
+        direct = counter_bcd;
+        direct_status = movie_play(&direct, &movies[m]);
+        assert(run_job_resumable(&trie, &counter_bcd, &movies[m], &cached) == direct_status);
+        assert(shares_machine_state(&cached, &direct) && memcmp(cached.registers, direct.registers, sizeof(direct.registers)) == 0);
+    }
+    assert(trie.frames_resumed == 64 && trie.frames_run == 80 + 16);
+    checkpoint_trie_free(&trie);
+    movie_free(&movies[0]);
+    movie_free(&movies[1]);
+    printf("Checkpoint trie resumes the shared prefix (%llu frames skipped)\n", (unsigned long long)trie.frames_resumed);
+
+
+    // LZ blobs must decode to exactly what was encoded
+    static uint8_t plain[1024], packed[LZ_BOUND(1024)], unpacked[1024];
+    for (size_t i = 0; i < sizeof(plain); i++) {
+        plain[i] = (uint8_t)(i % 7 == 0 ? i : i / 64);
+    }
+    size_t packed_size = lz_compress(plain, sizeof(plain), packed);
+    long unpacked_size = lz_decompress(packed, packed_size, unpacked, sizeof(unpacked));
+    assert(unpacked_size == (long)sizeof(plain));
+    assert(memcmp(plain, unpacked, sizeof(plain)) == 0);
+
+    // An instance left waiting on a key must be parked in the background and resume in the same state
+    static ParkingLot lot;
+    uint64_t parked_now = 0;
+    parking_init(&lot, 1, 2);
+    CPU *parked_cpu = parking_acquire(&lot, 0);
+    *parked_cpu = skipped;
+    for (int idle_run = 0; idle_run < 2; idle_run++) {
+        parking_note_run(&lot, 0, run_for(parked_cpu, 100));
+        run_for(&skipped, 100);
+    }
+    while (parked_now == 0) {
+        struct timespec nap = {0, 1000000};
+        nanosleep(&nap, NULL);
+        pthread_mutex_lock(&lot.lock);
+        parked_now = lot.parked_instances;
+        pthread_mutex_unlock(&lot.lock);
+    }
+    parked_cpu = parking_acquire(&lot, 0);
+    assert(lot.resumes == 1 && shares_machine_state(parked_cpu, &skipped));
+    assert(memcmp(parked_cpu->registers, skipped.registers, sizeof(skipped.registers)) == 0);
+    parking_free(&lot);
+    printf("LZ round-trips (%zu -> %zu bytes) and a parked instance resumes intact\n", sizeof(plain), packed_size);
+
+
+    // A migrated instance must arrive with the state it left with, both as a blob and through a pipe
+    static uint8_t blob[MIGRATION_MAX_BLOB];
+    static CPU migrated;
+    int migration_pipe[2];
+    direct.display[3][1] = 0xF00F;
+    direct.keys = 0x0081;
+    size_t blob_size = migration_encode(&direct, counter_bcd.memory, blob);
+    assert(migration_decode(blob, blob_size, counter_bcd.memory, &migrated) == 0);
+    assert(shares_machine_state(&direct, &migrated));
+    assert(memcmp(direct.registers, migrated.registers, sizeof(migrated.registers)) == 0);
+    memset(&migrated, 0, sizeof(migrated));
+    assert(pipe(migration_pipe) == 0);
+    assert(migrate_send(migration_pipe[1], &direct, counter_bcd.memory) == 0);
+    assert(migrate_receive(migration_pipe[0], counter_bcd.memory, &migrated) == 0);
+    assert(shares_machine_state(&direct, &migrated));
+    close(migration_pipe[0]);
+    close(migration_pipe[1]);
+    printf("Migration round-trips (%zu bytes)\n", blob_size);
+
+
+    // Parked instances holding the same pages must share one copy of them, and still resume intact
+    uint64_t reclaimed = 0;
+    for (size_t i = 0x400; i < 0x800; i++) {
+        skipped.memory[i] = (uint8_t)(i * 7);
+    }
+    mark_pages_written(&skipped, ~(uint64_t)0);
+    parking_init(&lot, 4, 1);
+    parking_set_dedup_rate(&lot, 1e6);
+    for (size_t id = 0; id < 4; id++) {
+        parked_cpu = parking_acquire(&lot, id);
+        *parked_cpu = skipped;
+        parking_note_run(&lot, id, run_for(parked_cpu, 100));
+    }
+    run_for(&skipped, 100);
+    while (reclaimed == 0) {
+        struct timespec nap = {0, 1000000};
+        nanosleep(&nap, NULL);
+        pthread_mutex_lock(&lot.lock);
+        reclaimed = lot.reclaimed_bytes;
+        pthread_mutex_unlock(&lot.lock);
+    }
+    for (size_t id = 0; id < 4; id++) {
+        parked_cpu = parking_acquire(&lot, id);
+        assert(shares_machine_state(parked_cpu, &skipped));
+    }
+    parking_free(&lot);
+    printf("Deduplication shares identical parked pages (%llu bytes reclaimed)\n", (unsigned long long)reclaimed);
+
+
+    // Jobs served by forked children must report the state movie_play reaches for each of them
+    ForkServerStats fork_stats = {0};
+    InputMovie fork_jobs[3];
+    FILE *requests = tmpfile(), *responses = tmpfile();
+    assert(requests != NULL && responses != NULL);
+    for (uint32_t job = 0; job < 3; job++) {
+        uint8_t job_id[4];
+        movie_init(&fork_jobs[job]);
+        for (uint32_t frame = 0; frame < 20; frame++) {
+            movie_record(&fork_jobs[job], frame % (job + 2) == 0 ? 0x0002 : 0);
+        }
+        blob_put(job_id, job, 4);
+        fwrite(job_id, 1, sizeof(job_id), requests);
+        movie_save(&fork_jobs[job], requests);
+    }
+    fflush(requests);
+    rewind(requests);
+    ir_cache_init(&ir_cache, counter_bcd.memory);
+    assert(fork_server(fileno(requests), fileno(responses), &counter_bcd, &ir_cache, &fork_stats) == 0);
+    assert(fork_stats.jobs == 3 && fork_stats.failures == 0);
+    rewind(responses);
+    for (int response = 0; response < 3; response++) {
+        uint8_t header[20];
+        const uint8_t *in = header;
+        assert(fread(header, 1, sizeof(header), responses) == sizeof(header));
+        uint32_t job = (uint32_t)blob_get(&in, 4);
+        int job_status = (int)blob_get(&in, 4);
+        blob_get(&in, 8);  // Startup time
+        size_t size = (size_t)blob_get(&in, 4);
+        assert(job < 3 && size <= sizeof(blob) && fread(blob, 1, size, responses) == size);
+        assert(migration_decode(blob, size, counter_bcd.memory, &migrated) == 0);
+        direct = counter_bcd;
+        assert(movie_play(&direct, &fork_jobs[job]) == job_status && shares_machine_state(&direct, &migrated));
+        assert(memcmp(direct.registers, migrated.registers, sizeof(direct.registers)) == 0);
+    }
+    for (int job = 0; job < 3; job++) {
+        movie_free(&fork_jobs[job]);
+    }
+    fclose(requests);
+    fclose(responses);
+    ir_cache_free(&ir_cache);
+    printf("Fork server children match movie_play (%llu ns slowest startup)\n", (unsigned long long)fork_stats.startup_ns_max);
+
+
+    // A test program: count V0 from 1 to 10, storing its BCD digits at 0x900 each time
+    static CPU metered;
+    static const uint16_t counter[] = {0x6000, 0xA900, 0x7001, 0xF033, 0x300A, 0x1204, 0x0000};
+    metered.position_in_memory = 0x200;
+    for (size_t i = 0; i < sizeof(counter) / sizeof(counter[0]); i++) {
+        metered.memory[0x200 + 2 * i] = counter[i] >> 8;
+        metered.memory[0x201 + 2 * i] = counter[i] & 0xFF;
+    }
+
+    // Translated blocks must charge the same gas and stop at the same instruction as the interpreter
+    static CPU interpreted, translated;
+    GasSchedule schedule = gas_default_schedule();
+    ir_cache_init(&ir_cache, metered.memory);
+    ir_cache_set_schedule(&ir_cache, &schedule);
+    for (uint64_t budget = 0; budget <= 200; budget += 25) {
+        uint64_t interpreted_gas = budget, translated_gas = budget;
+        interpreted = metered;
+        translated = metered;
+        int interpreted_status = run_metered(&interpreted, &schedule, &interpreted_gas);
+        int translated_status = run_ir_metered(&translated, &ir_cache, &translated_gas);
+        assert(interpreted_status == translated_status && interpreted_gas == translated_gas);
+        assert(shares_machine_state(&interpreted, &translated));
+        assert(memcmp(interpreted.registers, translated.registers, sizeof(interpreted.registers)) == 0);
+    }
+    assert(interpreted.memory[0x900] == 0 && interpreted.memory[0x901] == 1 && interpreted.memory[0x902] == 0);
+    ir_cache_free(&ir_cache);
+    printf("Metered interpreter and translated blocks agree\n");
+
+
+    // SHA-256 of "abc" must match the FIPS 180-2 test vector
+    static const uint8_t abc_digest[SHA256_SIZE] = {
+        0xBA, 0x78, 0x16, 0xBF, 0x8F, 0x01, 0xCF, 0xEA, 0x41, 0x41, 0x40, 0xDE, 0x5D, 0xAE, 0x22, 0x23,
+        0xB0, 0x03, 0x61, 0xA3, 0x96, 0x17, 0x7A, 0x9C, 0xB4, 0x10, 0xFF, 0x61, 0xF2, 0x00, 0x15, 0xAD};
+    const uint8_t *abc = (const uint8_t *)"abc";
+    uint8_t digest[1][SHA256_SIZE];
+    sha256_many(&abc, 3, 1, digest);
+    assert(memcmp(digest[0], abc_digest, SHA256_SIZE) == 0);
+    printf("SHA-256(\"abc\") matches the test vector\n");
+
+    // A Merkle tree updated from the written pages must reach the root of one built from scratch,
+    // and prove the contents of a page it rehashed
+    static MerkleTree incremental, fresh;
+    static uint8_t path[MERKLE_DEPTH + 1][SHA256_SIZE];
+    merkle_init(&incremental);
+    merkle_commit(&incremental, &interpreted);
+    store(&interpreted, 0x123, 0x45);
+    store(&interpreted, 0xFFF, 0x67);
+    interpreted.registers[5] ^= 0x80;
+    interpreted.display[10][0] ^= 0x8000000000000000;
+    merkle_commit(&incremental, &interpreted);
+    merkle_init(&fresh);
+    merkle_commit(&fresh, &interpreted);
+    assert(memcmp(incremental.root, fresh.root, SHA256_SIZE) == 0);
+    int proved_page = 0x123 / PAGE_SIZE;
+    merkle_prove_page(&incremental, proved_page, path);
+    assert(merkle_verify_page(incremental.root, proved_page, &interpreted.memory[proved_page * PAGE_SIZE],
+                              (const uint8_t (*)[SHA256_SIZE])path));
+    printf("Incremental and fresh Merkle roots match and a page proof verifies\n");
+
+
+    // A traced run must end where run() does, and a step proof must verify against replayed roots only
+    static ExecutionTrace trace;
+    static StepProof proof;
+    static CPU traced;
+    uint8_t step_roots[2][SHA256_SIZE];
+    traced = metered;
+    interpreted = metered;
+    run(&interpreted);
+    trace_init(&trace, 4, 2);
+    assert(trace_run(&trace, &traced, 1000) == RUN_HALTED && shares_machine_state(&traced, &interpreted));
+    assert(trace_replay(&trace, 13, 14, 1, step_roots, NULL) == 2);
+    assert(step_prove(&trace, 13, &proof) == 0 && step_verify(&proof, step_roots[0], step_roots[1]) == 1);
+    step_roots[1][0] ^= 1;
+    assert(step_verify(&proof, step_roots[0], step_roots[1]) == 0);
+    step_roots[1][0] ^= 1;
+    proof.pre.registers[0] ^= 1;
+    assert(step_verify(&proof, step_roots[0], step_roots[1]) == 0);
+    trace_free(&trace);
+    printf("Step proofs verify for the traced run and reject tampering (%llu steps)\n", (unsigned long long)trace.steps);
+
+
+    // Optimistic transactions must leave the memory and results of running them one after another
+    // Every transaction increments the counter at 0x800 + (its number % 8), so they conflict in eights
+    static const uint16_t increment[] = {0xF065, 0x7001, 0xF055, 0x0000};
+    static uint8_t serial_memory[MEMORY_SIZE], stm_memory[MEMORY_SIZE];
+    static CPU txs[64], serial_results[64], stm_results[64];
+    int serial_outcomes[64], stm_outcomes[64];
+    StmStats stm_stats = {0};
+    for (size_t i = 0; i < sizeof(increment) / sizeof(increment[0]); i++) {
+        serial_memory[0x200 + 2 * i] = increment[i] >> 8;
+        serial_memory[0x201 + 2 * i] = increment[i] & 0xFF;
+    }
+    memcpy(stm_memory, serial_memory, MEMORY_SIZE);
+    for (size_t i = 0; i < 64; i++) {
+        txs[i].position_in_memory = 0x200;
+        txs[i].index = 0x800 + i % 8;
+    }
+    run_transactions_serial(serial_memory, txs, 64, 100, serial_results, serial_outcomes);
+    run_transactions(stm_memory, txs, 64, 100, stm_results, stm_outcomes, 4, &stm_stats);
+    assert(memcmp(serial_memory, stm_memory, MEMORY_SIZE) == 0 && serial_memory[0x800] == 8);
+    for (size_t i = 0; i < 64; i++) {
+        assert(serial_outcomes[i] == stm_outcomes[i] && serial_outcomes[i] == RUN_HALTED);
+        assert(memcmp(serial_results[i].registers, stm_results[i].registers, sizeof(stm_results[i].registers)) == 0);
+    }
+    printf("STM matches serial execution (%llu incarnations for 64 transactions)\n",
+           (unsigned long long)stm_stats.incarnations);
+
+
+    // Readers must only ever see whole versions while a writer commits
+    static PageStore page_store;
+    static CPU writer;
+    static const uint8_t blank[MEMORY_SIZE];
+    _Atomic int stop = 0;
+    StoreCheck checks[2];
+    pthread_t readers[2];
+    store_init(&page_store, blank);
+    for (int r = 0; r < 2; r++) {
+        checks[r] = (StoreCheck){&page_store, r + 1, &stop, 0};
+        pthread_create(&readers[r], NULL, store_check_reader, &checks[r]);
+    }
+    const StoreVersion *base = store_open(&page_store, 0, STORE_LATEST);
+    uint64_t since = store_checkout(base, &writer);
+    for (uint64_t n = 1; n <= 2000; n++) {
+        int page = 1 + (int)(n % (MEMORY_PAGES - 1));
+        uint64_t committed;
+        int status;
+        for (int b = 0; b < 8; b++) {
+            store(&writer, (uint16_t)b, (uint8_t)(n >> (8 * b)));
+            store(&writer, (uint16_t)(page * PAGE_SIZE + b), (uint8_t)(n >> (8 * b)));
+        }
+        store(&writer, 8, (uint8_t)page);
+        while ((status = store_commit(&page_store, &writer, base, &since, &committed)) == STORE_FULL) {
+            sched_yield();  // Readers still hold the oldest slots
+        }
+        assert(status == STORE_OK && committed == n);
+        store_close(&page_store, 0);
+        base = store_open(&page_store, 0, committed);
+    }
+    atomic_store(&stop, 1);
+    for (int r = 0; r < 2; r++) {
+        pthread_join(readers[r], NULL);
+        assert(checks[r].failures == 0);
+    }
+    store_close(&page_store, 0);
+    store_free(&page_store);
+    printf("Page store readers saw only whole versions\n");
 
     return 0;  // Indicate successful program termination
 }